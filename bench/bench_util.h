@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file bench_util.h
+ *	Timing, memory and random data helpers shared by the benchmark drivers.
+ */
+
+#ifndef __BENCH_UTIL_H__
+#define __BENCH_UTIL_H__
+
+#include <chrono>
+#include <algorithm>
+#include <vector>
+
+#ifdef LINUX
+#include <sys/resource.h>
+#endif
+
+/**
+ * Small xorshift generator, the corpus must not depend on the C library's rand
+ */
+class BenchRandom
+{
+	private:
+		unsigned long long state;
+
+	public:
+		BenchRandom(unsigned long long seed) : state(seed) {}
+
+		unsigned int Next()
+		{
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			return (unsigned int) (state >> 16);
+		}
+
+		unsigned int Below(unsigned int limit)
+		{
+			return Next() % limit;
+		}
+
+		double Unit()	///< Uniform in the open interval (0, 1)
+		{
+			return (Next() + 0.5) / 4294967296.0;
+		}
+};
+
+/**
+ * @return Peak resident size of the process in KiB, 0 where it is unknown
+ */
+inline long PeakResident()
+{
+#ifdef LINUX
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+		return usage.ru_maxrss;
+#endif
+	return 0;
+}
+
+/**
+ * @return Seconds since an arbitrary start
+ */
+inline double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @return The value below which a fraction of the samples lie, samples must be sorted
+ */
+inline double Percentile(const std::vector<double>& sorted, double fraction)
+{
+	if(sorted.empty())
+		return 0;
+
+	size_t index = (size_t) (fraction * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+#endif // __BENCH_UTIL_H__
@@ -0,0 +1,550 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file host_bench.cpp
+ *	End to end benchmark of #parasite::ParasiteHost.
+ *	A host of the requested shape is generated from a fixed seed and infected,
+ *	then reading its table, extracting single items, extracting everything and
+ *	restoring the host are timed with a cold and a warm page cache. Every phase
+ *	prints one CSV or JSON line with its throughput and latency percentiles.
+ */
+
+#define parasite_static_lib
+#include "../parasite.h"
+#include "../md5_mb.h"
+#include "bench_util.h"
+
+#include <math.h>
+#include <string>
+
+#ifdef LINUX
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace parasite;
+
+/**
+ * Shape of the generated host and what to measure
+ */
+typedef struct _BENCH_OPTIONS
+{
+	unsigned int items;			///< Number of items in the host
+	const char* distribution;	///< Item size distribution, fixed, uniform or lognormal
+	unsigned int meanSize;		///< Mean item size in bytes
+	double compressibility;		///< Share of item data that repeats recent data, 0 to 1
+	BOOL compress;				///< Store items with #FEATURE_COMPRESS
+	const char* format;			///< File table format, tree, compact or mapped
+	unsigned int reads;			///< Table reads timed for each cache state
+	unsigned int samples;		///< Items extracted one by one for each cache state
+	BOOL extractAll;			///< Time ExtractAll, which writes every item to disk
+	BOOL json;					///< Print JSON lines instead of CSV
+	BOOL keep;					///< Leave the work directory behind
+	std::string dir;			///< Work directory
+} BENCH_OPTIONS;
+
+/**
+ * Timings of one phase
+ */
+typedef struct _BENCH_PHASE
+{
+	const char* name;				///< Phase measured
+	const char* cache;				///< cold, warm or n/a
+	unsigned long long bytes;		///< Item bytes handled by all operations
+	std::vector<double> latencies;	///< Seconds taken by each operation
+	BOOL passed;					///< Every operation succeeded
+} BENCH_PHASE;
+
+/**
+ * Generated items, they all point into one data pool
+ */
+typedef struct _BENCH_HOST
+{
+	std::vector<unsigned char> pool;	///< Data the items are cut from
+	std::vector<std::string> names;		///< Item paths
+	std::vector<unsigned int> offsets;	///< Start of each item in the pool
+	std::vector<unsigned int> sizes;	///< Size of each item
+	unsigned long long totalBytes;		///< Sum of the item sizes
+} BENCH_HOST;
+
+/**
+ * Size of one item drawn from the chosen distribution
+ */
+unsigned int DrawSize(const BENCH_OPTIONS& options, BenchRandom& random)
+{
+	double size = options.meanSize;
+	if(strcmp(options.distribution, "uniform") == 0)
+		size = 1 + random.Unit() * (2.0 * options.meanSize - 1);
+	else if(strcmp(options.distribution, "lognormal") == 0)
+	{
+		/*
+			Box-Muller normal, sigma 1 gives a long tail of large items
+			around a mass of small ones
+		*/
+		double normal = sqrt(-2.0 * log(random.Unit())) * cos(2.0 * M_PI * random.Unit());
+		size = exp(log((double) options.meanSize) - 0.5 + normal);
+	}
+
+	return size < 1 ? 1 : (unsigned int) size;
+}
+
+/**
+ * Builds the item pool, names and sizes. Chunks of the pool repeat a recent
+ * chunk with the chosen probability and are random otherwise.
+ */
+void MakeItems(const BENCH_OPTIONS& options, BENCH_HOST& host)
+{
+	BenchRandom random(0x486f737442656e63ULL);
+	const unsigned int chunk = 4096;
+
+	host.sizes.resize(options.items);
+	host.totalBytes = 0;
+	for(unsigned int i = 0; i < options.items; i++)
+	{
+		host.sizes[i] = DrawSize(options, random);
+		host.totalBytes += host.sizes[i];
+	}
+
+	unsigned long long poolSize = std::min(host.totalBytes, 32ULL << 20);
+	poolSize = (std::max(poolSize, (unsigned long long) chunk) + chunk - 1) / chunk * chunk;
+	host.pool.resize(poolSize);
+	for(size_t start = 0; start < poolSize; start += chunk)
+	{
+		if(start > 0 && random.Unit() < options.compressibility)
+		{
+			size_t back = chunk * (1 + random.Below((unsigned int) std::min(start / chunk, (size_t) 8)));
+			memcpy(&host.pool[start], &host.pool[start - back], chunk);
+		}
+		else
+			for(size_t i = 0; i < chunk; i++)
+				host.pool[start + i] = (unsigned char) random.Next();
+	}
+
+	host.names.resize(options.items);
+	host.offsets.resize(options.items);
+	for(unsigned int i = 0; i < options.items; i++)
+	{
+		if(host.sizes[i] > poolSize)
+		{
+			host.totalBytes -= host.sizes[i] - poolSize;
+			host.sizes[i] = (unsigned int) poolSize;
+		}
+		host.offsets[i] = random.Below((unsigned int) (poolSize - host.sizes[i] + 1));
+
+		char name[MAX_FILE_NAME];
+		sprintf(name, "d%05u/f%07u.bin", i / 100, i);
+		host.names[i] = name;
+	}
+}
+
+/**
+ * Flushes a file and drops it from the page cache, so the next read goes to disk
+ */
+void DropCache(const std::string& path)
+{
+#ifdef LINUX
+	int file = open(path.c_str(), O_RDONLY);
+	if(file < 0)
+		return;
+
+	fdatasync(file);
+	posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+	close(file);
+#endif
+}
+
+#ifdef LINUX
+int RemoveEntry(const char* path, const struct stat* info, int type, struct FTW* walk)
+{
+	return remove(path);
+}
+#endif
+
+/**
+ * Removes a directory tree
+ */
+void RemoveTree(const std::string& path)
+{
+#ifdef LINUX
+	nftw(path.c_str(), RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+#endif
+}
+
+/**
+ * Writes a plain host binary to infect
+ */
+BOOL MakeHostFile(const std::string& path)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if(file == NULL)
+		return FALSE;
+
+	BenchRandom random(0x686f7374ULL);
+	std::vector<unsigned char> data(64 << 10);
+	for(size_t i = 0; i < data.size(); i++)
+		data[i] = (unsigned char) random.Next();
+	memcpy(&data[0], "MZ", 2);
+
+	BOOL result = fwrite(&data[0], 1, data.size(), file) == data.size();
+	fclose(file);
+	return result;
+}
+
+/**
+ * Opens the host and reads its header and table, the way every client starts
+ */
+BOOL OpenHost(ParasiteHost& host, const std::string& path)
+{
+	host.SetVerboseOutput(FALSE);
+	return host.OpenReadOnly((char*) path.c_str()) && host.ReadHeader() && host.ReadFileTable();
+}
+
+BENCH_PHASE NewPhase(const char* name, const char* cache)
+{
+	BENCH_PHASE phase;
+	phase.name = name;
+	phase.cache = cache;
+	phase.bytes = 0;
+	phase.passed = TRUE;
+	return phase;
+}
+
+BENCH_PHASE TimeInfect(const BENCH_OPTIONS& options, const BENCH_HOST& items, const std::string& hostPath)
+{
+	BENCH_PHASE phase = NewPhase("infect", "n/a");
+	unsigned char format = TABLE_FORMAT_COMPACT;
+	if(strcmp(options.format, "tree") == 0)
+		format = TABLE_FORMAT_TREE;
+	else if(strcmp(options.format, "mapped") == 0)
+		format = TABLE_FORMAT_MAPPED;
+
+	double start = Now();
+	ParasiteHost host;
+	host.SetVerboseOutput(FALSE);
+	host.SetTableFormat(format);
+	phase.passed = host.Open((char*) hostPath.c_str());
+	for(unsigned int i = 0; phase.passed && i < options.items; i++)
+		phase.passed = host.AddItemFromMemory(items.names[i].c_str(), &items.pool[items.offsets[i]], items.sizes[i],
+											  options.compress ? FEATURE_COMPRESS : 0);
+	if(phase.passed)
+		phase.passed = host.Infect() && host.WriteFileTable();
+	host.Close();
+
+	phase.latencies.push_back(Now() - start);
+	phase.bytes = items.totalBytes;
+	return phase;
+}
+
+BENCH_PHASE TimeTableRead(const BENCH_OPTIONS& options, const std::string& hostPath, BOOL cold)
+{
+	BENCH_PHASE phase = NewPhase("read_table", cold ? "cold" : "warm");
+	unsigned int reads = cold ? options.reads : options.reads + 1;
+	for(unsigned int i = 0; i < reads; i++)
+	{
+		if(cold)
+			DropCache(hostPath);
+
+		double start = Now();
+		ParasiteHost host;
+		if(!OpenHost(host, hostPath))
+			phase.passed = FALSE;
+		host.Close();
+
+		/*
+			The first warm read only fills the cache
+		*/
+		if(cold || i > 0)
+			phase.latencies.push_back(Now() - start);
+	}
+
+	return phase;
+}
+
+BENCH_PHASE TimeExtract(const BENCH_OPTIONS& options, const BENCH_HOST& items, const std::string& hostPath, BOOL cold)
+{
+	BENCH_PHASE phase = NewPhase("extract", cold ? "cold" : "warm");
+	std::string out = options.dir + "/extract/";
+
+	ParasiteHost host;
+	if(!OpenHost(host, hostPath))
+	{
+		phase.passed = FALSE;
+		return phase;
+	}
+
+	/*
+		The same sample for both cache states
+	*/
+	BenchRandom random(0x53616d706c65ULL);
+	for(unsigned int i = 0; i < options.samples; i++)
+	{
+		unsigned int item = random.Below(options.items);
+		char name[MAX_FILE_NAME];
+		strcpy(name, items.names[item].c_str());
+
+		if(cold)
+			DropCache(hostPath);
+
+		double start = Now();
+		if(!host.ExtractItem(name, (char*) out.c_str()))
+			phase.passed = FALSE;
+		phase.latencies.push_back(Now() - start);
+		phase.bytes += items.sizes[item];
+	}
+
+	host.Close();
+	return phase;
+}
+
+BENCH_PHASE TimeExtractAll(const BENCH_OPTIONS& options, const BENCH_HOST& items, const std::string& hostPath, BOOL cold)
+{
+	BENCH_PHASE phase = NewPhase("extract_all", cold ? "cold" : "warm");
+	std::string out = options.dir + "/all/";
+	if(cold)
+		DropCache(hostPath);
+
+	double start = Now();
+	ParasiteHost host;
+	phase.passed = OpenHost(host, hostPath) && host.ExtractAll((char*) out.c_str());
+	host.Close();
+
+	phase.latencies.push_back(Now() - start);
+	phase.bytes = items.totalBytes;
+	return phase;
+}
+
+BENCH_PHASE TimeRestore(const BENCH_OPTIONS& options, const std::string& hostPath, BOOL cold)
+{
+	BENCH_PHASE phase = NewPhase("restore", cold ? "cold" : "warm");
+	std::string out = options.dir + "/restored.exe";
+	if(cold)
+		DropCache(hostPath);
+
+	double start = Now();
+	ParasiteHost host;
+	host.SetVerboseOutput(FALSE);
+	phase.passed = host.OpenReadOnly((char*) hostPath.c_str()) && host.ReadHeader()
+				   && host.RestoreFile((char*) out.c_str());
+	host.Close();
+
+	phase.latencies.push_back(Now() - start);
+	phase.bytes = 64 << 10;
+	return phase;
+}
+
+void PrintPhase(const BENCH_OPTIONS& options, BENCH_PHASE& phase, BOOL first)
+{
+	std::sort(phase.latencies.begin(), phase.latencies.end());
+	double total = 0;
+	for(size_t i = 0; i < phase.latencies.size(); i++)
+		total += phase.latencies[i];
+
+	double rate = total > 0 ? phase.bytes / total / 1e6 : 0;
+	double opsRate = total > 0 ? phase.latencies.size() / total : 0;
+	double p50 = Percentile(phase.latencies, 0.50) * 1e3;
+	double p90 = Percentile(phase.latencies, 0.90) * 1e3;
+	double p99 = Percentile(phase.latencies, 0.99) * 1e3;
+	double worst = phase.latencies.empty() ? 0 : phase.latencies.back() * 1e3;
+
+	if(options.json)
+	{
+		printf("{\"items\":%u,\"distribution\":\"%s\",\"mean_size\":%u,\"compressibility\":%.2f,\"compress\":%s,"
+			   "\"format\":\"%s\",\"phase\":\"%s\",\"cache\":\"%s\",\"ops\":%lu,\"bytes\":%llu,\"total_s\":%.6f,"
+			   "\"mb_s\":%.1f,\"ops_s\":%.1f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,"
+			   "\"peak_rss_kb\":%ld,\"passed\":%s}\n",
+			   options.items, options.distribution, options.meanSize, options.compressibility,
+			   options.compress ? "true" : "false", options.format, phase.name, phase.cache,
+			   (unsigned long) phase.latencies.size(), phase.bytes, total, rate, opsRate, p50, p90, p99, worst,
+			   PeakResident(), phase.passed ? "true" : "false");
+		return;
+	}
+
+	if(first)
+		printf("items,distribution,mean_size,compressibility,compress,format,phase,cache,ops,bytes,total_s,"
+			   "mb_s,ops_s,p50_ms,p90_ms,p99_ms,max_ms,peak_rss_kb,passed\n");
+	printf("%u,%s,%u,%.2f,%d,%s,%s,%s,%lu,%llu,%.6f,%.1f,%.1f,%.3f,%.3f,%.3f,%.3f,%ld,%d\n",
+		   options.items, options.distribution, options.meanSize, options.compressibility,
+		   options.compress ? 1 : 0, options.format, phase.name, phase.cache,
+		   (unsigned long) phase.latencies.size(), phase.bytes, total, rate, opsRate, p50, p90, p99, worst,
+		   PeakResident(), phase.passed ? 1 : 0);
+}
+
+void PrintBenchUsage()
+{
+	printf("Usage: host_bench [-n ITEMS] [-d DIST] [-s SIZE] [-c RATIO] [-z] [-f FORMAT]\n");
+	printf("                  [-r READS] [-e SAMPLES] [-X] [-j] [-k] [-w DIR]\n");
+	printf("  -n ITEMS    items in the host, 1 to 1000000, default 10000\n");
+	printf("  -d DIST     item sizes: fixed, uniform or lognormal, default lognormal\n");
+	printf("  -s SIZE     mean item size in bytes, default 16384\n");
+	printf("  -c RATIO    share of item data that repeats, 0 to 1, default 0.5\n");
+	printf("  -z          compress items\n");
+	printf("  -f FORMAT   file table format: tree, compact or mapped, default compact\n");
+	printf("  -r READS    table reads timed per cache state, default 20\n");
+	printf("  -e SAMPLES  single item extractions timed per cache state, default 200\n");
+	printf("  -X          skip ExtractAll, which writes every item to disk\n");
+	printf("  -j          print JSON lines instead of CSV\n");
+	printf("  -k          keep the work directory\n");
+	printf("  -w DIR      work directory, default a new one in /tmp\n");
+}
+
+/**
+ * Application entry
+ */
+int main(int argc, char** argv)
+{
+	BENCH_OPTIONS options;
+	options.items = 10000;
+	options.distribution = "lognormal";
+	options.meanSize = 16384;
+	options.compressibility = 0.5;
+	options.compress = false;
+	options.format = "compact";
+	options.reads = 20;
+	options.samples = 200;
+	options.extractAll = true;
+	options.json = false;
+	options.keep = false;
+
+	for(int i = 1; i < argc; i++)
+	{
+		BOOL hasValue = (i + 1 < argc);
+		if(strcmp(argv[i], "-n") == 0 && hasValue)
+			options.items = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-d") == 0 && hasValue)
+			options.distribution = argv[++i];
+		else if(strcmp(argv[i], "-s") == 0 && hasValue)
+			options.meanSize = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-c") == 0 && hasValue)
+			options.compressibility = atof(argv[++i]);
+		else if(strcmp(argv[i], "-z") == 0)
+			options.compress = true;
+		else if(strcmp(argv[i], "-f") == 0 && hasValue)
+			options.format = argv[++i];
+		else if(strcmp(argv[i], "-r") == 0 && hasValue)
+			options.reads = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-e") == 0 && hasValue)
+			options.samples = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-X") == 0)
+			options.extractAll = false;
+		else if(strcmp(argv[i], "-j") == 0)
+			options.json = true;
+		else if(strcmp(argv[i], "-k") == 0)
+			options.keep = true;
+		else if(strcmp(argv[i], "-w") == 0 && hasValue)
+			options.dir = argv[++i];
+		else
+		{
+			PrintBenchUsage();
+			return 1;
+		}
+	}
+
+	BOOL validDistribution = strcmp(options.distribution, "fixed") == 0 || strcmp(options.distribution, "uniform") == 0
+							 || strcmp(options.distribution, "lognormal") == 0;
+	BOOL validFormat = strcmp(options.format, "tree") == 0 || strcmp(options.format, "compact") == 0
+					   || strcmp(options.format, "mapped") == 0;
+	if(options.items < 1 || options.items > 1000000 || options.meanSize < 1 || !validDistribution || !validFormat
+	   || options.compressibility < 0 || options.compressibility > 1)
+	{
+		PrintBenchUsage();
+		return 1;
+	}
+
+	/*
+		Item hashes are only comparable across hosts when every multi-buffer
+		MD5 engine agrees with md5(), so check them before timing anything
+	*/
+	if(md5_mb_self_test(0) != 0)
+	{
+		fprintf(stderr, "Multi-buffer MD5 self test failed\n");
+		return 1;
+	}
+
+	/*
+		Only a directory made here is removed whole
+	*/
+	BOOL ownDir = options.dir.empty();
+#ifdef LINUX
+	if(ownDir)
+	{
+		char dir[] = "/tmp/parasite_bench.XXXXXX";
+		if(mkdtemp(dir) == NULL)
+		{
+			fprintf(stderr, "Could not create a work directory\n");
+			return 1;
+		}
+		options.dir = dir;
+	}
+	else
+		mkdir(options.dir.c_str(), 0755);
+#else
+	if(options.dir.empty())
+		options.dir = ".";
+#endif
+
+	std::string hostPath = options.dir + "/host.exe";
+	if(!MakeHostFile(hostPath))
+	{
+		fprintf(stderr, "Could not write %s\n", hostPath.c_str());
+		return 1;
+	}
+
+	BENCH_HOST items;
+	MakeItems(options, items);
+
+	std::vector<BENCH_PHASE> phases;
+	phases.push_back(TimeInfect(options, items, hostPath));
+	for(int cold = 1; cold >= 0; cold--)
+	{
+		phases.push_back(TimeTableRead(options, hostPath, cold));
+		if(options.samples > 0)
+			phases.push_back(TimeExtract(options, items, hostPath, cold));
+		if(options.extractAll)
+			phases.push_back(TimeExtractAll(options, items, hostPath, cold));
+		phases.push_back(TimeRestore(options, hostPath, cold));
+	}
+
+	BOOL passed = TRUE;
+	for(size_t i = 0; i < phases.size(); i++)
+	{
+		PrintPhase(options, phases[i], i == 0);
+		if(!phases[i].passed)
+			passed = FALSE;
+	}
+
+	if(!options.keep && ownDir)
+		RemoveTree(options.dir);
+	else if(!options.keep)
+	{
+		RemoveTree(options.dir + "/extract");
+		RemoveTree(options.dir + "/all");
+		remove(hostPath.c_str());
+		remove((options.dir + "/restored.exe").c_str());
+	}
+
+	if(!passed)
+	{
+		fprintf(stderr, "At least one operation failed\n");
+		return 1;
+	}
+
+	return 0;
+}
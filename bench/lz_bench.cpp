@@ -0,0 +1,394 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file lz_bench.cpp
+ *	Benchmark of the LZ codec in #lz.h.
+ *	A synthetic corpus is generated from a fixed seed, so every revision is
+ *	measured on the same bytes. Each codec is run on whole files and on blocks
+ *	of #BLOCK_SIZE the way hosts store items, and one line per run is printed
+ *	as CSV or JSON so results of two revisions can be compared with a script.
+ */
+
+#define parasite_static_lib
+#include "../parasite.h"
+#include "../lz.h"
+#include "bench_util.h"
+
+using namespace parasite;
+
+/**
+ * One file of the corpus
+ */
+typedef struct _BENCH_FILE
+{
+	const char* name;					///< Kind of data
+	std::vector<unsigned char> data;	///< File contents
+} BENCH_FILE;
+
+/**
+ * English like text, words drawn with a skewed distribution
+ */
+void MakeText(std::vector<unsigned char>& out, size_t size, BenchRandom& random)
+{
+	static const char* words[] = {
+		"the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with",
+		"be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which",
+		"but", "have", "an", "had", "they", "you", "were", "their", "one", "all", "we",
+		"host", "parasite", "file", "table", "item", "offset", "block", "compress", "stream",
+		"directory", "memory", "binary", "header", "version", "format", "entry", "index"
+	};
+	const unsigned int count = sizeof(words) / sizeof(words[0]);
+
+	unsigned int sentence = 0;
+	while(out.size() < size)
+	{
+		/*
+			Squaring a uniform pick favours the front of the list
+		*/
+		unsigned int pick = random.Below(count);
+		pick = pick * pick / count;
+		const char* word = words[pick];
+		out.insert(out.end(), word, word + strlen(word));
+
+		if(++sentence >= 8 + random.Below(12))
+		{
+			out.push_back('.');
+			out.push_back(random.Below(4) ? ' ' : '\n');
+			sentence = 0;
+		}
+		else
+			out.push_back(' ');
+	}
+	out.resize(size);
+}
+
+/**
+ * Arrays of fixed size records, like saved game or asset data
+ */
+void MakeBinary(std::vector<unsigned char>& out, size_t size, BenchRandom& random)
+{
+	unsigned int id = 1000;
+	float position[3] = {0, 0, 0};
+	while(out.size() < size)
+	{
+		unsigned char record[32];
+		memset(record, 0, sizeof(record));
+
+		id += 1 + random.Below(3);
+		for(int i = 0; i < 3; i++)
+			position[i] += (float) random.Below(100) / 10.0f;
+		unsigned short kind = (unsigned short) random.Below(6);
+		unsigned int flags = random.Below(4) ? 0x11 : 0x13;
+
+		memcpy(record, &id, sizeof(id));
+		memcpy(record + 4, position, sizeof(position));
+		memcpy(record + 16, &kind, sizeof(kind));
+		memcpy(record + 20, &flags, sizeof(flags));
+		out.insert(out.end(), record, record + sizeof(record));
+	}
+	out.resize(size);
+}
+
+/**
+ * Data that does not compress
+ */
+void MakeRandom(std::vector<unsigned char>& out, size_t size, BenchRandom& random)
+{
+	out.resize(size);
+	for(size_t i = 0; i < size; i++)
+		out[i] = (unsigned char) random.Next();
+}
+
+/**
+ * An executable image: a header, a code section built from common x86
+ * instruction patterns, a string table and zero padding between sections
+ */
+void MakeExecutable(std::vector<unsigned char>& out, size_t size, BenchRandom& random)
+{
+	static const unsigned char prologue[] = { 0x55, 0x8b, 0xec, 0x83, 0xec };	// push ebp; mov ebp, esp; sub esp, imm8
+	static const unsigned char epilogue[] = { 0x8b, 0xe5, 0x5d, 0xc3 };			// mov esp, ebp; pop ebp; ret
+	static const char* strings[] = { "kernel32.dll", "GetProcAddress", "LoadLibraryA", "CreateFileA",
+									 "ReadFile", "WriteFile", "CloseHandle", "VirtualAlloc", "user32.dll" };
+
+	out.assign(1024, 0);
+	memcpy(&out[0], "MZ", 2);
+	memcpy(&out[128], "PE\0\0", 4);
+
+	size_t codeEnd = size * 3 / 4;
+	while(out.size() < codeEnd)
+	{
+		out.insert(out.end(), prologue, prologue + sizeof(prologue));
+		out.push_back((unsigned char) (random.Below(8) * 4));
+
+		unsigned int instructions = 4 + random.Below(24);
+		for(unsigned int i = 0; i < instructions; i++)
+		{
+			unsigned int value = random.Below(4) ? random.Below(256) : random.Next();
+			switch(random.Below(4))
+			{
+				case 0:	// call rel32
+					out.push_back(0xe8);
+					break;
+				case 1:	// mov eax, imm32
+					out.push_back(0xb8);
+					break;
+				case 2:	// mov [ebp+disp8], eax
+					out.push_back(0x89);
+					out.push_back(0x45);
+					out.push_back((unsigned char) (0x100 - 4 * (1 + random.Below(8))));
+					continue;
+				default:	// push imm32
+					out.push_back(0x68);
+					break;
+			}
+			for(int b = 0; b < 4; b++)
+				out.push_back((unsigned char) (value >> (8 * b)));
+		}
+		out.insert(out.end(), epilogue, epilogue + sizeof(epilogue));
+
+		while(out.size() % 16)
+			out.push_back(0xcc);
+	}
+
+	out.resize((out.size() + 4095) & ~4095, 0);
+	while(out.size() < size)
+	{
+		const char* text = strings[random.Below(sizeof(strings) / sizeof(strings[0]))];
+		out.insert(out.end(), text, text + strlen(text) + 1);
+	}
+	out.resize(size);
+}
+
+/**
+ * Builds the corpus, the same for every run of the same size
+ */
+void MakeCorpus(std::vector<BENCH_FILE>& corpus, size_t size)
+{
+	BenchRandom random(0x5061726173697465ULL);
+	const char* names[] = { "text", "binary", "zeros", "random", "exe" };
+
+	corpus.resize(5);
+	for(int i = 0; i < 5; i++)
+		corpus[i].name = names[i];
+
+	MakeText(corpus[0].data, size, random);
+	MakeBinary(corpus[1].data, size, random);
+	corpus[2].data.assign(size, 0);
+	MakeRandom(corpus[3].data, size, random);
+	MakeExecutable(corpus[4].data, size, random);
+}
+
+/**
+ * Result of one codec on one file
+ */
+typedef struct _BENCH_RESULT
+{
+	const char* file;		///< Corpus file
+	const char* codec;		///< Compressor used
+	unsigned int block;		///< Block size, the file size for whole files
+	size_t original;		///< Bytes in
+	size_t compressed;		///< Bytes out, blocks that do not shrink counted raw
+	double compressRate;	///< MB/s of input compressed
+	double decompressRate;	///< MB/s of output decompressed
+	size_t workBytes;		///< Buffers the codec needs for one block
+	long peakKb;			///< Peak resident size of the process after the run
+	BOOL verified;			///< Round trip gave the original data back
+} BENCH_RESULT;
+
+/**
+ * Compresses and decompresses a file block by block until minTime has passed,
+ * keeping the fastest pass of each direction
+ */
+BENCH_RESULT RunCodec(const BENCH_FILE& file, const char* codec, unsigned int block, double minTime)
+{
+	BENCH_RESULT result;
+	result.file = file.name;
+	result.codec = codec;
+	result.block = block;
+	result.original = file.data.size();
+	result.compressed = 0;
+	result.verified = TRUE;
+
+	BOOL fast = (strcmp(codec, "fast") == 0);
+	size_t size = file.data.size();
+	unsigned int blocks = (unsigned int) ((size + block - 1) / block);
+	unsigned int bound = (block * 104 + 50) / 100 + 384;
+
+	std::vector<unsigned char> packed((size_t) blocks * bound);
+	std::vector<unsigned int> packedSize(blocks);
+	std::vector<unsigned char> unpacked(size + 1);
+	std::vector<unsigned int> work(fast ? 65536 + block : 1);
+	result.workBytes = bound + (fast ? work.size() * sizeof(unsigned int) : 0);
+
+	unsigned char* in = (unsigned char*) &file.data[0];
+
+	double best = 0;
+	double spent = 0;
+	do
+	{
+		double start = Now();
+		for(unsigned int i = 0; i < blocks; i++)
+		{
+			unsigned int raw = (unsigned int) std::min((size_t) block, size - (size_t) i * block);
+			unsigned char* out = &packed[(size_t) i * bound];
+			packedSize[i] = fast ? LZ_CompressFast(in + (size_t) i * block, out, raw, &work[0])
+								 : LZ_Compress(in + (size_t) i * block, out, raw);
+		}
+		double elapsed = Now() - start;
+		spent += elapsed;
+		if(best == 0 || elapsed < best)
+			best = elapsed;
+	}
+	while(spent < minTime);
+	result.compressRate = size / best / 1e6;
+
+	/*
+		Hosts keep blocks that do not shrink raw, count them the same way
+	*/
+	for(unsigned int i = 0; i < blocks; i++)
+	{
+		unsigned int raw = (unsigned int) std::min((size_t) block, size - (size_t) i * block);
+		result.compressed += std::min(packedSize[i], raw);
+	}
+
+	best = 0;
+	spent = 0;
+	do
+	{
+		double start = Now();
+		for(unsigned int i = 0; i < blocks; i++)
+		{
+			unsigned int raw = (unsigned int) std::min((size_t) block, size - (size_t) i * block);
+			if(packedSize[i] >= raw)
+				memcpy(&unpacked[(size_t) i * block], in + (size_t) i * block, raw);
+			else if(LZ_UncompressSafe(&packed[(size_t) i * bound], &unpacked[(size_t) i * block], packedSize[i], raw) != (int) raw)
+				result.verified = FALSE;
+		}
+		double elapsed = Now() - start;
+		spent += elapsed;
+		if(best == 0 || elapsed < best)
+			best = elapsed;
+	}
+	while(spent < minTime);
+	result.decompressRate = size / best / 1e6;
+
+	if(memcmp(&unpacked[0], in, size) != 0)
+		result.verified = FALSE;
+
+	result.peakKb = PeakResident();
+	return result;
+}
+
+void PrintResult(const BENCH_RESULT& result, BOOL json, BOOL first)
+{
+	double ratio = result.original ? (double) result.compressed / result.original : 0;
+	if(json)
+	{
+		printf("{\"file\":\"%s\",\"codec\":\"%s\",\"block\":%u,\"original\":%lu,\"compressed\":%lu,"
+			   "\"ratio\":%.4f,\"compress_mbs\":%.1f,\"decompress_mbs\":%.1f,\"work_bytes\":%lu,"
+			   "\"peak_rss_kb\":%ld,\"verified\":%s}\n",
+			   result.file, result.codec, result.block, (unsigned long) result.original,
+			   (unsigned long) result.compressed, ratio, result.compressRate, result.decompressRate,
+			   (unsigned long) result.workBytes, result.peakKb, result.verified ? "true" : "false");
+		return;
+	}
+
+	if(first)
+		printf("file,codec,block,original,compressed,ratio,compress_mbs,decompress_mbs,work_bytes,peak_rss_kb,verified\n");
+	printf("%s,%s,%u,%lu,%lu,%.4f,%.1f,%.1f,%lu,%ld,%d\n",
+		   result.file, result.codec, result.block, (unsigned long) result.original,
+		   (unsigned long) result.compressed, ratio, result.compressRate, result.decompressRate,
+		   (unsigned long) result.workBytes, result.peakKb, result.verified ? 1 : 0);
+}
+
+void PrintBenchUsage()
+{
+	printf("Usage: lz_bench [-s SIZE] [-t SECONDS] [-j] [-q]\n");
+	printf("  -s SIZE     bytes in each corpus file, default 262144\n");
+	printf("  -t SECONDS  least time spent on each measurement, default 0.2\n");
+	printf("  -j          print JSON lines instead of CSV\n");
+	printf("  -q          leave out the slow LZ_Compress codec\n");
+}
+
+/**
+ * Application entry
+ */
+int main(int argc, char** argv)
+{
+	size_t size = 256 << 10;
+	double minTime = 0.2;
+	BOOL json = FALSE;
+	BOOL quick = FALSE;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			size = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			minTime = atof(argv[++i]);
+		else if(strcmp(argv[i], "-j") == 0)
+			json = true;
+		else if(strcmp(argv[i], "-q") == 0)
+			quick = true;
+		else
+		{
+			PrintBenchUsage();
+			return 1;
+		}
+	}
+
+	if(size == 0)
+	{
+		PrintBenchUsage();
+		return 1;
+	}
+
+	std::vector<BENCH_FILE> corpus;
+	MakeCorpus(corpus, size);
+
+	/*
+		Whole files show the codec itself, BLOCK_SIZE blocks show what hosts get
+	*/
+	const char* codecs[] = { "fast", "lz" };
+	unsigned int blocks[] = { (unsigned int) size, BLOCK_SIZE };
+	int codecCount = quick ? 1 : 2;
+	int blockCount = (size > BLOCK_SIZE) ? 2 : 1;
+
+	BOOL first = TRUE;
+	BOOL verified = TRUE;
+	for(unsigned int f = 0; f < corpus.size(); f++)
+		for(int c = 0; c < codecCount; c++)
+			for(int b = 0; b < blockCount; b++)
+			{
+				BENCH_RESULT result = RunCodec(corpus[f], codecs[c], blocks[b], minTime);
+				PrintResult(result, json, first);
+				fflush(stdout);
+				first = FALSE;
+				if(!result.verified)
+					verified = FALSE;
+			}
+
+	if(!verified)
+	{
+		fprintf(stderr, "Round trip failed for at least one run\n");
+		return 1;
+	}
+
+	return 0;
+}
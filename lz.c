@@ -75,6 +75,9 @@
 *
 * Marcus Geelnard
 * marcus.geelnard at home.se
+*-------------------------------------------------------------------------
+* Altered for Parasite: added LZ_UncompressSafe(), a decoder that checks
+* every read and write against the buffer sizes.
 *************************************************************************/
 
 
@@ -173,6 +176,36 @@ static int _LZ_ReadVarSize( unsigned int * x, unsigned char * buf )
 }
 
 
+/*************************************************************************
+* _LZ_ReadVarSizeSafe() - Like _LZ_ReadVarSize(), but never reads more
+* than size bytes. Returns zero if the value is truncated or too long.
+*************************************************************************/
+
+static int _LZ_ReadVarSizeSafe( unsigned int * x, unsigned char * buf,
+    unsigned int size )
+{
+    unsigned int y, b, num_bytes;
+
+    y = 0;
+    num_bytes = 0;
+    do
+    {
+        if( (num_bytes >= size) || (num_bytes >= 5) )
+        {
+            return 0;
+        }
+        b = (unsigned int) (*buf ++);
+        y = (y << 7) | (b & 0x0000007f);
+        ++ num_bytes;
+    }
+    while( b & 0x00000080 );
+
+    *x = y;
+
+    return num_bytes;
+}
+
+
 
 /*************************************************************************
 *                            PUBLIC FUNCTIONS                            *
@@ -538,3 +571,100 @@ void LZ_Uncompress( unsigned char *in, unsigned char *out,
     }
     while( inpos < insize );
 }
+
+
+/*************************************************************************
+* LZ_UncompressSafe() - Uncompress a block of data using an LZ77 decoder,
+* checking every access against the buffer sizes so that corrupt input
+* can not write outside of the output buffer.
+*  in      - Input (compressed) buffer.
+*  out     - Output (uncompressed) buffer.
+*  insize  - Number of input bytes.
+*  outsize - Size of the output buffer.
+* The function returns the number of bytes written to out, or -1 if the
+* input is malformed or does not fit in the output buffer.
+*************************************************************************/
+
+int LZ_UncompressSafe( unsigned char *in, unsigned char *out,
+    unsigned int insize, unsigned int outsize )
+{
+    unsigned char marker, symbol;
+    unsigned int  i, inpos, outpos, length, offset;
+    int           num_bytes;
+
+    /* Do we have anything to uncompress? */
+    if( insize < 1 )
+    {
+        return 0;
+    }
+
+    /* Get marker symbol from input stream */
+    marker = in[ 0 ];
+    inpos = 1;
+
+    /* Main decompression loop */
+    outpos = 0;
+    while( inpos < insize )
+    {
+        symbol = in[ inpos ++ ];
+        if( symbol == marker )
+        {
+            /* We had a marker byte */
+            if( inpos >= insize )
+            {
+                return -1;
+            }
+            if( in[ inpos ] == 0 )
+            {
+                /* It was a single occurrence of the marker byte */
+                if( outpos >= outsize )
+                {
+                    return -1;
+                }
+                out[ outpos ++ ] = marker;
+                ++ inpos;
+            }
+            else
+            {
+                /* Extract true length and offset */
+                num_bytes = _LZ_ReadVarSizeSafe( &length, &in[ inpos ], insize - inpos );
+                if( num_bytes == 0 )
+                {
+                    return -1;
+                }
+                inpos += num_bytes;
+                num_bytes = _LZ_ReadVarSizeSafe( &offset, &in[ inpos ], insize - inpos );
+                if( num_bytes == 0 )
+                {
+                    return -1;
+                }
+                inpos += num_bytes;
+
+                /* The reference must point inside the data written so far */
+                if( (offset == 0) || (offset > outpos) ||
+                    (length > outsize - outpos) )
+                {
+                    return -1;
+                }
+
+                /* Copy corresponding data from history window */
+                for( i = 0; i < length; ++ i )
+                {
+                    out[ outpos ] = out[ outpos - offset ];
+                    ++ outpos;
+                }
+            }
+        }
+        else
+        {
+            /* No marker, plain copy */
+            if( outpos >= outsize )
+            {
+                return -1;
+            }
+            out[ outpos ++ ] = symbol;
+        }
+    }
+
+    return (int) outpos;
+}
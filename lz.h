@@ -44,6 +44,7 @@ extern "C" {
 int LZ_Compress( unsigned char *in, unsigned char *out, unsigned int insize );
 int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize, unsigned int *work );
 void LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize );
+int LZ_UncompressSafe( unsigned char *in, unsigned char *out, unsigned int insize, unsigned int outsize );
 
 #ifndef LINUX
 #ifdef __cplusplus
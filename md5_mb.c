@@ -0,0 +1,571 @@
+/*
+ *  Multi-buffer MD5 implementation
+ *
+ *  Each SIMD lane carries the state of an independent MD5 stream, so 4
+ *  (SSE2) or 8 (AVX2) buffers are compressed with one pass of the round
+ *  function. The lane kernels perform exactly the RFC 1321 rounds used by
+ *  md5.c, the results are bit-identical to md5().
+ *
+ *  The engine is selected at runtime from the features of the CPU. Builds
+ *  for other architectures fall back to calling md5() for each buffer.
+ */
+
+#ifndef _CRT_SECURE_NO_DEPRECATE
+#define _CRT_SECURE_NO_DEPRECATE 1
+#endif
+
+#include <string.h>
+#include <stdio.h>
+
+#include "md5.h"
+#include "md5_mb.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MD5_MB_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define MD5_MB_TARGET(t) __attribute__((target(t)))
+#else
+#define MD5_MB_TARGET(t)
+#endif
+
+/*
+ * Lane kernel: one 64 byte block for every lane, state is stored
+ * transposed (state[word][lane]) so a row loads straight into a register.
+ */
+typedef void (*md5_mb_kernel)( unsigned int state[4][MD5_MB_MAX_LANES],
+                               const unsigned char *block[MD5_MB_MAX_LANES] );
+
+#define MB_LOAD32(p,k)                                  \
+    (int) ( ( (unsigned int) (p)[4 * (k)    ]       )   \
+          | ( (unsigned int) (p)[4 * (k) + 1] <<  8 )   \
+          | ( (unsigned int) (p)[4 * (k) + 2] << 16 )   \
+          | ( (unsigned int) (p)[4 * (k) + 3] << 24 ) )
+
+#define MB_PUT32(n,b,i)                                 \
+{                                                       \
+    (b)[(i)    ] = (unsigned char) ( (n)       );       \
+    (b)[(i) + 1] = (unsigned char) ( (n) >>  8 );       \
+    (b)[(i) + 2] = (unsigned char) ( (n) >> 16 );       \
+    (b)[(i) + 3] = (unsigned char) ( (n) >> 24 );       \
+}
+
+#ifdef MD5_MB_X86
+
+/*
+ * The four MD5 round functions and the step macro, written in terms of
+ * V_* vector operations which every kernel defines for its register type.
+ */
+#define MB_F(x,y,z) V_XOR(z, V_AND(x, V_XOR(y, z)))
+#define MB_G(x,y,z) V_XOR(y, V_AND(z, V_XOR(x, y)))
+#define MB_H(x,y,z) V_XOR(x, V_XOR(y, z))
+#define MB_I(x,y,z) V_XOR(y, V_OR(x, V_NOT(z)))
+
+#define MB_P(f,a,b,c,d,k,s,t)                                       \
+{                                                                   \
+    a = V_ADD(a, V_ADD(f(b,c,d), V_ADD(X[k], V_SET1((int) t))));    \
+    a = V_ADD(V_ROTL(a,s), b);                                      \
+}
+
+#define MD5_MB_ROUNDS                                   \
+    MB_P( MB_F, A, B, C, D,  0,  7, 0xD76AA478 );       \
+    MB_P( MB_F, D, A, B, C,  1, 12, 0xE8C7B756 );       \
+    MB_P( MB_F, C, D, A, B,  2, 17, 0x242070DB );       \
+    MB_P( MB_F, B, C, D, A,  3, 22, 0xC1BDCEEE );       \
+    MB_P( MB_F, A, B, C, D,  4,  7, 0xF57C0FAF );       \
+    MB_P( MB_F, D, A, B, C,  5, 12, 0x4787C62A );       \
+    MB_P( MB_F, C, D, A, B,  6, 17, 0xA8304613 );       \
+    MB_P( MB_F, B, C, D, A,  7, 22, 0xFD469501 );       \
+    MB_P( MB_F, A, B, C, D,  8,  7, 0x698098D8 );       \
+    MB_P( MB_F, D, A, B, C,  9, 12, 0x8B44F7AF );       \
+    MB_P( MB_F, C, D, A, B, 10, 17, 0xFFFF5BB1 );       \
+    MB_P( MB_F, B, C, D, A, 11, 22, 0x895CD7BE );       \
+    MB_P( MB_F, A, B, C, D, 12,  7, 0x6B901122 );       \
+    MB_P( MB_F, D, A, B, C, 13, 12, 0xFD987193 );       \
+    MB_P( MB_F, C, D, A, B, 14, 17, 0xA679438E );       \
+    MB_P( MB_F, B, C, D, A, 15, 22, 0x49B40821 );       \
+                                                        \
+    MB_P( MB_G, A, B, C, D,  1,  5, 0xF61E2562 );       \
+    MB_P( MB_G, D, A, B, C,  6,  9, 0xC040B340 );       \
+    MB_P( MB_G, C, D, A, B, 11, 14, 0x265E5A51 );       \
+    MB_P( MB_G, B, C, D, A,  0, 20, 0xE9B6C7AA );       \
+    MB_P( MB_G, A, B, C, D,  5,  5, 0xD62F105D );       \
+    MB_P( MB_G, D, A, B, C, 10,  9, 0x02441453 );       \
+    MB_P( MB_G, C, D, A, B, 15, 14, 0xD8A1E681 );       \
+    MB_P( MB_G, B, C, D, A,  4, 20, 0xE7D3FBC8 );       \
+    MB_P( MB_G, A, B, C, D,  9,  5, 0x21E1CDE6 );       \
+    MB_P( MB_G, D, A, B, C, 14,  9, 0xC33707D6 );       \
+    MB_P( MB_G, C, D, A, B,  3, 14, 0xF4D50D87 );       \
+    MB_P( MB_G, B, C, D, A,  8, 20, 0x455A14ED );       \
+    MB_P( MB_G, A, B, C, D, 13,  5, 0xA9E3E905 );       \
+    MB_P( MB_G, D, A, B, C,  2,  9, 0xFCEFA3F8 );       \
+    MB_P( MB_G, C, D, A, B,  7, 14, 0x676F02D9 );       \
+    MB_P( MB_G, B, C, D, A, 12, 20, 0x8D2A4C8A );       \
+                                                        \
+    MB_P( MB_H, A, B, C, D,  5,  4, 0xFFFA3942 );       \
+    MB_P( MB_H, D, A, B, C,  8, 11, 0x8771F681 );       \
+    MB_P( MB_H, C, D, A, B, 11, 16, 0x6D9D6122 );       \
+    MB_P( MB_H, B, C, D, A, 14, 23, 0xFDE5380C );       \
+    MB_P( MB_H, A, B, C, D,  1,  4, 0xA4BEEA44 );       \
+    MB_P( MB_H, D, A, B, C,  4, 11, 0x4BDECFA9 );       \
+    MB_P( MB_H, C, D, A, B,  7, 16, 0xF6BB4B60 );       \
+    MB_P( MB_H, B, C, D, A, 10, 23, 0xBEBFBC70 );       \
+    MB_P( MB_H, A, B, C, D, 13,  4, 0x289B7EC6 );       \
+    MB_P( MB_H, D, A, B, C,  0, 11, 0xEAA127FA );       \
+    MB_P( MB_H, C, D, A, B,  3, 16, 0xD4EF3085 );       \
+    MB_P( MB_H, B, C, D, A,  6, 23, 0x04881D05 );       \
+    MB_P( MB_H, A, B, C, D,  9,  4, 0xD9D4D039 );       \
+    MB_P( MB_H, D, A, B, C, 12, 11, 0xE6DB99E5 );       \
+    MB_P( MB_H, C, D, A, B, 15, 16, 0x1FA27CF8 );       \
+    MB_P( MB_H, B, C, D, A,  2, 23, 0xC4AC5665 );       \
+                                                        \
+    MB_P( MB_I, A, B, C, D,  0,  6, 0xF4292244 );       \
+    MB_P( MB_I, D, A, B, C,  7, 10, 0x432AFF97 );       \
+    MB_P( MB_I, C, D, A, B, 14, 15, 0xAB9423A7 );       \
+    MB_P( MB_I, B, C, D, A,  5, 21, 0xFC93A039 );       \
+    MB_P( MB_I, A, B, C, D, 12,  6, 0x655B59C3 );       \
+    MB_P( MB_I, D, A, B, C,  3, 10, 0x8F0CCC92 );       \
+    MB_P( MB_I, C, D, A, B, 10, 15, 0xFFEFF47D );       \
+    MB_P( MB_I, B, C, D, A,  1, 21, 0x85845DD1 );       \
+    MB_P( MB_I, A, B, C, D,  8,  6, 0x6FA87E4F );       \
+    MB_P( MB_I, D, A, B, C, 15, 10, 0xFE2CE6E0 );       \
+    MB_P( MB_I, C, D, A, B,  6, 15, 0xA3014314 );       \
+    MB_P( MB_I, B, C, D, A, 13, 21, 0x4E0811A1 );       \
+    MB_P( MB_I, A, B, C, D,  4,  6, 0xF7537E82 );       \
+    MB_P( MB_I, D, A, B, C, 11, 10, 0xBD3AF235 );       \
+    MB_P( MB_I, C, D, A, B,  2, 15, 0x2AD7D2BB );       \
+    MB_P( MB_I, B, C, D, A,  9, 21, 0xEB86D391 );
+
+/*
+ * SSE2 kernel, 4 lanes
+ */
+#define V_ADD(a,b)  _mm_add_epi32(a, b)
+#define V_XOR(a,b)  _mm_xor_si128(a, b)
+#define V_AND(a,b)  _mm_and_si128(a, b)
+#define V_OR(a,b)   _mm_or_si128(a, b)
+#define V_NOT(a)    _mm_xor_si128(a, _mm_set1_epi32(-1))
+#define V_SET1(a)   _mm_set1_epi32(a)
+#define V_ROTL(a,n) _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+
+MD5_MB_TARGET("sse2")
+static void md5_mb_sse2( unsigned int state[4][MD5_MB_MAX_LANES],
+                         const unsigned char *block[MD5_MB_MAX_LANES] )
+{
+    __m128i X[16], A, B, C, D, AA, BB, CC, DD;
+    int k;
+
+    for( k = 0; k < 16; k++ )
+        X[k] = _mm_set_epi32( MB_LOAD32( block[3], k ), MB_LOAD32( block[2], k ),
+                              MB_LOAD32( block[1], k ), MB_LOAD32( block[0], k ) );
+
+    AA = A = _mm_loadu_si128( (__m128i *) state[0] );
+    BB = B = _mm_loadu_si128( (__m128i *) state[1] );
+    CC = C = _mm_loadu_si128( (__m128i *) state[2] );
+    DD = D = _mm_loadu_si128( (__m128i *) state[3] );
+
+    MD5_MB_ROUNDS
+
+    _mm_storeu_si128( (__m128i *) state[0], _mm_add_epi32( A, AA ) );
+    _mm_storeu_si128( (__m128i *) state[1], _mm_add_epi32( B, BB ) );
+    _mm_storeu_si128( (__m128i *) state[2], _mm_add_epi32( C, CC ) );
+    _mm_storeu_si128( (__m128i *) state[3], _mm_add_epi32( D, DD ) );
+}
+
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_SET1
+#undef V_ROTL
+
+/*
+ * AVX2 kernel, 8 lanes
+ */
+#define V_ADD(a,b)  _mm256_add_epi32(a, b)
+#define V_XOR(a,b)  _mm256_xor_si256(a, b)
+#define V_AND(a,b)  _mm256_and_si256(a, b)
+#define V_OR(a,b)   _mm256_or_si256(a, b)
+#define V_NOT(a)    _mm256_xor_si256(a, _mm256_set1_epi32(-1))
+#define V_SET1(a)   _mm256_set1_epi32(a)
+#define V_ROTL(a,n) _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+
+MD5_MB_TARGET("avx2")
+static void md5_mb_avx2( unsigned int state[4][MD5_MB_MAX_LANES],
+                         const unsigned char *block[MD5_MB_MAX_LANES] )
+{
+    __m256i X[16], A, B, C, D, AA, BB, CC, DD;
+    int k;
+
+    for( k = 0; k < 16; k++ )
+        X[k] = _mm256_set_epi32( MB_LOAD32( block[7], k ), MB_LOAD32( block[6], k ),
+                                 MB_LOAD32( block[5], k ), MB_LOAD32( block[4], k ),
+                                 MB_LOAD32( block[3], k ), MB_LOAD32( block[2], k ),
+                                 MB_LOAD32( block[1], k ), MB_LOAD32( block[0], k ) );
+
+    AA = A = _mm256_loadu_si256( (__m256i *) state[0] );
+    BB = B = _mm256_loadu_si256( (__m256i *) state[1] );
+    CC = C = _mm256_loadu_si256( (__m256i *) state[2] );
+    DD = D = _mm256_loadu_si256( (__m256i *) state[3] );
+
+    MD5_MB_ROUNDS
+
+    _mm256_storeu_si256( (__m256i *) state[0], _mm256_add_epi32( A, AA ) );
+    _mm256_storeu_si256( (__m256i *) state[1], _mm256_add_epi32( B, BB ) );
+    _mm256_storeu_si256( (__m256i *) state[2], _mm256_add_epi32( C, CC ) );
+    _mm256_storeu_si256( (__m256i *) state[3], _mm256_add_epi32( D, DD ) );
+}
+
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_SET1
+#undef V_ROTL
+
+static int md5_mb_cpu_sse2( void )
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return( 1 );
+#elif defined(__GNUC__)
+    __builtin_cpu_init();
+    return( __builtin_cpu_supports( "sse2" ) );
+#else
+    int info[4];
+    __cpuid( info, 1 );
+    return( ( info[3] & ( 1 << 26 ) ) != 0 );
+#endif
+}
+
+static int md5_mb_cpu_avx2( void )
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return( __builtin_cpu_supports( "avx2" ) );
+#else
+    int info[4];
+    __cpuid( info, 1 );
+    if( ( info[2] & ( 1 << 27 ) ) == 0 || ( info[2] & ( 1 << 28 ) ) == 0 )
+        return( 0 );
+    if( ( _xgetbv( 0 ) & 6 ) != 6 )
+        return( 0 );
+    __cpuidex( info, 7, 0 );
+    return( ( info[1] & ( 1 << 5 ) ) != 0 );
+#endif
+}
+
+#endif /* MD5_MB_X86 */
+
+/*
+ * A kernel together with the number of lanes it hashes
+ */
+typedef struct
+{
+    md5_mb_kernel kernel;       /* NULL for the scalar md5() fallback */
+    int lanes;
+}
+md5_mb_engine;
+
+#if defined(__GNUC__)
+#define MB_LOAD_ACQUIRE(p)      __atomic_load_n( &(p), __ATOMIC_ACQUIRE )
+#define MB_STORE_RELEASE(p,v)   __atomic_store_n( &(p), (v), __ATOMIC_RELEASE )
+#else
+/* MSVC gives volatile loads and stores acquire and release semantics */
+#define MB_LOAD_ACQUIRE(p)      (p)
+#define MB_STORE_RELEASE(p,v)   ( (p) = (v) )
+#endif
+
+/*
+ * Pick the widest kernel this CPU can run. The first callers may race
+ * here from several threads; they all pick the same engine and publish
+ * it with one pointer store, so no thread sees a kernel without its lanes.
+ */
+static int md5_mb_select( md5_mb_kernel *kernel )
+{
+    static const md5_mb_engine scalar = { NULL, 1 };
+#ifdef MD5_MB_X86
+    static const md5_mb_engine sse2 = { md5_mb_sse2, 4 };
+    static const md5_mb_engine avx2 = { md5_mb_avx2, 8 };
+#endif
+    static const md5_mb_engine * volatile selected = NULL;
+    const md5_mb_engine *engine = MB_LOAD_ACQUIRE( selected );
+
+    if( engine == NULL )
+    {
+        engine = &scalar;
+#ifdef MD5_MB_X86
+        if( md5_mb_cpu_avx2() )
+            engine = &avx2;
+        else if( md5_mb_cpu_sse2() )
+            engine = &sse2;
+#endif
+        MB_STORE_RELEASE( selected, engine );
+    }
+
+    *kernel = engine->kernel;
+    return( engine->lanes );
+}
+
+/*
+ * State of the stream hashed in one lane
+ */
+typedef struct
+{
+    int job;                    /* index of the buffer in this lane, -1 if idle */
+    unsigned char *data;        /* next unprocessed byte of the buffer          */
+    unsigned int blocks;        /* whole blocks left at data                    */
+    unsigned int rest;          /* bytes following those blocks                 */
+    unsigned char tail[128];    /* last partial block followed by the padding  */
+    unsigned char *tailptr;     /* next padding block to process               */
+    unsigned int tailblocks;    /* padding blocks left at tailptr               */
+}
+md5_mb_lane;
+
+static void md5_mb_load( md5_mb_lane *lane, unsigned int state[4][MD5_MB_MAX_LANES],
+                         int l, int job, unsigned char *input, unsigned int ilen )
+{
+    unsigned int high = ilen >> 29;
+    unsigned int low  = ilen << 3;
+
+    lane->job = job;
+    lane->data = input;
+    lane->blocks = ilen >> 6;
+    lane->rest = ilen & 0x3F;
+
+    memset( lane->tail, 0, sizeof( lane->tail ) );
+    memcpy( lane->tail, input + ( lane->blocks << 6 ), lane->rest );
+    lane->tail[lane->rest] = 0x80;
+    lane->tailblocks = ( lane->rest < 56 ) ? 1 : 2;
+    lane->tailptr = lane->tail;
+
+    MB_PUT32( low,  lane->tail, lane->tailblocks * 64 - 8 );
+    MB_PUT32( high, lane->tail, lane->tailblocks * 64 - 4 );
+
+    state[0][l] = 0x67452301;
+    state[1][l] = 0xEFCDAB89;
+    state[2][l] = 0x98BADCFE;
+    state[3][l] = 0x10325476;
+}
+
+/*
+ * Hand the remainder of a lone stream to the scalar code, there is
+ * nothing to gain from running a single busy lane through the kernel.
+ */
+static void md5_mb_finish_scalar( md5_mb_lane *lane, unsigned int state[4][MD5_MB_MAX_LANES],
+                                  int l, unsigned int ilen, unsigned char *output )
+{
+    md5_context ctx;
+    unsigned char *p = lane->data;
+    unsigned int left = ( lane->blocks << 6 ) + lane->rest;
+    int n;
+
+    ctx.total[0] = ilen - left;
+    ctx.total[1] = 0;
+    ctx.state[0] = state[0][l];
+    ctx.state[1] = state[1][l];
+    ctx.state[2] = state[2][l];
+    ctx.state[3] = state[3][l];
+
+    while( left > 0 )
+    {
+        n = ( left > 0x40000000 ) ? 0x40000000 : (int) left;
+        md5_update( &ctx, p, n );
+        p += n;
+        left -= n;
+    }
+
+    md5_finish( &ctx, output );
+    memset( &ctx, 0, sizeof( md5_context ) );
+}
+
+static void md5_mb_run( md5_mb_kernel kernel, int lanes, int count,
+                        unsigned char **input, unsigned int *ilen,
+                        unsigned char (*output)[16] )
+{
+    static const unsigned char idle[64] = { 0 };
+    md5_mb_lane lane[MD5_MB_MAX_LANES];
+    unsigned int state[4][MD5_MB_MAX_LANES];
+    const unsigned char *block[MD5_MB_MAX_LANES];
+    int l, next = 0, active = 0;
+
+    memset( state, 0, sizeof( state ) );
+
+    for( l = 0; l < lanes; l++ )
+    {
+        if( next < count )
+        {
+            md5_mb_load( &lane[l], state, l, next, input[next], ilen[next] );
+            next++;
+            active++;
+        }
+        else
+            lane[l].job = -1;
+    }
+
+    while( active > 0 )
+    {
+        /*
+         * Lanes are refilled as soon as they finish, so a single busy
+         * lane means every other buffer is done.
+         */
+        if( active == 1 )
+        {
+            for( l = 0; lane[l].job < 0; l++ );
+
+            if( lane[l].blocks > 0 )
+            {
+                md5_mb_finish_scalar( &lane[l], state, l, ilen[lane[l].job],
+                                      output[lane[l].job] );
+                lane[l].job = -1;
+                active = 0;
+                break;
+            }
+        }
+
+        for( l = 0; l < lanes; l++ )
+        {
+            if( lane[l].job < 0 )
+                block[l] = idle;
+            else if( lane[l].blocks > 0 )
+                block[l] = lane[l].data;
+            else
+                block[l] = lane[l].tailptr;
+        }
+
+        kernel( state, block );
+
+        for( l = 0; l < lanes; l++ )
+        {
+            if( lane[l].job < 0 )
+                continue;
+
+            if( lane[l].blocks > 0 )
+            {
+                lane[l].data += 64;
+                lane[l].blocks--;
+                continue;
+            }
+
+            lane[l].tailptr += 64;
+            if( --lane[l].tailblocks > 0 )
+                continue;
+
+            MB_PUT32( state[0][l], output[lane[l].job],  0 );
+            MB_PUT32( state[1][l], output[lane[l].job],  4 );
+            MB_PUT32( state[2][l], output[lane[l].job],  8 );
+            MB_PUT32( state[3][l], output[lane[l].job], 12 );
+
+            if( next < count )
+            {
+                md5_mb_load( &lane[l], state, l, next, input[next], ilen[next] );
+                next++;
+            }
+            else
+            {
+                lane[l].job = -1;
+                active--;
+            }
+        }
+    }
+}
+
+/*
+ * Output[i] = MD5( input[i] )
+ */
+void md5_mb( int count, unsigned char **input, unsigned int *ilen,
+             unsigned char (*output)[16] )
+{
+    md5_mb_kernel kernel;
+    int i, lanes;
+
+    lanes = md5_mb_select( &kernel );
+    if( lanes <= 1 || count <= 1 )
+    {
+        for( i = 0; i < count; i++ )
+            md5( input[i], (int) ilen[i], output[i] );
+        return;
+    }
+
+    md5_mb_run( kernel, lanes, count, input, ilen, output );
+}
+
+int md5_mb_lanes( void )
+{
+    md5_mb_kernel kernel;
+    return( md5_mb_select( &kernel ) );
+}
+
+/*
+ * Checkup routine
+ */
+#define MB_TEST_COUNT 21
+
+static int md5_mb_test_engine( const char *name, md5_mb_kernel kernel,
+                               int lanes, int verbose )
+{
+    static const unsigned int lengths[MB_TEST_COUNT] =
+        { 0, 1, 3, 55, 56, 57, 63, 64, 65, 119, 120, 127, 128, 129,
+          1000, 4096, 4159, 70000, 5, 200000, 64 * 31 + 55 };
+    static unsigned char data[200000];
+    unsigned char *input[MB_TEST_COUNT];
+    unsigned int ilen[MB_TEST_COUNT];
+    unsigned char sum[MB_TEST_COUNT][16], ref[16];
+    unsigned int i, seed = 0x1234567;
+
+    for( i = 0; i < sizeof( data ); i++ )
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (unsigned char) ( seed >> 16 );
+    }
+
+    for( i = 0; i < MB_TEST_COUNT; i++ )
+    {
+        input[i] = data + ( i * 7 ) % 64;
+        ilen[i] = lengths[i];
+        if( ilen[i] > sizeof( data ) - 64 )
+            ilen[i] = sizeof( data ) - 64;
+    }
+
+    if( verbose != 0 )
+        printf( "  MD5 multi-buffer %s (%d lanes): ", name, lanes );
+
+    md5_mb_run( kernel, lanes, MB_TEST_COUNT, input, ilen, sum );
+
+    for( i = 0; i < MB_TEST_COUNT; i++ )
+    {
+        md5( input[i], (int) ilen[i], ref );
+        if( memcmp( sum[i], ref, 16 ) != 0 )
+        {
+            if( verbose != 0 )
+                printf( "failed\n" );
+
+            return( 1 );
+        }
+    }
+
+    if( verbose != 0 )
+        printf( "passed\n" );
+
+    return( 0 );
+}
+
+int md5_mb_self_test( int verbose )
+{
+    int ret = 0;
+
+#ifdef MD5_MB_X86
+    if( md5_mb_cpu_sse2() )
+        ret |= md5_mb_test_engine( "sse2", md5_mb_sse2, 4, verbose );
+    if( md5_mb_cpu_avx2() )
+        ret |= md5_mb_test_engine( "avx2", md5_mb_avx2, 8, verbose );
+#endif
+
+    return( ret );
+}
@@ -0,0 +1,45 @@
+/**
+ * \file md5_mb.h
+ *
+ * Multi-buffer MD5: hashes several independent buffers at once by running
+ * one MD5 stream per SIMD lane. Digests are identical to md5().
+ */
+#ifndef _MD5_MB_H
+#define _MD5_MB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MD5_MB_MAX_LANES 8  /*!< widest lane count of any engine */
+
+/**
+ * \brief          Output[i] = MD5( input[i] ) for count buffers
+ *
+ * \param count    number of buffers to hash
+ * \param input    array of count buffer pointers
+ * \param ilen     array of count buffer lengths
+ * \param output   array of count MD5 checksum results
+ */
+	void md5_mb( int count, unsigned char **input, unsigned int *ilen,
+				 unsigned char (*output)[16] );
+
+/**
+ * \brief          Number of lanes hashed in parallel by the engine
+ *                 selected for this CPU (8 for AVX2, 4 for SSE2, else 1)
+ */
+	int md5_mb_lanes( void );
+
+/**
+ * \brief          Checkup routine, compares every engine usable on this
+ *                 CPU against md5()
+ *
+ * \return         0 if successful, or 1 if the test failed
+ */
+	int md5_mb_self_test( int verbose );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* md5_mb.h */
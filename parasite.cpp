@@ -28,402 +28,4532 @@
 #define parasite_export
 #define parasite_static_lib
 #include "parasite.h"
+#include "parasite_map.h"
+#include "parasite_trace.h"
+#include "parasite_io.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef LINUX
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <io.h>
+#endif
 
 namespace parasite
 {
-	char* ExtractFileName(char* path)
+	/*
+		A batch of item payloads handed from the TestItems reader to its workers
+	*/
+	struct TestBatch
 	{
-		char* rslt = NULL;
-	
-		rslt = strrchr(path, '\\');
-		if(rslt != NULL)
-			return rslt + 1;
-	
-		rslt = strrchr(path, '/');
-		if(rslt != NULL)
-			return rslt + 1;
-		
-		return path;
+		std::vector<unsigned int> items;	// Indexes into the item store
+		std::vector<unsigned char*> data;	// Payloads as stored in the host, NULL if the read failed
+		unsigned int size;					// Total number of payload bytes in the batch
+	};
+
+	/*
+		Bounded queue shared by the TestItems reader and workers
+	*/
+	struct TestQueue
+	{
+		std::mutex lock;
+		std::condition_variable changed;
+		std::deque<TestBatch*> batches;
+		unsigned int limit;					// Number of batches the reader may queue ahead
+		BOOL finished;						// Set when the reader has queued every item
+		PARASITE_PHASE_STATS* stats;		// Phases the workers add their time to, NULL when not collected
+		ParasiteTrace* trace;				// Trace the workers record to, NULL for none
+		ParasiteAllocator* allocator;		// Allocator of the batch payloads and decoded items
+	};
+
+
+	/*
+		Seconds on a monotonic clock, for statistics
+	*/
+	static double StatsClock()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 	}
 
-	
-	BOOL NewItemFromFile(PARASITE_ITEM& item, char* fileName, unsigned char flags)
+
+	/*
+		Adds the time since start to a phase, phases is NULL when not collecting
+	*/
+	static void AddPhase(PARASITE_PHASE_STATS* phases, int phase, double start, unsigned long long bytes)
 	{
-		FILE* file = fopen(fileName, "r");
-		if(file == NULL)
+		if(phases == NULL)
+			return;
+
+		phases[phase].seconds += StatsClock() - start;
+		phases[phase].bytes += bytes;
+		phases[phase].calls++;
+	}
+
+
+	/*
+		Checks that a #FEATURE_BLOCKS index agrees with the item it belongs to
+	*/
+	static BOOL CheckBlockIndex(const PARASITE_ITEM& item, const PARASITE_BLOCK_INDEX& index)
+	{
+		if(index.blockSize == 0)
+			return FALSE;
+
+		if(index.blockCount != item.lzSize / index.blockSize + (item.lzSize % index.blockSize ? 1 : 0))
+			return FALSE;
+
+		unsigned int header = sizeof(unsigned int) * (2 + index.blockCount);
+		unsigned int previous = 0;
+		for(unsigned int i = 0; i < index.blockCount; i++)
 		{
-			printf("Could not read input file %s\n", fileName);
+			if(index.ends[i] < previous)
+				return FALSE;
+			previous = index.ends[i];
+		}
+
+		return header + previous == item.size;
+	}
+
+
+	/*
+		Decodes a whole item from its stored data held in memory
+	*/
+	static BOOL DecodeItem(const PARASITE_ITEM& item, unsigned char* data, unsigned char* out)
+	{
+		if(!(item.flags & FEATURE_BLOCKS))
+			return LZ_UncompressSafe(data, out, item.size, item.lzSize) == (int) item.lzSize;
+
+		PARASITE_BLOCK_INDEX index;
+		if(item.size < sizeof(unsigned int) * 2)
+			return FALSE;
+
+		memcpy(&index.blockSize, data, sizeof(unsigned int));
+		memcpy(&index.blockCount, data + sizeof(unsigned int), sizeof(unsigned int));
+		if(index.blockCount > (item.size - sizeof(unsigned int) * 2) / sizeof(unsigned int))
 			return FALSE;
+
+		index.ends.resize(index.blockCount);
+		if(index.blockCount > 0)
+			memcpy(&index.ends[0], data + sizeof(unsigned int) * 2, sizeof(unsigned int) * index.blockCount);
+		if(!CheckBlockIndex(item, index))
+			return FALSE;
+
+		unsigned char* blocks = data + sizeof(unsigned int) * (2 + index.blockCount);
+		unsigned int start = 0;
+		for(unsigned int i = 0; i < index.blockCount; i++)
+		{
+			unsigned int rawSize = item.lzSize - i * index.blockSize;
+			if(rawSize > index.blockSize)
+				rawSize = index.blockSize;
+
+			unsigned int storedSize = index.ends[i] - start;
+			if(storedSize == rawSize)
+				memcpy(out, blocks + start, rawSize);
+			else if(LZ_UncompressSafe(blocks + start, out, storedSize, rawSize) != (int) rawSize)
+				return FALSE;
+
+			out += rawSize;
+			start = index.ends[i];
 		}
 
-		/*
-			Store original file name
-		*/
-		strcpy(item.localpath, fileName);
-		strcpy(item.filename, ExtractFileName(fileName));
+		return TRUE;
+	}
 
-		/* 
-			Store original file size
-		*/
-		fseek(file, 0, SEEK_END);
-		item.size = ftell(file);
-		item.lzSize = 0;
-		item.offset = 0;
-		
+
+	/*
+		Decodes every item of a batch in memory and hashes them together
+	*/
+	static void TestBatchItems(TestBatch* batch, const ParasiteItemStore* items,
+							   std::vector<PARASITE_TEST_RESULT>* results, PARASITE_PHASE_STATS* phases, ParasiteTrace* trace,
+							   ParasiteAllocator* allocator)
+	{
+		unsigned char* buffers[HASH_BATCH_ITEMS];
+		unsigned int sizes[HASH_BATCH_ITEMS];
+		unsigned char hashes[HASH_BATCH_ITEMS][HASH_SIZE];
+		unsigned char* decoded[HASH_BATCH_ITEMS];
+		unsigned int index[HASH_BATCH_ITEMS];
+		int count = 0;
+
+		PARASITE_ITEM item;
+		for(unsigned int i = 0; i < batch->items.size(); i++)
+		{
+			items->GetItem(batch->items[i], &item);
+			decoded[i] = NULL;
+
+			if(batch->data[i] == NULL)
+				continue;
+
+			if(item.flags & FEATURE_COMPRESS)
+			{
+				decoded[i] = (unsigned char*) allocator->Alloc(item.lzSize + 1);
+				if(!decoded[i])
+					continue;
+
+				double start = phases ? StatsClock() : 0;
+				ParasiteTraceSpan span(trace, "decompress", item.filename);
+				span.SetBytes(item.lzSize);
+				BOOL decodedItem = DecodeItem(item, batch->data[i], decoded[i]);
+				AddPhase(phases, PHASE_DECOMPRESS, start, item.lzSize);
+				if(!decodedItem)
+					continue;
+
+				buffers[count] = decoded[i];
+				sizes[count] = item.lzSize;
+			}
+			else
+			{
+				buffers[count] = batch->data[i];
+				sizes[count] = item.size;
+			}
+			index[count++] = i;
+		}
+
+		double start = (phases || trace) ? StatsClock() : 0;
+		md5_mb(count, buffers, sizes, hashes);
+		unsigned long long hashed = 0;
+		for(int i = 0; i < count; i++)
+			hashed += sizes[i];
+		AddPhase(phases, PHASE_VERIFY, start, hashed);
+		if(trace)
+			trace->Add("verify", NULL, start, StatsClock(), hashed);
+
+		for(int i = 0; i < count; i++)
+		{
+			unsigned int item = batch->items[index[i]];
+			(*results)[item].passed = (memcmp(hashes[i], items->GetHash(item), HASH_SIZE) == 0);
+		}
+
+		for(unsigned int i = 0; i < batch->items.size(); i++)
+		{
+			allocator->Free(decoded[i]);
+			allocator->Free(batch->data[i]);
+		}
+	}
+
+
+	static void TestWorker(TestQueue* queue, const ParasiteItemStore* items,
+						   std::vector<PARASITE_TEST_RESULT>* results)
+	{
 		/*
-			Assign requested flags to the new file item
+			Phases are counted per worker and added to the totals at the end
 		*/
-		item.flags = flags;
-	
-		fclose(file);
-		return TRUE;
+		PARASITE_PHASE_STATS phases[PHASE_COUNT];
+		memset(phases, 0, sizeof(phases));
+		if(queue->trace)
+			queue->trace->NameThread("test worker");
+
+		for(;;)
+		{
+			TestBatch* batch;
+			{
+				std::unique_lock<std::mutex> guard(queue->lock);
+				double wait = (queue->trace && queue->batches.empty() && !queue->finished) ? StatsClock() : 0;
+				while(queue->batches.empty() && !queue->finished)
+					queue->changed.wait(guard);
+				if(wait != 0)
+					queue->trace->Add("wait", NULL, wait, StatsClock());
+
+				if(queue->batches.empty())
+				{
+					for(int i = 0; queue->stats && i < PHASE_COUNT; i++)
+					{
+						queue->stats[i].seconds += phases[i].seconds;
+						queue->stats[i].bytes += phases[i].bytes;
+						queue->stats[i].calls += phases[i].calls;
+					}
+					return;
+				}
+
+				batch = queue->batches.front();
+				queue->batches.pop_front();
+			}
+			queue->changed.notify_all();
+
+			TestBatchItems(batch, items, results, queue->stats ? phases : NULL, queue->trace, queue->allocator);
+			delete batch;
+		}
 	}
 
-	
-	void ParasiteHost::SetLastError(const char* error) 
+
+	static void QueueTestBatch(TestQueue* queue, TestBatch* batch)
 	{
-		strcpy(LastError, error);
+		{
+			std::unique_lock<std::mutex> guard(queue->lock);
+			double wait = (queue->trace && queue->batches.size() >= queue->limit) ? StatsClock() : 0;
+			while(queue->batches.size() >= queue->limit)
+				queue->changed.wait(guard);
+			if(wait != 0)
+				queue->trace->Add("wait", NULL, wait, StatsClock());
+
+			queue->batches.push_back(batch);
+		}
+		queue->changed.notify_all();
 	}
-	
-	char* ParasiteHost::GetLastError()
+
+
+	/*
+		Orders indexes of a store by the stream offsets of their items
+	*/
+	struct OffsetOrder
 	{
-		return (char*)&LastError;
+		const ParasiteItemStore* items;
+
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			return items->GetOffset(a) < items->GetOffset(b);
+		}
+	};
+
+
+	/*
+		Compares two directory paths component by component. '/' sorts before any
+		other character, so a directory is directly followed by its subtree.
+	*/
+	static int CompareDirPath(const char* a, size_t aLength, const char* b, size_t bLength)
+	{
+		size_t length = aLength < bLength ? aLength : bLength;
+		for(size_t i = 0; i < length; i++)
+		{
+			unsigned char ca = (a[i] == '/') ? 1 : (unsigned char) a[i];
+			unsigned char cb = (b[i] == '/') ? 1 : (unsigned char) b[i];
+			if(ca != cb)
+				return ca < cb ? -1 : 1;
+		}
+
+		if(aLength == bLength)
+			return 0;
+		return aLength < bLength ? -1 : 1;
 	}
 
 
-	BOOL ParasiteHost::OpenHostFile(char* file, const char* mode)
+	/*
+		Length of the directory part of an item path, 0 for items in the root
+	*/
+	static size_t DirLength(const char* path)
 	{
-		hostFile = fopen(file, mode);
-		return(hostFile != NULL);
+		const char* slash = strrchr(path, '/');
+		return slash ? slash - path : 0;
 	}
 
 
-	BOOL ParasiteHost::CloseHostFile()
+	/*
+		Name of an item within its directory
+	*/
+	static const char* LeafName(const char* path)
 	{
-		assert(hostFile != NULL);
-		return(fclose(hostFile) == 0);
+		const char* slash = strrchr(path, '/');
+		return slash ? slash + 1 : path;
 	}
 
-	
-	BOOL ParasiteHost::Seek(unsigned int offset)
+
+	/*
+		Table order: by directory, then by name within the directory
+	*/
+	static bool ComparePath(const char* a, const char* b)
 	{
-		assert(hostFile != NULL);
-		if((offset < 0) || (offset > host.size))
-			return FALSE;
-		
-		fseek(hostFile, offset, SEEK_SET);
-		return TRUE;
+		int order = CompareDirPath(a, DirLength(a), b, DirLength(b));
+		if(order != 0)
+			return order < 0;
+
+		return strcmp(LeafName(a), LeafName(b)) < 0;
 	}
 
-	
-	BOOL ParasiteHost::RSeek(unsigned int offset)
+
+	static bool CompareItemPath(const PARASITE_ITEM& a, const PARASITE_ITEM& b)
 	{
-		assert(hostFile != NULL);
-		if((offset < 0) || (offset > host.size))
-			return FALSE;
-		
-		fseek(hostFile, (host.size - offset), SEEK_SET);
-		return TRUE;
+		return ComparePath(a.filename, b.filename);
 	}
-	
-	
-	BOOL ParasiteHost::WriteItemToHost(PARASITE_ITEM* item)
+
+
+	/*
+		Orders indexes of a store by the paths of their items
+	*/
+	struct StoreOrder
 	{
-		assert(item != NULL);
-		assert(hostFile != NULL);
+		const ParasiteItemStore* items;
 
-		if(verboseOutput)
-		{		  
-			printf("\n Infecting <%s> with [%u] bytes from File <%s>\n", host.filename, item->size, item->localpath);
-			if(item->flags > 0)
-			{
-				printf("  Using features:\n");
-				if(item->flags & FEATURE_COMPRESS)
-					printf("    compression\n");
-			}
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			return ComparePath(items->GetName(a), items->GetName(b));
 		}
+	};
 
 
-		/*
-			Calculate the HASH of the _original_ file.
-			This hash will be checked against after the file has been restored.
-		*/
-		if(md5_file(item->localpath, item->hash) != 0)
+	/*
+		First item of [first, last) whose name within its directory is not less
+		than name. The range must be one directory of a table in table order.
+	*/
+	static unsigned int LowerBoundLeaf(const ParasiteItemStore& items, unsigned int first, unsigned int last,
+									   const char* name)
+	{
+		while(first < last)
 		{
-			printf(" Failed to gernerate MD5 sum for %s", item->localpath);
-			return FALSE;
+			unsigned int middle = first + (last - first) / 2;
+			if(strcmp(LeafName(items.GetName(middle)), name) < 0)
+				first = middle + 1;
+			else
+				last = middle;
 		}
-		if(verboseOutput)
+
+		return first;
+	}
+
+
+	/*
+		Appends an unsigned LEB128 varint
+	*/
+	static void PutVarint(std::vector<unsigned char>& out, unsigned int value)
+	{
+		while(value >= 0x80)
 		{
-			printf("  * %s Hash: ", item->localpath);
-			for(int i = 0; i < HASH_SIZE; i++)
-				printf("%x", item->hash[i]);
-			printf("\n");			
+			out.push_back((unsigned char) (value | 0x80));
+			value >>= 7;
 		}
-		
-		/* 
-			These allocations are calculated from lz4 worst case compress size.
-			TODO: I Believe that this calculation is incorrect (too large) fix it! 
-		*/
-		unsigned int bufsize = (item->size * 104 + 50) / 100 + 384;
-		unsigned char* itemBuf = (unsigned char*) malloc(item->size + 2 * bufsize);
-		if(!itemBuf)
+		out.push_back((unsigned char) value);
+	}
+
+
+	/*
+		Appends a name as the length of the prefix it shares with the previous
+		name, the length of the rest and the rest
+	*/
+	static void PutFrontCoded(std::vector<unsigned char>& out, std::string& previous, const char* name)
+	{
+		size_t shared = 0;
+		while(shared < previous.size() && name[shared] == previous[shared])
+			shared++;
+
+		size_t rest = strlen(name + shared);
+		PutVarint(out, (unsigned int) shared);
+		PutVarint(out, (unsigned int) rest);
+		out.insert(out.end(), name + shared, name + shared + rest);
+
+		previous.assign(name);
+	}
+
+
+	static unsigned int ZigZag(int value)
+	{
+		return ((unsigned int) value << 1) ^ (unsigned int) (value >> 31);
+	}
+
+
+	static int UnZigZag(unsigned int value)
+	{
+		return (int) (value >> 1) ^ -(int) (value & 1);
+	}
+
+
+	/*
+		Bounds checked reader over the body of a compact file table
+	*/
+	struct TableReader
+	{
+		const unsigned char* pos;
+		const unsigned char* end;
+
+		BOOL GetVarint(unsigned int* value)
 		{
-			printf(" Failed to allocate [itemBuf] buffer for WriteItemToHost\n");
+			*value = 0;
+			for(int shift = 0; shift < 35; shift += 7)
+			{
+				if(pos == end)
+					return FALSE;
+				unsigned char byte = *pos++;
+				*value |= (unsigned int) (byte & 0x7f) << shift;
+				if(!(byte & 0x80))
+					return TRUE;
+			}
 			return FALSE;
 		}
-		unsigned char* buf = &itemBuf[item->size];
 
-		/* 
-			Read item file into buffer 
-		*/
-		FILE* readsrc = fopen(item->localpath, "rb");
-		fread(itemBuf, 1, item->size, readsrc);	   
-		fclose(readsrc);
+		BOOL GetBytes(void* value, size_t size)
+		{
+			if((size_t) (end - pos) < size)
+				return FALSE;
+			memcpy(value, pos, size);
+			pos += size;
+			return TRUE;
+		}
 
-		/* 
-			If the compression feature is set on this item, compress the file buffer
-		*/
-		if(item->flags & FEATURE_COMPRESS)
+		BOOL GetFrontCoded(std::string& previous)
 		{
-			unsigned int* work = (unsigned int*) malloc(sizeof(unsigned int) * (65536 + item->size));
-			if(work)
-			{
-				printf("  Original file size: %u\n", item->size);
+			unsigned int shared, rest;
+			if(!GetVarint(&shared) || !GetVarint(&rest) || shared > previous.size()
+			   || rest >= MAX_FILE_NAME || (size_t) (end - pos) < rest)
+				return FALSE;
 
-				item->lzSize = item->size;
-	  			item->size = LZ_CompressFast(itemBuf, buf, item->size, work);
-				
-				printf("  Finished compress with size: %u\n", item->size);
-				free(work);
+			previous.resize(shared);
+			previous.append((const char*) pos, rest);
+			pos += rest;
+			return previous.size() < MAX_FILE_NAME && previous.find('\0') == std::string::npos;
+		}
+	};
 
-				item->offset = ftell(hostFile);
-				fwrite(buf, 1, item->size, hostFile);
-				
-				free(itemBuf);
-				return TRUE;
-			}	  
+
+	/*
+		Decodes one item entry of a compact table body: sizes, offset relative to
+		the end of the previous item, flags, hash and the name within the
+		directory, front coded against the previous entry's name in leaf.
+		Pass a NULL item to only skim the entry.
+	*/
+	static BOOL DecodeCompactEntry(TableReader& reader, const std::string& path, std::string& leaf,
+								   unsigned int& expected, PARASITE_ITEM* item)
+	{
+		PARASITE_ITEM skimmed;
+		if(item == NULL)
+			item = &skimmed;
+
+		unsigned int delta;
+		if(!reader.GetVarint(&item->size) || !reader.GetVarint(&item->lzSize) || !reader.GetVarint(&delta)
+		   || !reader.GetBytes(&item->flags, 1) || !reader.GetBytes(item->hash, HASH_SIZE)
+		   || !reader.GetFrontCoded(leaf))
+			return FALSE;
+
+		if(leaf.empty() || leaf.find('/') != std::string::npos || path.size() + 1 + leaf.size() >= MAX_FILE_NAME)
+			return FALSE;
+
+		item->offset = expected + UnZigZag(delta);
+		expected = item->offset + item->size;
+
+		if(item != &skimmed)
+		{
+			if(path.empty())
+				memcpy(item->filename, leaf.c_str(), leaf.size() + 1);
 			else
-				printf(" Failed to allocate work buffer for compress\n");
+			{
+				memcpy(item->filename, path.c_str(), path.size());
+				item->filename[path.size()] = '/';
+				memcpy(item->filename + path.size() + 1, leaf.c_str(), leaf.size() + 1);
+			}
+			item->localpath[0] = 0;
+			item->data = NULL;
 		}
 
-		/* 
-			Append the file final data into the current working item.
-		*/
-		item->offset = ftell(hostFile);
-		fwrite(itemBuf, 1, item->size, hostFile);
-		
-		free(itemBuf);
 		return TRUE;
 	}
 
 
-	void ParasiteHost::SetVerboseOutput(BOOL verbose)
+	/*
+		Item paths come from the host file, so refuse any that would be written
+		outside of the extraction directory
+	*/
+	static BOOL IsSafeItemPath(const char* path)
 	{
-		verboseOutput = verbose;
+		if(path[0] == 0 || path[0] == '/' || path[0] == '\\' || strchr(path, ':') != NULL)
+			return FALSE;
+
+		for(const char* part = path; part != NULL; )
+		{
+			const char* end = strpbrk(part, "/\\");
+			size_t length = end ? end - part : strlen(part);
+			if(length == 0 || (length == 2 && part[0] == '.' && part[1] == '.'))
+				return FALSE;
+			part = end ? end + 1 : NULL;
+		}
+
+		return TRUE;
 	}
 
 
-	unsigned int ParasiteHost::GetSize()
+	/*
+		Creates the missing parent directories of a file path
+	*/
+	static void MakeParentDirectories(const std::string& filePath)
 	{
-		assert(hostFile != NULL);
-		fseek(hostFile, 0, SEEK_END);
+		for(size_t i = 1; i < filePath.size(); i++)
+		{
+			if(filePath[i] != '/')
+				continue;
+
+			std::string dir = filePath.substr(0, i);
+#ifdef LINUX
+			mkdir(dir.c_str(), 0755);
+#else
+			_mkdir(dir.c_str());
+#endif
+		}
+	}
+
+
+	char* ExtractFileName(char* path)
+	{
+		char* rslt = NULL;
+	
+		rslt = strrchr(path, '\\');
+		if(rslt != NULL)
+			return rslt + 1;
+	
+		rslt = strrchr(path, '/');
+		if(rslt != NULL)
+			return rslt + 1;
+		
+		return path;
+	}
+
+	
+	std::string MakeItemPath(const char* path)
+	{
+		std::string result;
+		std::string part;
+
+		/*
+			Skip a drive letter
+		*/
+		if(path[0] != 0 && path[1] == ':')
+			path += 2;
+
+		for(const char* c = path; ; c++)
+		{
+			if(*c != 0 && *c != '/' && *c != '\\')
+			{
+				part += *c;
+				continue;
+			}
+
+			if(part == "..")
+				result.clear();
+			else if(!part.empty() && part != ".")
+			{
+				if(!result.empty())
+					result += '/';
+				result += part;
+			}
+			part.clear();
+
+			if(*c == 0)
+				break;
+		}
+
+		return result;
+	}
+
+	
+	BOOL NewItemFromFile(PARASITE_ITEM& item, char* fileName, unsigned char flags)
+	{
+		std::string itemPath = MakeItemPath(fileName);
+		if(itemPath.empty() || itemPath.size() >= MAX_FILE_NAME || strlen(fileName) >= MAX_FILE_NAME)
+		{
+			printf("Input file name %s is empty or too long\n", fileName);
+			return FALSE;
+		}
+
+		FILE* file = fopen(fileName, "r");
+		if(file == NULL)
+		{
+			printf("Could not read input file %s\n", fileName);
+			return FALSE;
+		}
+
+		/*
+			Store original file name, keeping its relative directory
+		*/
+		strcpy(item.localpath, fileName);
+		strcpy(item.filename, itemPath.c_str());
+
+		/* 
+			Store original file size
+		*/
+		fseek(file, 0, SEEK_END);
+		item.size = ftell(file);
+		item.lzSize = 0;
+		item.offset = 0;
+		
+		/*
+			Assign requested flags to the new file item
+		*/
+		item.flags = flags;
+		item.data = NULL;
+	
+		fclose(file);
+		return TRUE;
+	}
+
+	
+	unsigned int HashItemName(const char* name)
+	{
+		unsigned int hash = 2166136261u;
+		for(const unsigned char* c = (const unsigned char*) name; *c; c++)
+		{
+			hash ^= *c;
+			hash *= 16777619u;
+		}
+
+		return hash;
+	}
+
+
+	BOOL CheckMapHeader(const PARASITE_MAP_HEADER& header, unsigned int available)
+	{
+		unsigned long long recordEnd = header.recordOffset + (unsigned long long) header.items * sizeof(PARASITE_MAP_RECORD);
+		unsigned long long dirEnd = header.dirOffset + (unsigned long long) header.dirCount * sizeof(PARASITE_MAP_DIR);
+		unsigned long long indexEnd = header.indexOffset + (unsigned long long) header.items * sizeof(PARASITE_MAP_INDEX);
+		unsigned long long poolEnd = header.poolOffset + (unsigned long long) header.poolSize;
+
+		if(header.headerSize < sizeof(PARASITE_MAP_HEADER) || header.dirCount == 0 || header.tableSize > available)
+			return FALSE;
+
+		if((header.recordOffset | header.dirOffset | header.indexOffset | header.poolOffset) % 8 != 0)
+			return FALSE;
+
+		return header.recordOffset >= header.headerSize && header.dirOffset >= recordEnd
+			   && header.indexOffset >= dirEnd && header.poolOffset >= indexEnd && poolEnd <= header.tableSize;
+	}
+
+
+	unsigned int GetOriginalSize(const PARASITE_ITEM& item)
+	{
+		return (item.flags & FEATURE_COMPRESS) ? item.lzSize : item.size;
+	}
+
+
+	void ParasiteItemStore::Clear()
+	{
+		offsets.clear();
+		sizes.clear();
+		lzSizes.clear();
+		flags.clear();
+		hashes.clear();
+		names.clear();
+		arena.clear();
+	}
+
+
+	void ParasiteItemStore::Reserve(unsigned int count, size_t nameBytes)
+	{
+		offsets.reserve(count);
+		sizes.reserve(count);
+		lzSizes.reserve(count);
+		flags.reserve(count);
+		hashes.reserve((size_t) count * HASH_SIZE);
+		names.reserve(count);
+		arena.reserve(nameBytes);
+	}
+
+
+	void ParasiteItemStore::Add(const PARASITE_ITEM& item)
+	{
+		Add(item.filename, strlen(item.filename), item.offset, item.size, item.lzSize, item.flags, item.hash);
+	}
+
+
+	void ParasiteItemStore::Add(const char* name, size_t length, unsigned int offset, unsigned int size,
+								unsigned int lzSize, unsigned char flag, const unsigned char* hash)
+	{
+		offsets.push_back(offset);
+		sizes.push_back(size);
+		lzSizes.push_back(lzSize);
+		flags.push_back(flag);
+		hashes.insert(hashes.end(), hash, hash + HASH_SIZE);
+		names.push_back((unsigned int) arena.size());
+		arena.insert(arena.end(), name, name + length);
+		arena.push_back(0);
+	}
+
+
+	void ParasiteItemStore::Reorder(const std::vector<unsigned int>& order)
+	{
+		ParasiteItemStore sorted;
+		sorted.Reserve(order.size(), arena.size());
+		for(unsigned int i = 0; i < order.size(); i++)
+		{
+			unsigned int from = order[i];
+			const char* name = GetName(from);
+			sorted.Add(name, strlen(name), offsets[from], sizes[from], lzSizes[from], flags[from], GetHash(from));
+		}
+
+		offsets.swap(sorted.offsets);
+		sizes.swap(sorted.sizes);
+		lzSizes.swap(sorted.lzSizes);
+		flags.swap(sorted.flags);
+		hashes.swap(sorted.hashes);
+		names.swap(sorted.names);
+		arena.swap(sorted.arena);
+	}
+
+
+	void ParasiteItemStore::GetItem(unsigned int index, PARASITE_ITEM* item) const
+	{
+		item->offset = offsets[index];
+		item->size = sizes[index];
+		item->lzSize = lzSizes[index];
+		item->flags = flags[index];
+		memcpy(item->hash, GetHash(index), HASH_SIZE);
+		strcpy(item->filename, GetName(index));
+		item->localpath[0] = 0;
+		item->data = NULL;
+	}
+
+
+	size_t ParasiteItemStore::GetMemoryUsage() const
+	{
+		return (offsets.capacity() + sizes.capacity() + lzSizes.capacity() + names.capacity()) * sizeof(unsigned int)
+			   + flags.capacity() + hashes.capacity() + arena.capacity();
+	}
+
+
+	/*
+		Buffers from ParasiteAllocator::Alloc start with their size, padded so
+		the buffer keeps the alignment of malloc
+	*/
+	static const size_t ALLOC_HEADER = 16;
+
+
+	ParasiteAllocator::ParasiteAllocator() : current(0), peak(0), allocations(0)
+	{
+	}
+
+
+	void* ParasiteAllocator::Alloc(size_t size)
+	{
+		unsigned char* block = (unsigned char*) malloc(size + ALLOC_HEADER);
+		if(block == NULL)
+			return NULL;
+
+		*(size_t*) block = size;
+		Hold(size);
+		return block + ALLOC_HEADER;
+	}
+
+
+	void ParasiteAllocator::Free(void* buffer)
+	{
+		if(buffer == NULL)
+			return;
+
+		unsigned char* block = (unsigned char*) buffer - ALLOC_HEADER;
+		Drop(*(size_t*) block);
+		free(block);
+	}
+
+
+	void ParasiteAllocator::Hold(size_t bytes)
+	{
+		allocations++;
+		size_t now = current += bytes;
+		size_t highest = peak;
+		while(now > highest && !peak.compare_exchange_weak(highest, now))
+			;
+	}
+
+
+	void ParasiteAllocator::Drop(size_t bytes)
+	{
+		current -= bytes;
+	}
+
+
+	size_t ParasiteAllocator::OpenWindow()
+	{
+		return peak.exchange(current);
+	}
+
+
+	void ParasiteAllocator::CloseWindow(size_t previous)
+	{
+		size_t highest = peak;
+		while(previous > highest && !peak.compare_exchange_weak(highest, previous))
+			;
+	}
+
+
+	/*
+		Counts a container's memory with an allocator for as long as it lives
+	*/
+	struct HeldMemory
+	{
+		ParasiteAllocator& allocator;
+		size_t bytes;
+
+		HeldMemory(ParasiteAllocator& allocator, size_t bytes) : allocator(allocator), bytes(bytes) { allocator.Hold(bytes); }
+		~HeldMemory() { allocator.Drop(bytes); }
+	};
+
+
+	/*
+		Alignment of scratch buffers, smallest chunk and huge page size
+	*/
+	static const size_t SCRATCH_ALIGN = 64;
+	static const size_t SCRATCH_MIN_CHUNK = 64 * 1024;
+	static const size_t SCRATCH_HUGE_PAGE = 2 * 1024 * 1024;
+
+
+	/*
+		Scratch bytes WriteCompressedBlocks needs for its output and LZ work
+		buffers, plus the block read when streaming
+	*/
+	static size_t CompressWorkSize(unsigned int blockSize)
+	{
+		return (blockSize * 104 + 50) / 100 + 384 + sizeof(unsigned int) * (65536 + blockSize)
+			   + blockSize + 3 * SCRATCH_ALIGN;
+	}
+
+
+	/*
+		Scratch bytes WritePipelinedItem needs for the read and compressed
+		blocks of every slot and the LZ work buffer
+	*/
+	static size_t PipelineWorkSize(unsigned int blockSize)
+	{
+		return PIPELINE_SLOTS * (blockSize + (blockSize * 104 + 50) / 100 + 384 + 2 * SCRATCH_ALIGN)
+			   + sizeof(unsigned int) * (65536 + blockSize) + SCRATCH_ALIGN;
+	}
+
+
+	ParasiteScratch::ParasiteScratch() : hugePages(false), allocator(NULL)
+	{
+	}
+
+
+	ParasiteScratch::~ParasiteScratch()
+	{
+		FreeChunks();
+	}
+
+
+	void ParasiteScratch::SetHugePages(BOOL use)
+	{
+		hugePages = use;
+	}
+
+
+	void ParasiteScratch::SetAllocator(ParasiteAllocator* allocator)
+	{
+		this->allocator = allocator;
+	}
+
+
+	BOOL ParasiteScratch::AddChunk(size_t size)
+	{
+		SCRATCH_CHUNK chunk;
+		chunk.base = NULL;
+		chunk.size = size;
+		chunk.used = 0;
+		chunk.mapped = FALSE;
+
+#ifdef LINUX
+		if(hugePages)
+		{
+			size_t rounded = (size + SCRATCH_HUGE_PAGE - 1) & ~(SCRATCH_HUGE_PAGE - 1);
+			void* mapping = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			mapping = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+			/*
+				No reserved huge pages, ask for transparent ones instead
+			*/
+			if(mapping == MAP_FAILED)
+			{
+				mapping = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+				if(mapping != MAP_FAILED)
+					madvise(mapping, rounded, MADV_HUGEPAGE);
+#endif
+			}
+
+			if(mapping != MAP_FAILED)
+			{
+				chunk.base = (unsigned char*) mapping;
+				chunk.size = rounded;
+				chunk.mapped = TRUE;
+				if(allocator)
+					allocator->Hold(rounded);
+			}
+		}
+#endif
+
+		if(chunk.base == NULL)
+			chunk.base = (unsigned char*) (allocator ? allocator->Alloc(size) : malloc(size));
+		if(chunk.base == NULL)
+			return FALSE;
+
+		chunks.push_back(chunk);
+		return TRUE;
+	}
+
+
+	void ParasiteScratch::FreeChunks()
+	{
+		for(size_t i = 0; i < chunks.size(); i++)
+		{
+#ifdef LINUX
+			if(chunks[i].mapped)
+			{
+				munmap(chunks[i].base, chunks[i].size);
+				if(allocator)
+					allocator->Drop(chunks[i].size);
+				continue;
+			}
+#endif
+			if(allocator)
+				allocator->Free(chunks[i].base);
+			else
+				free(chunks[i].base);
+		}
+		chunks.clear();
+	}
+
+
+	unsigned char* ParasiteScratch::Alloc(size_t size)
+	{
+		/*
+			Buffers only go on top of the last chunk in use, or into an empty
+			chunk after it, so releasing to a mark frees them in order
+		*/
+		size_t top = 0;
+		for(size_t i = chunks.size(); i > 0; i--)
+		{
+			if(chunks[i - 1].used > 0)
+			{
+				top = i - 1;
+				break;
+			}
+		}
+
+		for(size_t i = top; i < chunks.size(); i++)
+		{
+			size_t start = (chunks[i].used + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+			if(start <= chunks[i].size && chunks[i].size - start >= size)
+			{
+				chunks[i].used = start + size;
+				return chunks[i].base + start;
+			}
+		}
+
+		/*
+			Grow by at least the memory already held, so a few rounds reach the
+			working set and the merge in Release leaves a single chunk
+		*/
+		size_t grow = std::max(std::max(size + SCRATCH_ALIGN, GetCapacity()), SCRATCH_MIN_CHUNK);
+		if(!AddChunk(grow))
+			return NULL;
+
+		SCRATCH_CHUNK& chunk = chunks.back();
+		chunk.used = size;
+		return chunk.base;
+	}
+
+
+	size_t ParasiteScratch::Mark()
+	{
+		/*
+			The mark is the offset of the top as if the chunks were laid end to end
+		*/
+		size_t position = 0;
+		size_t start = 0;
+		for(size_t i = 0; i < chunks.size(); i++)
+		{
+			if(chunks[i].used > 0)
+				position = start + chunks[i].used;
+			start += chunks[i].size;
+		}
+
+		return position;
+	}
+
+
+	void ParasiteScratch::Release(size_t mark)
+	{
+		size_t start = 0;
+		for(size_t i = 0; i < chunks.size(); i++)
+		{
+			if(mark <= start)
+				chunks[i].used = 0;
+			else if(mark - start < chunks[i].size)
+				chunks[i].used = std::min(chunks[i].used, mark - start);
+			start += chunks[i].size;
+		}
+
+		if(mark == 0 && chunks.size() > 1)
+		{
+			size_t capacity = GetCapacity();
+			FreeChunks();
+			AddChunk(capacity);
+		}
+	}
+
+
+	size_t ParasiteScratch::GetCapacity()
+	{
+		size_t capacity = 0;
+		for(size_t i = 0; i < chunks.size(); i++)
+			capacity += chunks[i].size;
+
+		return capacity;
+	}
+
+
+	void ParasiteHost::SetLastError(const char* error) 
+	{
+		strcpy(LastError, error);
+	}
+	
+	char* ParasiteHost::GetLastError()
+	{
+		return (char*)&LastError;
+	}
+
+
+	BOOL ParasiteHost::OpenHostFile(char* file, const char* mode)
+	{
+		hostFile = fopen(file, mode);
+		return(hostFile != NULL);
+	}
+
+
+	BOOL ParasiteHost::CloseHostFile()
+	{
+		assert(hostFile != NULL);
+		return(fclose(hostFile) == 0);
+	}
+
+	
+	BOOL ParasiteHost::Seek(unsigned int offset)
+	{
+		assert(hostFile != NULL);
+		if((offset < 0) || (offset > host.size))
+			return FALSE;
+		
+		fseek(hostFile, offset, SEEK_SET);
+		return TRUE;
+	}
+
+	
+	BOOL ParasiteHost::RSeek(unsigned int offset)
+	{
+		assert(hostFile != NULL);
+		if((offset < 0) || (offset > host.size))
+			return FALSE;
+		
+		fseek(hostFile, (host.size - offset), SEEK_SET);
+		return TRUE;
+	}
+	
+	
+	BOOL ParasiteHost::WriteItemToHost(PARASITE_ITEM* item, unsigned char* data)
+	{
+		assert(item != NULL);
+		assert(hostFile != NULL);
+
+		ParasiteTraceSpan span(trace, "WriteItemToHost", item->filename);
+		span.SetBytes(item->size);
+
+		if(verboseOutput)
+		{		  
+			if(item->data)
+				printf("\n Infecting <%s> with [%u] bytes from memory item <%s>\n", host.filename, item->size, item->filename);
+			else
+				printf("\n Infecting <%s> with [%u] bytes from File <%s>\n", host.filename, item->size, item->localpath);
+			if(item->flags > 0)
+			{
+				printf("  Using features:\n");
+				if(item->flags & FEATURE_COMPRESS)
+					printf("    compression\n");
+			}
+		}
+
+		/*
+			Large item files go through the pipeline when its buffers fit the
+			budget. Other items that cannot be held whole within the memory
+			budget are read and written a block at a time.
+		*/
+		double itemStart = StatsStart();
+		ParasiteMemoryWindow itemMemory(allocator);
+		if(data == NULL && item->data == NULL && pipelineWrites && item->size >= PIPELINE_MIN_SIZE
+		   && (memoryBudget == 0 || PipelineWorkSize(GetCompressBlockSize()) <= memoryBudget))
+		{
+			BOOL result = WritePipelinedItem(item);
+			if(result)
+				AddItemStats(item, true, itemStart, itemMemory);
+			return result;
+		}
+
+		if(data == NULL && item->data == NULL && memoryBudget != 0)
+		{
+			size_t work = (item->flags & FEATURE_COMPRESS) ? CompressWorkSize(GetCompressBlockSize()) : 0;
+			if((size_t) item->size + work > memoryBudget)
+			{
+				BOOL result = WriteStreamedItem(item);
+				if(result)
+					AddItemStats(item, true, itemStart, itemMemory);
+				return result;
+			}
+		}
+
+		/* 
+			Read item file into buffer, unless the caller already did or the
+			item was added from memory.
+		*/
+		unsigned char* itemBuf = data;
+		size_t mark = scratch.Mark();
+		if(itemBuf == NULL && item->data != NULL)
+		{
+			itemBuf = (unsigned char*) item->data;
+			double start = StatsStart();
+			md5(itemBuf, item->size, item->hash);
+			AddPhaseStats(PHASE_HASH, start, item->size);
+		}
+		else if(itemBuf == NULL)
+		{
+			unsigned char* readBuf = scratch.Alloc(item->size + 1);
+			if(!readBuf)
+			{
+				printf(" Failed to allocate [itemBuf] buffer for WriteItemToHost\n");
+				return FALSE;
+			}
+
+			FILE* readsrc = fopen(item->localpath, "rb");
+			if(readsrc == NULL)
+			{
+				printf(" Could not read input file %s\n", item->localpath);
+				scratch.Release(mark);
+				return FALSE;
+			}
+			double start = StatsStart();
+			size_t got = fread(readBuf, 1, item->size, readsrc);
+			fclose(readsrc);
+			AddPhaseStats(PHASE_SOURCE_READ, start, got);
+			if(got != item->size)
+			{
+				printf(" Failed to read %u bytes from %s\n", item->size, item->localpath);
+				scratch.Release(mark);
+				return FALSE;
+			}
+			itemBuf = readBuf;
+
+			/*
+				Calculate the HASH of the _original_ file.
+				This hash will be checked against after the file has been restored.
+			*/
+			start = StatsStart();
+			md5(itemBuf, item->size, item->hash);
+			AddPhaseStats(PHASE_HASH, start, item->size);
+		}
+
+		if(verboseOutput)
+		{
+			printf("  * %s Hash: ", item->filename);
+			for(int i = 0; i < HASH_SIZE; i++)
+				printf("%x", item->hash[i]);
+			printf("\n");			
+		}
+		
+		/* 
+			If the compression feature is set on this item, compress the file buffer
+		*/
+		if(item->flags & FEATURE_COMPRESS)
+		{
+			BOOL result = WriteCompressedBlocks(item, itemBuf);
+			scratch.Release(mark);
+			if(result)
+				AddItemStats(item, true, itemStart, itemMemory);
+			return result;
+		}
+
+		/* 
+			Append the file final data into the current working item.
+		*/
+		item->offset = ftell(hostFile);
+		double start = StatsStart();
+		fwrite(itemBuf, 1, item->size, hostFile);
+		AddPhaseStats(PHASE_HOST_WRITE, start, item->size);
+		
+		scratch.Release(mark);
+		AddItemStats(item, true, itemStart, itemMemory);
+		return ReportProgress(item->size, 0, item->filename);
+	}
+
+
+	BOOL ParasiteHost::WriteStreamedItem(PARASITE_ITEM* item)
+	{
+		FILE* readsrc = fopen(item->localpath, "rb");
+		if(readsrc == NULL)
+		{
+			printf(" Could not read input file %s\n", item->localpath);
+			return FALSE;
+		}
+
+		if(verboseOutput)
+			printf("  Streaming %s to stay within the memory budget\n", item->localpath);
+
+		BOOL result = TRUE;
+		if(item->flags & FEATURE_COMPRESS)
+			result = WriteCompressedBlocks(item, NULL, readsrc);
+		else
+		{
+			size_t mark = scratch.Mark();
+			unsigned int blockSize = GetCompressBlockSize();
+			unsigned char* block = scratch.Alloc(blockSize);
+			if(!block)
+			{
+				printf(" Failed to allocate [itemBuf] buffer for WriteStreamedItem\n");
+				fclose(readsrc);
+				return FALSE;
+			}
+
+			md5_context ctx;
+			md5_starts(&ctx);
+			item->offset = ftell(hostFile);
+			for(unsigned int done = 0; done < item->size && result; )
+			{
+				unsigned int size = item->size - done;
+				if(size > blockSize)
+					size = blockSize;
+
+				double start = StatsStart();
+				if(fread(block, 1, size, readsrc) != size)
+				{
+					printf(" Failed to read %u bytes from %s\n", item->size, item->localpath);
+					result = FALSE;
+					break;
+				}
+				AddPhaseStats(PHASE_SOURCE_READ, start, size);
+
+				start = StatsStart();
+				md5_update(&ctx, block, size);
+				AddPhaseStats(PHASE_HASH, start, size);
+
+				start = StatsStart();
+				if(fwrite(block, 1, size, hostFile) != size)
+				{
+					printf(" Failed to write item data to host\n");
+					result = FALSE;
+				}
+				AddPhaseStats(PHASE_HOST_WRITE, start, size);
+				done += size;
+
+				if(result && !ReportProgress(size, 0, item->filename))
+					result = FALSE;
+			}
+			md5_finish(&ctx, item->hash);
+			scratch.Release(mark);
+		}
+
+		fclose(readsrc);
+		if(result && verboseOutput)
+		{
+			printf("  * %s Hash: ", item->filename);
+			for(int i = 0; i < HASH_SIZE; i++)
+				printf("%x", item->hash[i]);
+			printf("\n");
+		}
+
+		return result;
+	}
+
+
+	/*
+		Stages a block of WritePipelinedItem waits for. Every slot goes from
+		the reader to the compressor to the writer and back to the reader.
+	*/
+	static const int STAGE_READ = 0;
+	static const int STAGE_COMPRESS = 1;
+	static const int STAGE_WRITE = 2;
+
+
+	/*
+		The slots and the shared state of the stages of WritePipelinedItem.
+		Block i always uses slot i % PIPELINE_SLOTS, so every stage handles
+		the blocks in order.
+	*/
+	struct ItemPipeline
+	{
+		std::mutex lock;
+		std::condition_variable changed;
+		int stage[PIPELINE_SLOTS];					// Stage each slot waits for
+		unsigned char* raw[PIPELINE_SLOTS];			// Blocks as read from the file
+		unsigned char* packed[PIPELINE_SLOTS];		// Compressed blocks, NULL when not compressing
+		const unsigned char* out[PIPELINE_SLOTS];	// Data to write, raw or packed
+		unsigned int size[PIPELINE_SLOTS];			// Bytes read into raw, then bytes of out
+		BOOL stopped;								// Set when a stage fails, the others stop too
+
+		PARASITE_ITEM* item;
+		unsigned int blockSize;
+		unsigned int blockCount;
+		FILE* source;
+		FILE* host;
+		md5_context hash;							// Hash of the original data, updated by the reader
+		unsigned int* ends;							// Stored end of every block, NULL when not compressing
+		unsigned int stored;						// Bytes written by the writer
+		BOOL clocked;								// Time the stages, for statistics or a trace
+		PARASITE_PHASE_STATS readPhases[PHASE_COUNT];	// Time of the reader, added up once it is done
+		PARASITE_PHASE_STATS writePhases[PHASE_COUNT];	// Time of the writer
+		ParasiteTrace* trace;
+	};
+
+
+	/*
+		Waits until a slot reaches a stage, FALSE if the pipeline stopped
+	*/
+	static BOOL WaitForSlot(ItemPipeline* pipeline, unsigned int slot, int stage)
+	{
+		std::unique_lock<std::mutex> guard(pipeline->lock);
+		double wait = (pipeline->trace && pipeline->stage[slot] != stage && !pipeline->stopped) ? StatsClock() : 0;
+		while(pipeline->stage[slot] != stage && !pipeline->stopped)
+			pipeline->changed.wait(guard);
+		if(wait != 0)
+			pipeline->trace->Add("wait", NULL, wait, StatsClock());
+
+		return !pipeline->stopped;
+	}
+
+
+	/*
+		Hands a slot on to the next stage
+	*/
+	static void PassSlot(ItemPipeline* pipeline, unsigned int slot, int stage)
+	{
+		{
+			std::lock_guard<std::mutex> guard(pipeline->lock);
+			pipeline->stage[slot] = stage;
+		}
+		pipeline->changed.notify_all();
+	}
+
+
+	static void StopPipeline(ItemPipeline* pipeline)
+	{
+		{
+			std::lock_guard<std::mutex> guard(pipeline->lock);
+			pipeline->stopped = TRUE;
+		}
+		pipeline->changed.notify_all();
+	}
+
+
+	/*
+		Adds the time of a stage to its phases and the trace
+	*/
+	static void AddPipelinePhase(ItemPipeline* pipeline, PARASITE_PHASE_STATS* phases, int phase, double start,
+								 unsigned long long bytes)
+	{
+		if(!pipeline->clocked)
+			return;
+
+		AddPhase(phases, phase, start, bytes);
+		if(pipeline->trace)
+			pipeline->trace->Add(ParasiteHost::GetPhaseName(phase), NULL, start, StatsClock(), bytes);
+	}
+
+
+	/*
+		Reads the blocks of the item file and hashes them
+	*/
+	static void PipelineReader(ItemPipeline* pipeline)
+	{
+		if(pipeline->trace)
+			pipeline->trace->NameThread("pipeline reader");
+
+		for(unsigned int i = 0; i < pipeline->blockCount; i++)
+		{
+			unsigned int slot = i % PIPELINE_SLOTS;
+			if(!WaitForSlot(pipeline, slot, STAGE_READ))
+				return;
+
+			unsigned int rawSize = pipeline->item->size - i * pipeline->blockSize;
+			if(rawSize > pipeline->blockSize)
+				rawSize = pipeline->blockSize;
+
+			double start = pipeline->clocked ? StatsClock() : 0;
+			if(fread(pipeline->raw[slot], 1, rawSize, pipeline->source) != rawSize)
+			{
+				printf(" Failed to read %u bytes from %s\n", pipeline->item->size, pipeline->item->localpath);
+				StopPipeline(pipeline);
+				return;
+			}
+			AddPipelinePhase(pipeline, pipeline->readPhases, PHASE_SOURCE_READ, start, rawSize);
+
+			start = pipeline->clocked ? StatsClock() : 0;
+			md5_update(&pipeline->hash, pipeline->raw[slot], rawSize);
+			AddPipelinePhase(pipeline, pipeline->readPhases, PHASE_HASH, start, rawSize);
+
+			pipeline->size[slot] = rawSize;
+			PassSlot(pipeline, slot, STAGE_COMPRESS);
+		}
+	}
+
+
+	/*
+		Appends the blocks to the host and notes where each one ends
+	*/
+	static void PipelineWriter(ItemPipeline* pipeline)
+	{
+		if(pipeline->trace)
+			pipeline->trace->NameThread("pipeline writer");
+
+		for(unsigned int i = 0; i < pipeline->blockCount; i++)
+		{
+			unsigned int slot = i % PIPELINE_SLOTS;
+			if(!WaitForSlot(pipeline, slot, STAGE_WRITE))
+				return;
+
+			unsigned int size = pipeline->size[slot];
+			double start = pipeline->clocked ? StatsClock() : 0;
+			if(fwrite(pipeline->out[slot], 1, size, pipeline->host) != size)
+			{
+				printf(" Failed to write item data to host\n");
+				StopPipeline(pipeline);
+				return;
+			}
+			AddPipelinePhase(pipeline, pipeline->writePhases, PHASE_HOST_WRITE, start, size);
+
+			pipeline->stored += size;
+			if(pipeline->ends)
+				pipeline->ends[i] = pipeline->stored;
+			PassSlot(pipeline, slot, STAGE_READ);
+		}
+	}
+
+
+	BOOL ParasiteHost::WritePipelinedItem(PARASITE_ITEM* item)
+	{
+		FILE* readsrc = fopen(item->localpath, "rb");
+		if(readsrc == NULL)
+		{
+			printf(" Could not read input file %s\n", item->localpath);
+			return FALSE;
+		}
+
+		if(verboseOutput)
+			printf("  Pipelining %s through read, compress and write\n", item->localpath);
+
+		BOOL compress = (item->flags & FEATURE_COMPRESS) != 0;
+		ItemPipeline pipeline;
+		pipeline.blockSize = GetCompressBlockSize();
+		pipeline.blockCount = item->size / pipeline.blockSize + (item->size % pipeline.blockSize ? 1 : 0);
+
+		size_t mark = scratch.Mark();
+		unsigned int bufsize = (pipeline.blockSize * 104 + 50) / 100 + 384;
+		unsigned int* work = compress ? (unsigned int*) scratch.Alloc(sizeof(unsigned int) * (65536 + pipeline.blockSize)) : NULL;
+		BOOL allocated = !compress || work;
+		for(int i = 0; i < PIPELINE_SLOTS; i++)
+		{
+			pipeline.stage[i] = STAGE_READ;
+			pipeline.raw[i] = scratch.Alloc(pipeline.blockSize);
+			pipeline.packed[i] = compress ? scratch.Alloc(bufsize) : NULL;
+			if(!pipeline.raw[i] || (compress && !pipeline.packed[i]))
+				allocated = FALSE;
+		}
+		if(!allocated)
+		{
+			printf(" Failed to allocate the pipeline buffers\n");
+			scratch.Release(mark);
+			fclose(readsrc);
+			return FALSE;
+		}
+
+		/*
+			Compressed items start with their block index, reserved here and
+			written again once the writer knows where every block ends
+		*/
+		std::vector<unsigned int> ends(compress ? pipeline.blockCount : 0);
+		HeldMemory endsMemory(allocator, ends.capacity() * sizeof(unsigned int));
+		item->offset = ftell(hostFile);
+		if(compress)
+		{
+			if(verboseOutput)
+				printf("  Original file size: %u\n", item->size);
+
+			if(Write(pipeline.blockSize) != 1 || Write(pipeline.blockCount) != 1
+			   || (pipeline.blockCount > 0
+				   && fwrite(&ends[0], sizeof(unsigned int), pipeline.blockCount, hostFile) != pipeline.blockCount))
+			{
+				printf(" Failed to write the block index to host\n");
+				scratch.Release(mark);
+				fclose(readsrc);
+				return FALSE;
+			}
+		}
+
+		pipeline.stopped = FALSE;
+		pipeline.item = item;
+		pipeline.source = readsrc;
+		pipeline.host = hostFile;
+		pipeline.ends = compress && pipeline.blockCount > 0 ? &ends[0] : NULL;
+		pipeline.stored = 0;
+		pipeline.clocked = collectStats || trace;
+		pipeline.trace = trace;
+		memset(pipeline.readPhases, 0, sizeof(pipeline.readPhases));
+		memset(pipeline.writePhases, 0, sizeof(pipeline.writePhases));
+		md5_starts(&pipeline.hash);
+
+		std::thread reader(PipelineReader, &pipeline);
+		std::thread writer(PipelineWriter, &pipeline);
+
+		/*
+			Compress on this thread, between the reader and the writer.
+			Blocks that do not shrink are stored raw.
+		*/
+		BOOL result = TRUE;
+		for(unsigned int i = 0; i < pipeline.blockCount; i++)
+		{
+			unsigned int slot = i % PIPELINE_SLOTS;
+			if(!WaitForSlot(&pipeline, slot, STAGE_COMPRESS))
+			{
+				result = FALSE;
+				break;
+			}
+
+			unsigned int rawSize = pipeline.size[slot];
+			pipeline.out[slot] = pipeline.raw[slot];
+			if(compress)
+			{
+				double start = StatsStart();
+				unsigned int size = LZ_CompressFast(pipeline.raw[slot], pipeline.packed[slot], rawSize, work);
+				AddPhaseStats(PHASE_COMPRESS, start, rawSize);
+				if(size < rawSize)
+				{
+					pipeline.out[slot] = pipeline.packed[slot];
+					pipeline.size[slot] = size;
+				}
+			}
+			PassSlot(&pipeline, slot, STAGE_WRITE);
+
+			if(!ReportProgress(rawSize, 0, item->filename))
+			{
+				result = FALSE;
+				break;
+			}
+		}
+
+		if(!result)
+			StopPipeline(&pipeline);
+		reader.join();
+		writer.join();
+		if(pipeline.stopped)
+			result = FALSE;
+
+		for(int i = 0; collectStats && i < PHASE_COUNT; i++)
+		{
+			PARASITE_PHASE_STATS* phases[2] = { pipeline.readPhases, pipeline.writePhases };
+			for(int j = 0; j < 2; j++)
+			{
+				stats.phases[i].seconds += phases[j][i].seconds;
+				stats.phases[i].bytes += phases[j][i].bytes;
+				stats.phases[i].calls += phases[j][i].calls;
+			}
+		}
+
+		fclose(readsrc);
+		scratch.Release(mark);
+		md5_finish(&pipeline.hash, item->hash);
+		if(!result)
+			return FALSE;
+
+		if(compress)
+		{
+			long end = ftell(hostFile);
+			if(end < 0 || fseek(hostFile, item->offset + sizeof(unsigned int) * 2, SEEK_SET) != 0
+			   || (pipeline.blockCount > 0
+				   && fwrite(&ends[0], sizeof(unsigned int), pipeline.blockCount, hostFile) != pipeline.blockCount)
+			   || fseek(hostFile, end, SEEK_SET) != 0)
+			{
+				printf(" Failed to write the block index to host\n");
+				return FALSE;
+			}
+
+			item->flags |= FEATURE_BLOCKS;
+			item->lzSize = item->size;
+			item->size = sizeof(unsigned int) * (2 + pipeline.blockCount) + pipeline.stored;
+
+			if(verboseOutput)
+				printf("  Finished compress with size: %u\n", item->size);
+		}
+
+		if(verboseOutput)
+		{
+			printf("  * %s Hash: ", item->filename);
+			for(int i = 0; i < HASH_SIZE; i++)
+				printf("%x", item->hash[i]);
+			printf("\n");
+		}
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::WriteCompressedBlocks(PARASITE_ITEM* item, unsigned char* data, FILE* source)
+	{
+		unsigned int blockSize = GetCompressBlockSize();
+		unsigned int blockCount = item->size / blockSize + (item->size % blockSize ? 1 : 0);
+
+		/* 
+			These allocations are calculated from lz4 worst case compress size.
+			TODO: I Believe that this calculation is incorrect (too large) fix it! 
+		*/
+		unsigned int bufsize = (blockSize * 104 + 50) / 100 + 384;
+		size_t mark = scratch.Mark();
+		unsigned char* buf = scratch.Alloc(bufsize);
+		unsigned int* work = (unsigned int*) scratch.Alloc(sizeof(unsigned int) * (65536 + blockSize));
+		unsigned char* block = data ? NULL : scratch.Alloc(blockSize);
+		if(!buf || !work || (!data && !block))
+		{
+			printf(" Failed to allocate work buffer for compress\n");
+			scratch.Release(mark);
+			return FALSE;
+		}
+
+		if(verboseOutput)
+			printf("  Original file size: %u\n", item->size);
+
+		/*
+			The block index goes first. It is written once to reserve the space,
+			and again when the compressed size of every block is known.
+		*/
+		std::vector<unsigned int> ends(blockCount);
+		item->offset = ftell(hostFile);
+		BOOL result = Write(blockSize) == 1 && Write(blockCount) == 1
+					  && (blockCount == 0 || fwrite(&ends[0], sizeof(unsigned int), blockCount, hostFile) == blockCount);
+
+		md5_context ctx;
+		if(!data)
+			md5_starts(&ctx);
+
+		unsigned int stored = 0;
+		for(unsigned int i = 0; i < blockCount && result; i++)
+		{
+			unsigned int rawSize = item->size - i * blockSize;
+			if(rawSize > blockSize)
+				rawSize = blockSize;
+
+			unsigned char* in;
+			if(data)
+				in = data + i * blockSize;
+			else
+			{
+				in = block;
+				double start = StatsStart();
+				if(fread(block, 1, rawSize, source) != rawSize)
+				{
+					printf(" Failed to read %u bytes from %s\n", item->size, item->localpath);
+					scratch.Release(mark);
+					return FALSE;
+				}
+				AddPhaseStats(PHASE_SOURCE_READ, start, rawSize);
+
+				start = StatsStart();
+				md5_update(&ctx, block, rawSize);
+				AddPhaseStats(PHASE_HASH, start, rawSize);
+			}
+
+			/*
+				Blocks that do not shrink are stored raw
+			*/
+			double start = StatsStart();
+			unsigned int size = LZ_CompressFast(in, buf, rawSize, work);
+			AddPhaseStats(PHASE_COMPRESS, start, rawSize);
+
+			start = StatsStart();
+			if(size >= rawSize)
+			{
+				size = rawSize;
+				result = (fwrite(in, 1, size, hostFile) == size);
+			}
+			else
+				result = (fwrite(buf, 1, size, hostFile) == size);
+			AddPhaseStats(PHASE_HOST_WRITE, start, size);
+
+			if(!result)
+				break;
+
+			stored += size;
+			ends[i] = stored;
+
+			if(!ReportProgress(rawSize, 0, item->filename))
+			{
+				scratch.Release(mark);
+				return FALSE;
+			}
+		}
+
+		scratch.Release(mark);
+		if(!data)
+			md5_finish(&ctx, item->hash);
+
+		if(!result)
+		{
+			printf(" Failed to write compressed data to host\n");
+			return FALSE;
+		}
+
+		/*
+			An index left zeroed would make the item unreadable, so a failed
+			rewrite fails the item
+		*/
+		long end = ftell(hostFile);
+		if(end < 0 || fseek(hostFile, item->offset + sizeof(unsigned int) * 2, SEEK_SET) != 0
+		   || (blockCount > 0 && fwrite(&ends[0], sizeof(unsigned int), blockCount, hostFile) != blockCount)
+		   || fseek(hostFile, end, SEEK_SET) != 0)
+		{
+			printf(" Failed to write the block index to host\n");
+			return FALSE;
+		}
+
+		item->flags |= FEATURE_BLOCKS;
+		item->lzSize = item->size;
+		item->size = sizeof(unsigned int) * (2 + blockCount) + stored;
+
+		if(verboseOutput)
+			printf("  Finished compress with size: %u\n", item->size);
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::WriteItemBatch(PARASITE_ITEM** items, int count)
+	{
+		assert(count <= HASH_BATCH_ITEMS);
+
+		unsigned char* buffers[HASH_BATCH_ITEMS];
+		unsigned int sizes[HASH_BATCH_ITEMS];
+		unsigned char hashes[HASH_BATCH_ITEMS][HASH_SIZE];
+		BOOL result = TRUE;
+		size_t mark = scratch.Mark();
+		ParasiteTraceSpan span(trace, "WriteItemBatch");
+		int loaded;
+
+		/*
+			Read every file of the batch into memory. Items added from memory
+			are hashed where they are.
+		*/
+		for(loaded = 0; loaded < count; loaded++)
+		{
+			PARASITE_ITEM* item = items[loaded];
+			sizes[loaded] = item->size;
+			if(item->data)
+			{
+				buffers[loaded] = (unsigned char*) item->data;
+				continue;
+			}
+
+			buffers[loaded] = scratch.Alloc(item->size + 1);
+			if(!buffers[loaded])
+			{
+				printf(" Failed to allocate [itemBuf] buffer for WriteItemBatch\n");
+				result = FALSE;
+				break;
+			}
+
+			if(io != NULL)
+				continue;
+
+			FILE* readsrc = fopen(item->localpath, "rb");
+			if(readsrc == NULL)
+			{
+				printf(" Could not read input file %s\n", item->localpath);
+				result = FALSE;
+				break;
+			}
+			double start = StatsStart();
+			size_t got = fread(buffers[loaded], 1, item->size, readsrc);
+			fclose(readsrc);
+			AddPhaseStats(PHASE_SOURCE_READ, start, got);
+			if(got != item->size)
+			{
+				printf(" Failed to read %u bytes from %s\n", item->size, item->localpath);
+				result = FALSE;
+				break;
+			}
+		}
+
+		if(result && io != NULL)
+			result = ReadItemFiles(items, count, buffers);
+
+		/*
+			Hash the whole batch in parallel lanes, then write the items out in order
+		*/
+		if(result)
+		{
+			double start = StatsStart();
+			md5_mb(count, buffers, sizes, hashes);
+			unsigned long long hashed = 0;
+			for(int i = 0; i < count; i++)
+				hashed += sizes[i];
+			AddPhaseStats(PHASE_HASH, start, hashed);
+
+			for(int i = 0; i < count; i++)
+			{
+				memcpy(items[i]->hash, hashes[i], HASH_SIZE);
+				if(WriteItemToHost(items[i], buffers[i]) == FALSE || !ReportProgress(0, 1, NULL))
+				{
+					result = FALSE;
+					break;
+				}
+			}
+		}
+
+		scratch.Release(mark);
+		return result;
+	}
+
+
+	BOOL ParasiteHost::ReadItemFiles(PARASITE_ITEM** items, int count, unsigned char** buffers)
+	{
+#ifdef LINUX
+		PARASITE_IO_REQUEST requests[HASH_BATCH_ITEMS];
+		BOOL inFlight[HASH_BATCH_ITEMS];
+		BOOL result = TRUE;
+		unsigned long long bytes = 0;
+		double start = StatsStart();
+
+		for(int i = 0; i < count; i++)
+			inFlight[i] = FALSE;
+
+		for(int i = 0; i <= count; i++)
+		{
+			/*
+				Keep the queue within its depth, and empty it after the last file
+			*/
+			while(io->GetPending() > 0 && (i == count || io->GetPending() >= ioDepth))
+			{
+				PARASITE_IO_REQUEST* done = io->Wait();
+				if(done == NULL)
+				{
+					/*
+						The requests left may still fill the buffers, which are
+						released by the caller, so the engine goes first
+					*/
+					AbandonIO();
+					printf(" Failed to read the input files: %s\n", GetLastError());
+					for(int j = 0; j < count; j++)
+						if(inFlight[j])
+							close(requests[j].fd);
+					AddPhaseStats(PHASE_SOURCE_READ, start, bytes);
+					return FALSE;
+				}
+
+				PARASITE_ITEM* item = (PARASITE_ITEM*) done->tag;
+				if(done->result > 0 && (size_t) done->result < done->size)
+				{
+					bytes += done->result;
+					done->buffer += done->result;
+					done->offset += done->result;
+					done->size -= done->result;
+					if(io->Submit(done))
+						continue;
+				}
+
+				close(done->fd);
+				inFlight[done - requests] = FALSE;
+				if(done->result == (long long) done->size)
+					bytes += done->size;
+				else if(result)
+				{
+					printf(" Failed to read %u bytes from %s\n", item->size, item->localpath);
+					result = FALSE;
+				}
+			}
+
+			if(i == count || items[i]->data || !result)
+				continue;
+
+			PARASITE_IO_REQUEST& request = requests[i];
+			request.fd = open(items[i]->localpath, O_RDONLY);
+			if(request.fd < 0)
+			{
+				printf(" Could not read input file %s\n", items[i]->localpath);
+				result = FALSE;
+				continue;
+			}
+
+			request.write = FALSE;
+			request.buffer = buffers[i];
+			request.size = items[i]->size;
+			request.offset = 0;
+			request.tag = items[i];
+			if(!io->Submit(&request))
+			{
+				close(request.fd);
+				printf(" Could not read input file %s\n", items[i]->localpath);
+				result = FALSE;
+			}
+			else
+				inFlight[i] = TRUE;
+		}
+
+		AddPhaseStats(PHASE_SOURCE_READ, start, bytes);
+		return result;
+#else
+		return FALSE;
+#endif
+	}
+
+
+	void ParasiteHost::AbandonIO()
+	{
+		delete io;
+		io = NULL;
+		SetLastError("The I/O engine failed, stdio is used from now on");
+	}
+
+
+	BOOL ParasiteHost::SetIOEngine(int engine, unsigned int depth)
+	{
+		delete io;
+		io = NULL;
+		ioDepth = depth ? depth : IO_QUEUE_DEPTH;
+		if(engine == IO_ENGINE_SYNC)
+			return TRUE;
+
+		io = ParasiteIO::Create(engine, ioDepth);
+		if(io == NULL)
+		{
+			SetLastError("I/O engine is not available on this system");
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+
+	const char* ParasiteHost::GetIOEngineName()
+	{
+		return io ? io->GetName() : "stdio";
+	}
+
+
+	BOOL ParasiteHost::SetDirectIO(BOOL enable)
+	{
+#ifdef LINUX
+		directIO = enable;
+		return TRUE;
+#else
+		directIO = FALSE;
+		if(enable)
+			SetLastError("Direct I/O is not available on this system");
+		return !enable;
+#endif
+	}
+
+
+	BOOL ParasiteHost::OpenDirectFile(ParasiteDirectFile& file, const char* path, BOOL write)
+	{
+		if(!file.Open(path, write))
+			return FALSE;
+
+		stats.direct.files++;
+		if(file.IsDirect())
+			stats.direct.direct++;
+		return TRUE;
+	}
+
+
+	void ParasiteHost::AddDirectStats(double seconds, unsigned long long bytesRead, unsigned long long bytesWritten)
+	{
+		if(!collectStats)
+			return;
+
+		stats.direct.seconds += seconds;
+		stats.direct.bytesRead += bytesRead;
+		stats.direct.bytesWritten += bytesWritten;
+	}
+
+
+	void ParasiteHost::SetVerboseOutput(BOOL verbose)
+	{
+		verboseOutput = verbose;
+	}
+
+
+	void ParasiteHost::SetMemoryBudget(size_t bytes)
+	{
+		memoryBudget = bytes;
+	}
+
+
+	void ParasiteHost::SetPipelinedWrites(BOOL enable)
+	{
+		pipelineWrites = enable;
+	}
+
+
+	void ParasiteHost::SetCollectStats(BOOL collect)
+	{
+		if(collect && !collectStats)
+			ResetStats();
+		collectStats = collect;
+	}
+
+
+	void ParasiteHost::ResetStats()
+	{
+		memset(stats.phases, 0, sizeof(stats.phases));
+		memset(&stats.direct, 0, sizeof(stats.direct));
+		stats.items.clear();
+		stats.operations.clear();
+		stats.seconds = 0;
+		statsStart = StatsClock();
+
+		/*
+			Opening a window that is never closed restarts the peak
+		*/
+		allocator.OpenWindow();
+		statsAllocations = allocator.GetAllocations();
+	}
+
+
+	const PARASITE_STATS& ParasiteHost::GetStats()
+	{
+		UpdateTableMemory();
+		stats.seconds = StatsClock() - statsStart;
+		stats.memory.current = allocator.GetCurrent();
+		stats.memory.peak = allocator.GetPeak();
+		stats.memory.allocations = allocator.GetAllocations() - statsAllocations;
+		return stats;
+	}
+
+
+	double ParasiteHost::StatsStart()
+	{
+		return (collectStats || trace) ? StatsClock() : 0;
+	}
+
+
+	void ParasiteHost::AddPhaseStats(int phase, double start, unsigned long long bytes)
+	{
+		AddPhase(collectStats ? stats.phases : NULL, phase, start, bytes);
+		if(trace)
+			trace->Add(GetPhaseName(phase), NULL, start, StatsClock(), bytes);
+	}
+
+
+	void ParasiteHost::SetTrace(ParasiteTrace* trace)
+	{
+		this->trace = trace;
+	}
+
+
+	void ParasiteHost::AddItemStats(const PARASITE_ITEM* item, BOOL written, double start, const ParasiteMemoryWindow& window)
+	{
+		if(!collectStats)
+			return;
+
+		PARASITE_ITEM_STATS record;
+		record.name = item->filename;
+		record.written = written;
+		record.original = GetOriginalSize(*item);
+		record.stored = item->size;
+		record.seconds = StatsClock() - start;
+		record.memory = window.GetStats();
+		stats.items.push_back(record);
+	}
+
+
+	ParasiteHost::OperationStats::OperationStats(ParasiteHost* host, const char* name)
+		: host(host), name(name), start(host->StatsStart()), window(host->allocator)
+	{
+	}
+
+
+	ParasiteHost::OperationStats::~OperationStats()
+	{
+		if(!host->collectStats)
+			return;
+
+		host->UpdateTableMemory();
+		PARASITE_OPERATION_STATS record;
+		record.name = name;
+		record.seconds = StatsClock() - start;
+		record.memory = window.GetStats();
+		host->stats.operations.push_back(record);
+	}
+
+
+	void ParasiteHost::UpdateTableMemory()
+	{
+		size_t held = itemStore.GetMemoryUsage() + tableBody.capacity() + entryNames.capacity()
+					  + tableEntries.capacity() * sizeof(PARASITE_TABLE_ENTRY) + dirList.capacity() * sizeof(PARASITE_DIR)
+					  + (newItems.capacity() + itemList.capacity()) * sizeof(PARASITE_ITEM)
+					  + blockIndexes.size() * sizeof(PARASITE_BLOCK_INDEX);
+
+		if(held > tableMemory)
+			allocator.Hold(held - tableMemory);
+		else
+			allocator.Drop(tableMemory - held);
+		tableMemory = held;
+	}
+
+
+	void ParasiteHost::SetProgressCallback(PARASITE_PROGRESS_CALLBACK callback, void* context)
+	{
+		progressCallback = callback;
+		progressContext = context;
+	}
+
+
+	void ParasiteHost::StartProgress(unsigned int items, unsigned long long bytes)
+	{
+		progressActive = (progressCallback != NULL);
+		progressCancelled = FALSE;
+		if(!progressActive)
+			return;
+
+		memset(&progress, 0, sizeof(progress));
+		progress.itemsTotal = items;
+		progress.bytesTotal = bytes;
+		progress.eta = -1;
+		progressStart = StatsClock();
+		rateTime = progressStart;
+		rateBytes = 0;
+	}
+
+
+	BOOL ParasiteHost::ReportProgress(unsigned long long bytes, unsigned int items, const char* current)
+	{
+		if(!progressActive)
+			return TRUE;
+
+		progress.bytesDone += bytes;
+		progress.itemsDone += items;
+		progress.current = current;
+
+		/*
+			The rate is measured over windows of half a second or more so it
+			follows changes in speed, the first window uses the average so far
+		*/
+		double now = StatsClock();
+		progress.seconds = now - progressStart;
+		if(now - rateTime >= 0.5)
+		{
+			progress.rate = (progress.bytesDone - rateBytes) / (now - rateTime);
+			rateTime = now;
+			rateBytes = progress.bytesDone;
+		}
+		else if(rateBytes == 0 && progress.seconds > 0)
+			progress.rate = progress.bytesDone / progress.seconds;
+
+		if(progress.rate > 0 && progress.bytesTotal >= progress.bytesDone)
+			progress.eta = (progress.bytesTotal - progress.bytesDone) / progress.rate;
+
+		if(!progressCallback(progressContext, &progress))
+		{
+			SetLastError("Cancelled");
+			progressActive = FALSE;
+			progressCancelled = TRUE;
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+
+	void ParasiteHost::EndProgress()
+	{
+		progressActive = FALSE;
+	}
+
+
+	const char* ParasiteHost::GetPhaseName(int phase)
+	{
+		static const char* names[PHASE_COUNT] = { "source_read", "hash", "compress", "host_write", "table_read",
+												  "table_write", "host_read", "decompress", "verify", "output_write" };
+
+		return (phase >= 0 && phase < PHASE_COUNT) ? names[phase] : "unknown";
+	}
+
+
+	void WriteJsonString(FILE* out, const char* text)
+	{
+		fputc('"', out);
+		for(const unsigned char* c = (const unsigned char*) text; *c; c++)
+		{
+			if(*c == '"' || *c == '\\')
+				fprintf(out, "\\%c", *c);
+			else if(*c < 0x20)
+				fprintf(out, "\\u%04x", *c);
+			else
+				fputc(*c, out);
+		}
+		fputc('"', out);
+	}
+
+
+	void ParasiteHost::DumpStats(FILE* out)
+	{
+		const PARASITE_STATS& current = GetStats();
+
+		fprintf(out, "{\n  \"seconds\": %.6f,\n", current.seconds);
+		fprintf(out, "  \"memory\": {\"current\": %llu, \"peak\": %llu, \"allocations\": %llu},\n",
+				current.memory.current, current.memory.peak, current.memory.allocations);
+		fprintf(out, "  \"phases\": {\n");
+		for(int i = 0; i < PHASE_COUNT; i++)
+		{
+			const PARASITE_PHASE_STATS& phase = current.phases[i];
+			double rate = phase.seconds > 0 ? phase.bytes / phase.seconds / 1e6 : 0;
+			fprintf(out, "    \"%s\": {\"seconds\": %.6f, \"bytes\": %llu, \"calls\": %u, \"mb_s\": %.1f}%s\n",
+					GetPhaseName(i), phase.seconds, phase.bytes, phase.calls, rate, i + 1 < PHASE_COUNT ? "," : "");
+		}
+
+		const PARASITE_DIRECT_STATS& direct = current.direct;
+		fprintf(out, "  },\n  \"direct_io\": {\"files\": %u, \"o_direct\": %u, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+				"\"seconds\": %.6f, \"mb_s\": %.1f},\n", direct.files, direct.direct, direct.bytesRead, direct.bytesWritten,
+				direct.seconds, direct.seconds > 0 ? (direct.bytesRead + direct.bytesWritten) / direct.seconds / 1e6 : 0);
+		fprintf(out, "  \"operations\": [");
+		for(size_t i = 0; i < current.operations.size(); i++)
+		{
+			const PARASITE_OPERATION_STATS& operation = current.operations[i];
+			fprintf(out, "%s\n    {\"name\": \"%s\", \"seconds\": %.6f, \"memory\": %llu, \"peak_memory\": %llu, "
+					"\"allocations\": %llu}", i ? "," : "", operation.name, operation.seconds, operation.memory.current,
+					operation.memory.peak, operation.memory.allocations);
+		}
+		fprintf(out, "%s],\n  \"items\": [", current.operations.empty() ? "" : "\n  ");
+		for(size_t i = 0; i < current.items.size(); i++)
+		{
+			const PARASITE_ITEM_STATS& item = current.items[i];
+			fprintf(out, "%s\n    {\"name\": ", i ? "," : "");
+			WriteJsonString(out, item.name.c_str());
+			fprintf(out, ", \"operation\": \"%s\", \"original\": %u, \"stored\": %u, \"ratio\": %.4f, \"seconds\": %.6f, "
+					"\"peak_memory\": %llu, \"allocations\": %llu}", item.written ? "write" : "extract", item.original,
+					item.stored, item.original ? (double) item.stored / item.original : 0, item.seconds, item.memory.peak,
+					item.memory.allocations);
+		}
+		fprintf(out, "%s]\n}\n", current.items.empty() ? "" : "\n  ");
+	}
+
+
+	unsigned int ParasiteHost::GetCompressBlockSize()
+	{
+		/*
+			The LZ hash table is a fixed cost, only the block dependent part
+			shrinks. Half the budget is left for the item buffers.
+		*/
+		unsigned int blockSize = BLOCK_SIZE;
+		while(memoryBudget != 0 && blockSize > MIN_BLOCK_SIZE
+			  && CompressWorkSize(blockSize) + blockSize > memoryBudget / 2)
+			blockSize /= 2;
+
+		return blockSize;
+	}
+
+
+	unsigned int ParasiteHost::GetBatchLimit()
+	{
+		if(memoryBudget != 0 && memoryBudget / 4 < HASH_BATCH_SIZE)
+			return (unsigned int) (memoryBudget / 4);
+
+		return HASH_BATCH_SIZE;
+	}
+
+
+	void ParasiteHost::SetLazyTable(BOOL lazy, BOOL index)
+	{
+		lazyTable = lazy;
+		indexEntries = index;
+	}
+
+
+	void ParasiteHost::SetScratchHugePages(BOOL use)
+	{
+		scratch.SetHugePages(use);
+	}
+
+
+	BOOL ParasiteHost::SetTableFormat(unsigned char format, BOOL compress)
+	{
+		if(format != TABLE_FORMAT_TREE && format != TABLE_FORMAT_COMPACT && format != TABLE_FORMAT_MAPPED)
+		{
+			SetLastError("Unsupported table format");
+			return FALSE;
+		}
+
+		tableFormat = format;
+		compressTable = compress;
+		return TRUE;
+	}
+
+
+	unsigned int ParasiteHost::GetSize()
+	{
+		assert(hostFile != NULL);
+		fseek(hostFile, 0, SEEK_END);
 		return ftell(hostFile);
 	}
 
 
-	void ParasiteHost::DumpItems()
+	void ParasiteHost::DumpItems(const char* prefix)
+	{
+		if(!LoadTable())
+			return;
+		if(!tableSorted)
+			SortTable();
+
+		std::vector<unsigned int> indexes;
+		FindPrefixIndexes(prefix, &indexes);
+
+		for(unsigned int n = 0; n < indexes.size(); n++)
+		{
+			unsigned int item = indexes[n];
+			const unsigned char* hash = itemStore.GetHash(item);
+			
+			//printf("FileName\tFlags\tSize\tOffset\n");
+			printf("\n");
+			printf("%s\n", itemStore.GetName(item));
+			printf("  flags:       %u\n", itemStore.GetFlags(item));
+			printf("  size:        %u\n", itemStore.GetSize(item));
+			printf("  offset:      %d\n", itemStore.GetOffset(item));
+			printf("  lzSize:      %u\n", itemStore.GetLzSize(item));
+			printf("  hash: \t");
+			for(int i = 0; i < HASH_SIZE; i++)
+				printf("%x", hash[i]);
+			printf("\n");
+			printf("\n");
+		}
+	}
+
+
+	void ParasiteHost::AddItem(PARASITE_ITEM & item)
+	{
+		newItems.push_back(item);
+		UpdateTableMemory();
+	}
+
+
+	void ParasiteHost::SortTable()
+	{
+		std::vector<unsigned int> order(itemStore.GetCount());
+		for(unsigned int i = 0; i < order.size(); i++)
+			order[i] = i;
+
+		StoreOrder compare;
+		compare.items = &itemStore;
+		if(!std::is_sorted(order.begin(), order.end(), compare))
+		{
+			std::stable_sort(order.begin(), order.end(), compare);
+			itemStore.Reorder(order);
+			itemListCurrent = FALSE;
+			foundIndex.clear();
+		}
+
+		/*
+			Walk the sorted items keeping the chain of open directories, so every
+			directory, including ones holding only subdirectories, is emitted in
+			depth-first order before anything below it.
+		*/
+		PARASITE_DIR root;
+		root.parent = 0;
+		root.firstItem = 0;
+		root.itemCount = 0;
+		dirList.clear();
+		dirList.push_back(root);
+
+		std::vector<unsigned int> open(1, 0);
+		for(unsigned int i = 0; i < itemStore.GetCount(); i++)
+		{
+			const char* path = itemStore.GetName(i);
+			size_t length = DirLength(path);
+
+			/*
+				Close directories that are not ancestors of this item
+			*/
+			while(open.size() > 1)
+			{
+				const std::string& top = dirList[open.back()].path;
+				if(top.size() <= length && memcmp(top.c_str(), path, top.size()) == 0
+				   && (top.size() == length || path[top.size()] == '/'))
+					break;
+
+				dirList[open.back()].dirEnd = dirList.size();
+				open.pop_back();
+			}
+
+			/*
+				Open the missing directories down to the item's own
+			*/
+			while(dirList[open.back()].path.size() < length)
+			{
+				/*
+					Empty components are skipped, so every directory opened is
+					longer than its parent
+				*/
+				size_t start = dirList[open.back()].path.size();
+				if(start > 0)
+					start++;
+				while(start < length && path[start] == '/')
+					start++;
+				const char* slash = (const char*) memchr(path + start, '/', length - start);
+				size_t end = slash ? slash - path : length;
+
+				PARASITE_DIR dir;
+				dir.path.assign(path, end);
+				dir.parent = open.back();
+				dir.firstItem = i;
+				dir.itemCount = 0;
+				open.push_back(dirList.size());
+				dirList.push_back(dir);
+			}
+
+			dirList[open.back()].itemCount++;
+		}
+
+		while(!open.empty())
+		{
+			dirList[open.back()].dirEnd = dirList.size();
+			open.pop_back();
+		}
+
+		/*
+			Directories without items of their own point at the position they
+			would have in the table
+		*/
+		unsigned int next = 0;
+		for(unsigned int d = 0; d < dirList.size(); d++)
+		{
+			if(dirList[d].itemCount == 0)
+				dirList[d].firstItem = next;
+			next = dirList[d].firstItem + dirList[d].itemCount;
+		}
+
+		tableSorted = TRUE;
+	}
+
+
+	int ParasiteHost::FindDirectory(const char* path, size_t length)
+	{
+		int low = 0;
+		int high = (int) dirList.size() - 1;
+		while(low <= high)
+		{
+			int middle = (low + high) / 2;
+			const std::string& dir = dirList[middle].path;
+			int order = CompareDirPath(dir.c_str(), dir.size(), path, length);
+			if(order == 0)
+				return middle;
+			if(order < 0)
+				low = middle + 1;
+			else
+				high = middle - 1;
+		}
+
+		return -1;
+	}
+
+
+	const PARASITE_ITEM* ParasiteHost::FindItem(const char* itemName)
+	{
+		if(!tableLoaded)
+			return FindLazyItem(itemName);
+
+		/*
+			Items added since the table was sorted are put in order first
+		*/
+		if(!tableSorted)
+			SortTable();
+
+		int dir = FindDirectory(itemName, DirLength(itemName));
+		if(dir < 0)
+			return NULL;
+
+		unsigned int last = dirList[dir].firstItem + dirList[dir].itemCount;
+		const char* leaf = LeafName(itemName);
+
+		unsigned int found = LowerBoundLeaf(itemStore, dirList[dir].firstItem, last, leaf);
+		if(found == last || strcmp(LeafName(itemStore.GetName(found)), leaf) != 0)
+			return NULL;
+
+		return KeepFoundItem(found, NULL);
+	}
+
+
+	const PARASITE_ITEM* ParasiteHost::KeepFoundItem(unsigned int index, const PARASITE_ITEM* item)
+	{
+		if(index >= foundIndex.size())
+			foundIndex.resize(index >= host.items ? index + 1 : host.items, 0);
+
+		if(foundIndex[index] == 0)
+		{
+			foundItems.push_back(PARASITE_ITEM());
+			if(item)
+				foundItems.back() = *item;
+			else
+				itemStore.GetItem(index, &foundItems.back());
+			foundIndex[index] = foundItems.size();
+		}
+
+		return &foundItems[foundIndex[index] - 1];
+	}
+
+
+	BOOL ParasiteHost::ListDirectory(const char* path, std::vector<const PARASITE_ITEM*>* items,
+									 std::vector<std::string>* subdirs)
+	{
+		items->clear();
+		if(subdirs)
+			subdirs->clear();
+
+		if(!LoadTable())
+			return FALSE;
+		if(!tableSorted)
+			SortTable();
+
+		if(path == NULL)
+			path = "";
+
+		size_t length = strlen(path);
+		if(length > 0 && path[length - 1] == '/')
+			length--;
+
+		int dir = FindDirectory(path, length);
+		if(dir < 0)
+			return FALSE;
+
+		MakeItemList();
+
+		const PARASITE_DIR& entry = dirList[dir];
+		for(unsigned int i = 0; i < entry.itemCount; i++)
+			items->push_back(&itemList[entry.firstItem + i]);
+
+		if(subdirs)
+			for(unsigned int d = dir + 1; d < entry.dirEnd; d = dirList[d].dirEnd)
+				subdirs->push_back(dirList[d].path);
+
+		return TRUE;
+	}
+
+
+	void ParasiteHost::FindPrefixIndexes(const char* prefix, std::vector<unsigned int>* indexes)
+	{
+		indexes->clear();
+
+		if(prefix == NULL)
+			prefix = "";
+
+		/*
+			The prefix is a directory path plus the start of a name in it. Matching
+			items of that directory are contiguous, and so is every subtree whose
+			directory name matches.
+		*/
+		size_t dirLength = DirLength(prefix);
+		const char* leaf = LeafName(prefix);
+		size_t leafLength = strlen(leaf);
+
+		int dir = FindDirectory(prefix, dirLength);
+		if(dir < 0)
+			return;
+
+		const PARASITE_DIR& entry = dirList[dir];
+		unsigned int last = entry.firstItem + entry.itemCount;
+		for(unsigned int i = LowerBoundLeaf(itemStore, entry.firstItem, last, leaf); i < last; i++)
+		{
+			if(strncmp(LeafName(itemStore.GetName(i)), leaf, leafLength) != 0)
+				break;
+			indexes->push_back(i);
+		}
+
+		for(unsigned int d = dir + 1; d < entry.dirEnd; d = dirList[d].dirEnd)
+		{
+			const char* name = LeafName(dirList[d].path.c_str());
+			if(strncmp(name, leaf, leafLength) != 0)
+				continue;
+
+			const PARASITE_DIR& lastDir = dirList[dirList[d].dirEnd - 1];
+			for(unsigned int i = dirList[d].firstItem; i < lastDir.firstItem + lastDir.itemCount; i++)
+				indexes->push_back(i);
+		}
+	}
+
+
+	unsigned int ParasiteHost::FindPrefix(const char* prefix, std::vector<const PARASITE_ITEM*>* items)
+	{
+		items->clear();
+
+		if(!LoadTable())
+			return 0;
+		if(!tableSorted)
+			SortTable();
+
+		std::vector<unsigned int> indexes;
+		FindPrefixIndexes(prefix, &indexes);
+
+		MakeItemList();
+		for(unsigned int i = 0; i < indexes.size(); i++)
+			items->push_back(&itemList[indexes[i]]);
+
+		return (unsigned int) items->size();
+	}
+
+
+	void ParasiteHost::MakeItemList()
+	{
+		if(itemListCurrent)
+			return;
+
+		itemList.resize(itemStore.GetCount());
+		for(unsigned int i = 0; i < itemStore.GetCount(); i++)
+			itemStore.GetItem(i, &itemList[i]);
+
+		itemListCurrent = TRUE;
+	}
+
+
+	const std::vector<PARASITE_ITEM>& ParasiteHost::GetItems()
+	{
+		LoadTable();
+		MakeItemList();
+		return itemList;
+	}
+
+
+	const ParasiteItemStore& ParasiteHost::GetItemStore()
+	{
+		LoadTable();
+		return itemStore;
+	}
+
+
+	PARASITE_BLOCK_INDEX* ParasiteHost::GetBlockIndex(const PARASITE_ITEM* item)
+	{
+		assert(hostFile != NULL);
+
+		std::map<unsigned int, PARASITE_BLOCK_INDEX>::iterator found = blockIndexes.find(item->offset);
+		if(found != blockIndexes.end())
+			return &found->second;
+
+		PARASITE_BLOCK_INDEX index;
+		if(item->flags & FEATURE_BLOCKS)
+		{
+			/*
+				Read the index stored in front of the blocks
+			*/
+			if(item->size < sizeof(unsigned int) * 2 || !Seek(item->offset))
+				return NULL;
+
+			if(Read(index.blockSize) != 1 || Read(index.blockCount) != 1)
+				return NULL;
+
+			if(index.blockCount > (item->size - sizeof(unsigned int) * 2) / sizeof(unsigned int))
+				return NULL;
+
+			index.ends.resize(index.blockCount);
+			if(index.blockCount > 0 &&
+			   fread(&index.ends[0], sizeof(unsigned int), index.blockCount, hostFile) != index.blockCount)
+				return NULL;
+
+			if(!CheckBlockIndex(*item, index))
+				return NULL;
+
+			index.dataOffset = item->offset + sizeof(unsigned int) * (2 + index.blockCount);
+		}
+		else if(item->flags & FEATURE_COMPRESS)
+		{
+			/*
+				Older hosts compress the whole item as one stream
+			*/
+			index.blockSize = item->lzSize;
+			index.blockCount = (item->lzSize > 0) ? 1 : 0;
+			index.dataOffset = item->offset;
+		}
+		else
+		{
+			index.blockSize = BLOCK_SIZE;
+			index.blockCount = item->size / BLOCK_SIZE + (item->size % BLOCK_SIZE ? 1 : 0);
+			index.dataOffset = item->offset;
+		}
+
+		return &(blockIndexes[item->offset] = index);
+	}
+
+
+	BOOL ParasiteHost::GetItemBlocks(const PARASITE_ITEM* item, unsigned int* blockSize, unsigned int* blockCount)
+	{
+		PARASITE_BLOCK_INDEX* index = GetBlockIndex(item);
+		if(index == NULL)
+		{
+			SetLastError("Block index of item is corrupt");
+			return FALSE;
+		}
+
+		*blockSize = index->blockSize;
+		*blockCount = index->blockCount;
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::ReadItemBlock(const PARASITE_ITEM* item, unsigned int block, unsigned char* out, unsigned int* outSize)
+	{
+		assert(hostFile != NULL);
+
+		PARASITE_BLOCK_INDEX* index = GetBlockIndex(item);
+		if(index == NULL || block >= index->blockCount)
+		{
+			SetLastError("Block index of item is corrupt or block out of range");
+			return FALSE;
+		}
+
+		unsigned int total = GetOriginalSize(*item);
+		unsigned int rawSize = total - block * index->blockSize;
+		if(rawSize > index->blockSize)
+			rawSize = index->blockSize;
+
+		unsigned int start, storedSize;
+		BOOL raw;
+		if(item->flags & FEATURE_BLOCKS)
+		{
+			start = block ? index->ends[block - 1] : 0;
+			storedSize = index->ends[block] - start;
+			raw = (storedSize == rawSize);
+		}
+		else if(item->flags & FEATURE_COMPRESS)
+		{
+			start = 0;
+			storedSize = item->size;
+			raw = FALSE;
+		}
+		else
+		{
+			start = block * index->blockSize;
+			storedSize = rawSize;
+			raw = TRUE;
+		}
+
+		if(!Seek(index->dataOffset + start))
+		{
+			SetLastError("Item data lies outside of the host file");
+			return FALSE;
+		}
+
+		/*
+			Raw blocks are read straight into the callers buffer
+		*/
+		double clock = StatsStart();
+		if(raw)
+		{
+			BOOL read = (fread(out, 1, rawSize, hostFile) == rawSize);
+			AddPhaseStats(PHASE_HOST_READ, clock, rawSize);
+			if(!read)
+			{
+				SetLastError("Failed to read item data from host");
+				return FALSE;
+			}
+		}
+		else
+		{
+			size_t mark = scratch.Mark();
+			unsigned char* stored = scratch.Alloc(storedSize + 1);
+			if(!stored)
+			{
+				SetLastError("Failed to allocate the block buffer");
+				return FALSE;
+			}
+
+			BOOL read = (fread(stored, 1, storedSize, hostFile) == storedSize);
+			AddPhaseStats(PHASE_HOST_READ, clock, storedSize);
+			if(!read)
+			{
+				scratch.Release(mark);
+				SetLastError("Failed to read item data from host");
+				return FALSE;
+			}
+
+			clock = StatsStart();
+			int decoded = LZ_UncompressSafe(stored, out, storedSize, rawSize);
+			AddPhaseStats(PHASE_DECOMPRESS, clock, rawSize);
+			scratch.Release(mark);
+			if(decoded != (int) rawSize)
+			{
+				SetLastError("Compressed item data is corrupt");
+				return FALSE;
+			}
+		}
+
+		*outSize = rawSize;
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::ReadRange(char* itemName, unsigned int offset, unsigned int length, unsigned char* buffer,
+								 unsigned int* bytesRead)
+	{
+		assert(hostFile != NULL);
+
+		const PARASITE_ITEM* item = FindItem(itemName);
+		if(item == NULL)
+		{
+			SetLastError("Item not found");
+			return FALSE;
+		}
+
+		return ReadRange(item, offset, length, buffer, bytesRead);
+	}
+
+
+	BOOL ParasiteHost::ReadRange(const PARASITE_ITEM* item, unsigned int offset, unsigned int length, unsigned char* buffer,
+								 unsigned int* bytesRead)
+	{
+		assert(hostFile != NULL);
+
+		unsigned int total = GetOriginalSize(*item);
+		if(offset > total)
+		{
+			SetLastError("Range starts past the end of the item");
+			return FALSE;
+		}
+
+		if(length > total - offset)
+			length = total - offset;
+		if(bytesRead)
+			*bytesRead = length;
+		if(length == 0)
+			return TRUE;
+
+		/*
+			Uncompressed data is read straight from the host
+		*/
+		if(!(item->flags & FEATURE_COMPRESS))
+		{
+			if(!Seek(item->offset + offset) || fread(buffer, 1, length, hostFile) != length)
+			{
+				SetLastError("Failed to read item data from host");
+				return FALSE;
+			}
+			return TRUE;
+		}
+
+		PARASITE_BLOCK_INDEX* index = GetBlockIndex(item);
+		if(index == NULL)
+		{
+			SetLastError("Block index of item is corrupt");
+			return FALSE;
+		}
+
+		unsigned int done = 0;
+		while(done < length)
+		{
+			unsigned int position = offset + done;
+			unsigned int block = position / index->blockSize;
+			unsigned int skip = position - block * index->blockSize;
+			unsigned int rawSize = total - block * index->blockSize;
+			if(rawSize > index->blockSize)
+				rawSize = index->blockSize;
+
+			unsigned int size;
+			if(skip == 0 && length - done >= rawSize)
+			{
+				/*
+					The whole block is inside the range, decode it in place
+				*/
+				if(!ReadItemBlock(item, block, buffer + done, &size))
+					return FALSE;
+				done += size;
+			}
+			else
+			{
+				size_t mark = scratch.Mark();
+				unsigned char* decoded = scratch.Alloc(index->blockSize);
+				if(!decoded)
+				{
+					SetLastError("Failed to allocate the block buffer");
+					return FALSE;
+				}
+
+				if(!ReadItemBlock(item, block, decoded, &size))
+				{
+					scratch.Release(mark);
+					return FALSE;
+				}
+
+				unsigned int copy = size - skip;
+				if(copy > length - done)
+					copy = length - done;
+				memcpy(buffer + done, decoded + skip, copy);
+				scratch.Release(mark);
+				done += copy;
+			}
+		}
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::AddItemFromMemory(const char* name, const unsigned char* data, unsigned int size, unsigned char flags)
+	{
+		/*
+			Names are stored as relative paths, the way file items are
+		*/
+		std::string itemPath = MakeItemPath(name ? name : "");
+		if(itemPath.empty() || itemPath.size() >= MAX_FILE_NAME)
+		{
+			SetLastError("Item name is empty or too long");
+			return FALSE;
+		}
+		if(itemPath[itemPath.size() - 1] == '/' || !IsSafeItemPath(itemPath.c_str()))
+		{
+			SetLastError("Item name is not a valid relative path");
+			return FALSE;
+		}
+
+		PARASITE_ITEM item;
+		item.localpath[0] = 0;
+		strcpy(item.filename, itemPath.c_str());
+		item.size = size;
+		item.lzSize = 0;
+		item.offset = 0;
+		item.flags = flags;
+		item.data = data;
+
+		newItems.push_back(item);
+		UpdateTableMemory();
+		return TRUE;
+	}
+
+
+	/*
+		Destination of an item read into memory with ReadItem
+	*/
+	struct MemorySinkBuffer
+	{
+		unsigned char* buffer;
+		unsigned int size;
+		unsigned int used;
+	};
+
+
+	static BOOL MemorySink(void* context, const unsigned char* data, unsigned int size)
+	{
+		MemorySinkBuffer* memory = (MemorySinkBuffer*) context;
+		if(size > memory->size - memory->used)
+			return FALSE;
+
+		memcpy(memory->buffer + memory->used, data, size);
+		memory->used += size;
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::ReadItem(const char* itemName, unsigned char* buffer, unsigned int bufferSize, unsigned int* size)
+	{
+		const PARASITE_ITEM* item = FindItem(itemName);
+		if(item == NULL)
+		{
+			SetLastError("Item not found");
+			return FALSE;
+		}
+
+		if(GetOriginalSize(*item) > bufferSize)
+		{
+			SetLastError("Buffer is too small for the item");
+			return FALSE;
+		}
+
+		MemorySinkBuffer memory;
+		memory.buffer = buffer;
+		memory.size = bufferSize;
+		memory.used = 0;
+
+		BOOL result = ExtractItemToSink(itemName, MemorySink, &memory);
+		if(size)
+			*size = memory.used;
+
+		return result;
+	}
+
+
+	unsigned char* ParasiteHost::ReadItem(const char* itemName, unsigned int* size)
+	{
+		const PARASITE_ITEM* item = FindItem(itemName);
+		if(item == NULL)
+		{
+			SetLastError("Item not found");
+			return NULL;
+		}
+
+		unsigned int original = GetOriginalSize(*item);
+		unsigned char* buffer = (unsigned char*) malloc(original + 1);
+		if(!buffer)
+		{
+			SetLastError("Failed to allocate the item buffer");
+			return NULL;
+		}
+
+		if(!ReadItem(itemName, buffer, original, size))
+		{
+			free(buffer);
+			return NULL;
+		}
+
+		return buffer;
+	}
+
+
+	BOOL ParasiteHost::ExtractItemToSink(const char* itemName, PARASITE_SINK sink, void* context)
+	{
+		assert(hostFile != NULL);
+
+		const PARASITE_ITEM* item = FindItem(itemName);
+		if(item == NULL)
+		{
+			SetLastError("Item not found");
+			return FALSE;
+		}
+
+		return ExtractItemToSink(item, sink, context);
+	}
+
+
+	BOOL ParasiteHost::ExtractItemToSink(const PARASITE_ITEM* item, PARASITE_SINK sink, void* context)
+	{
+		assert(hostFile != NULL);
+
+		ParasiteTraceSpan span(trace, "ExtractItem", item->filename);
+		span.SetBytes(GetOriginalSize(*item));
+
+		double itemStart = StatsStart();
+		ParasiteMemoryWindow itemMemory(allocator);
+		unsigned int blockSize, blockCount;
+		if(!GetItemBlocks(item, &blockSize, &blockCount))
+			return FALSE;
+
+		size_t mark = scratch.Mark();
+		unsigned char* block = scratch.Alloc(blockSize + 1);
+		if(!block)
+		{
+			SetLastError("Failed to allocate the extract buffer");
+			return FALSE;
+		}
+
+		/* 
+			Decode the item block by block, hashing each block as it is handed
+			to the sink so the result is verified without a second pass.
+		*/
+		md5_context ctx;
+		md5_starts(&ctx);
+
+		for(unsigned int i = 0; i < blockCount; i++)
+		{
+			unsigned int size;
+			if(!ReadItemBlock(item, i, block, &size))
+			{
+				scratch.Release(mark);
+				return FALSE;
+			}
+
+			double start = StatsStart();
+			md5_update(&ctx, block, size);
+			AddPhaseStats(PHASE_VERIFY, start, size);
+
+			start = StatsStart();
+			BOOL accepted = sink(context, block, size);
+			AddPhaseStats(PHASE_OUTPUT_WRITE, start, size);
+			if(!accepted)
+			{
+				SetLastError("Extraction aborted by sink");
+				scratch.Release(mark);
+				return FALSE;
+			}
+
+			if(!ReportProgress(size, 0, item->filename))
+			{
+				scratch.Release(mark);
+				return FALSE;
+			}
+		}
+
+		unsigned char finalHash[HASH_SIZE];
+		md5_finish(&ctx, finalHash);
+		scratch.Release(mark);
+
+		/* 
+			Check the final hash against original hash value stored during injection
+		*/
+		if(memcmp(finalHash, item->hash, HASH_SIZE) != 0)
+		{
+			SetLastError("Hash mismatch, extracted data is corrupt");
+			return FALSE;
+		}
+
+		AddItemStats(item, FALSE, itemStart, itemMemory);
+		return TRUE;
+	}
+
+
+	/*
+		Sink used by ExtractItem to write item data to a file
+	*/
+	static BOOL FileSink(void* context, const unsigned char* data, unsigned int size)
+	{
+		return fwrite(data, 1, size, (FILE*) context) == size;
+	}
+
+
+	/*
+		Destination of an item ExtractItem writes around the page cache
+	*/
+	struct DirectSinkFile
+	{
+		ParasiteDirectFile* file;
+		BOOL clocked;				// Time the writes for statistics
+		double seconds;
+		unsigned long long bytes;
+	};
+
+
+	static BOOL DirectSink(void* context, const unsigned char* data, unsigned int size)
+	{
+		DirectSinkFile* sink = (DirectSinkFile*) context;
+		double start = sink->clocked ? StatsClock() : 0;
+		BOOL written = sink->file->Write(data, size);
+		if(sink->clocked)
+			sink->seconds += StatsClock() - start;
+		sink->bytes += size;
+		return written;
+	}
+
+
+	BOOL ParasiteHost::ExtractItem(char* itemName, char* path)
+	{
+		assert(hostFile != NULL);
+
+		const PARASITE_ITEM* item = FindItem(itemName);
+		if(item == NULL)
+			return FALSE;
+
+		return ExtractItem(item, path);
+	}
+
+
+	BOOL ParasiteHost::ExtractItem(const PARASITE_ITEM* item, char* path)
+	{
+		assert(hostFile != NULL);
+
+		const char* itemName = item->filename;
+		std::string targetPath;
+		if(path != NULL)
+			targetPath = path;
+		targetPath += itemName;
+
+		if(!IsSafeItemPath(itemName))
+		{
+			printf("Refusing to extract %s outside of the target directory\n", itemName);
+			return FALSE;
+		}
+
+		if(verboseOutput)
+			printf("Extracting item %s to %s\n", itemName, targetPath.c_str());
+
+		MakeParentDirectories(targetPath);
+
+		BOOL result;
+		if(directIO)
+		{
+			ParasiteDirectFile dest(&allocator);
+			if(!OpenDirectFile(dest, targetPath.c_str(), true))
+			{
+				printf("Error opening file %s with write access\n", targetPath.c_str());
+				return FALSE;
+			}
+
+			DirectSinkFile sink;
+			sink.file = &dest;
+			sink.clocked = collectStats;
+			sink.seconds = 0;
+			sink.bytes = 0;
+			result = ExtractItemToSink(item, DirectSink, &sink);
+
+			double start = StatsStart();
+			if(!dest.Close() && result)
+			{
+				SetLastError("Error writing extracted data");
+				result = FALSE;
+			}
+			AddDirectStats(sink.seconds + (collectStats ? StatsClock() - start : 0), 0, sink.bytes);
+
+			/*
+				The stored data was read through stdio, its pages go too
+			*/
+#ifdef LINUX
+			posix_fadvise(fileno(hostFile), item->offset, item->size, POSIX_FADV_DONTNEED);
+#endif
+		}
+		else
+		{
+			FILE* dest = fopen(targetPath.c_str(), "w+b");
+			if(dest == NULL)
+			{
+				printf("Error opening file %s with write access\n", targetPath.c_str());
+				return FALSE;
+			}
+
+			result = ExtractItemToSink(item, FileSink, dest);
+			if(fclose(dest) != 0 && result)
+			{
+				SetLastError("Error writing extracted data");
+				result = FALSE;
+			}
+		}
+
+		/*
+			Never leave a partial or corrupt file behind
+		*/
+		if(!result)
+		{
+			printf("Failed to extract %s: %s\n", itemName, GetLastError());
+			remove(targetPath.c_str());
+		}
+
+		return result;
+	}
+
+	
+	BOOL ParasiteHost::ExtractAll(char* path)
+	{
+		assert(hostFile != NULL);
+
+		ParasiteTraceSpan span(trace, "ExtractAll");
+		OperationStats operation(this, "ExtractAll");
+		
+		if(!LoadTable())
+			return FALSE;
+
+		unsigned long long totalBytes = 0;
+		for(unsigned int i = 0; i < itemStore.GetCount(); i++)
+			totalBytes += (itemStore.GetFlags(i) & FEATURE_COMPRESS) ? itemStore.GetLzSize(i) : itemStore.GetSize(i);
+		StartProgress(itemStore.GetCount(), totalBytes);
+
+		/*
+			Items are copied out of the table one at a time into the same
+			structure. A cancelled extraction keeps the items already done
+			and removes the one it stopped in.
+		*/
+		PARASITE_ITEM item;
+		BOOL result = TRUE;
+		if(io != NULL && !directIO)
+			result = ExtractItemsAsync(path);
+		else
+			for(unsigned int i = 0; i < itemStore.GetCount() && result; i++)
+			{
+				itemStore.GetItem(i, &item);
+				result = ExtractItem(&item, path) && ReportProgress(0, 1, NULL);
+			}
+
+		EndProgress();
+		return result;
+	}
+
+
+#ifdef LINUX
+	/*
+		An item being extracted by ExtractItemsAsync. It has one request in
+		flight at a time, first reading the stored data then writing the
+		decoded data.
+	*/
+	struct AsyncExtract
+	{
+		BOOL active;
+		PARASITE_ITEM item;
+		std::string path;
+		int output;					// Descriptor of the extracted file
+		PARASITE_IO_REQUEST request;
+		unsigned char* stored;		// Data as stored in the host
+		unsigned char* decoded;		// Original data, stored itself if not compressed
+		size_t memory;				// Bytes of both buffers
+		double start;				// Clock when the item was started
+		double submitted;			// Clock when the request was submitted
+	};
+#endif
+
+
+	BOOL ParasiteHost::ExtractItemsAsync(char* path)
+	{
+#ifdef LINUX
+		/*
+			Visit the items in payload order so the host is read front to back.
+			Every item in flight holds its stored and decoded data, so together
+			they stay within half the memory budget.
+		*/
+		std::vector<unsigned int> order(itemStore.GetCount());
+		for(unsigned int i = 0; i < order.size(); i++)
+			order[i] = i;
+		OffsetOrder compare;
+		compare.items = &itemStore;
+		std::sort(order.begin(), order.end(), compare);
+
+		size_t memoryLimit = IO_INFLIGHT_SIZE;
+		if(memoryBudget != 0 && memoryBudget / 2 < memoryLimit)
+			memoryLimit = memoryBudget / 2;
+
+		std::vector<AsyncExtract> jobs(ioDepth);
+		for(unsigned int i = 0; i < jobs.size(); i++)
+			jobs[i].active = FALSE;
+
+		ParasiteMemoryWindow window(allocator);
+		int hostFd = fileno(hostFile);
+		unsigned int running = 0;
+		size_t memory = 0;
+		unsigned int next = 0;
+		BOOL result = TRUE;
+
+		for(;;)
+		{
+			/*
+				Start reading items while a job is free and memory allows
+			*/
+			while(result && next < order.size() && running < jobs.size())
+			{
+				PARASITE_ITEM item;
+				itemStore.GetItem(order[next], &item);
+				unsigned int original = GetOriginalSize(item);
+				size_t need = item.size + 1 + ((item.flags & FEATURE_COMPRESS) ? original + 1 : 0);
+
+				/*
+					Items too large to hold in memory are streamed block by
+					block once everything before them is done
+				*/
+				if(need > memoryLimit)
+				{
+					if(running > 0)
+						break;
+					next++;
+					result = ExtractItem(&item, path) && ReportProgress(0, 1, NULL);
+					continue;
+				}
+
+				if(memory + need > memoryLimit && running > 0)
+					break;
+				next++;
+
+				if(!IsSafeItemPath(item.filename))
+				{
+					printf("Refusing to extract %s outside of the target directory\n", item.filename);
+					result = FALSE;
+					break;
+				}
+
+				AsyncExtract* job = &jobs[0];
+				while(job->active)
+					job++;
+
+				job->item = item;
+				job->path = path ? path : "";
+				job->path += item.filename;
+				job->start = StatsStart();
+				if(verboseOutput)
+					printf("Extracting item %s to %s\n", item.filename, job->path.c_str());
+
+				MakeParentDirectories(job->path);
+				job->output = open(job->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if(job->output < 0)
+				{
+					printf("Error opening file %s with write access\n", job->path.c_str());
+					result = FALSE;
+					break;
+				}
+
+				job->active = TRUE;
+				job->memory = need;
+				job->decoded = NULL;
+				job->stored = (unsigned char*) allocator.Alloc(item.size + 1);
+				running++;
+				memory += need;
+
+				job->request.fd = hostFd;
+				job->request.write = FALSE;
+				job->request.buffer = job->stored;
+				job->request.size = item.size;
+				job->request.offset = item.offset;
+				job->request.tag = job;
+				job->submitted = StatsStart();
+				if(!job->stored || !io->Submit(&job->request))
+				{
+					SetLastError(job->stored ? "Failed to queue a read of the host" : "Failed to allocate the extract buffer");
+					printf("Failed to extract %s: %s\n", item.filename, GetLastError());
+					result = FALSE;
+					break;
+				}
+			}
+
+			if(io->GetPending() == 0)
+				break;
+
+			/*
+				After a failure the requests still in flight are only waited for
+			*/
+			PARASITE_IO_REQUEST* done = io->Wait();
+			if(done == NULL)
+			{
+				/*
+					Requests left may still use the item buffers, which are
+					freed below, so the engine goes first
+				*/
+				AbandonIO();
+				printf("Failed to extract the items: %s\n", GetLastError());
+				result = FALSE;
+				break;
+			}
+			if(!result)
+				continue;
+
+			AsyncExtract* job = (AsyncExtract*) done->tag;
+			const char* error = NULL;
+			if(done->result < 0 || (done->result == 0 && done->size > 0))
+				error = done->write ? "Error writing extracted data" : "Failed to read item data from host";
+			else
+			{
+				AddPhaseStats(done->write ? PHASE_OUTPUT_WRITE : PHASE_HOST_READ, job->submitted, done->result);
+
+				/*
+					Short transfers go on where they stopped
+				*/
+				if((size_t) done->result < done->size)
+				{
+					done->buffer += done->result;
+					done->offset += done->result;
+					done->size -= done->result;
+					job->submitted = StatsStart();
+					if(!io->Submit(done))
+						error = "Failed to queue a transfer";
+				}
+				else if(!done->write)
+				{
+					/*
+						The stored data is in, decode and check it then write it out
+					*/
+					unsigned int original = GetOriginalSize(job->item);
+					job->decoded = job->stored;
+					if(job->item.flags & FEATURE_COMPRESS)
+					{
+						job->decoded = (unsigned char*) allocator.Alloc(original + 1);
+						double start = StatsStart();
+						BOOL decodedItem = job->decoded && DecodeItem(job->item, job->stored, job->decoded);
+						AddPhaseStats(PHASE_DECOMPRESS, start, original);
+						if(!decodedItem)
+							error = "Failed to decompress item data";
+					}
+
+					if(error == NULL)
+					{
+						double start = StatsStart();
+						md5_context ctx;
+						unsigned char finalHash[HASH_SIZE];
+						md5_starts(&ctx);
+						md5_update(&ctx, job->decoded, original);
+						md5_finish(&ctx, finalHash);
+						AddPhaseStats(PHASE_VERIFY, start, original);
+						if(memcmp(finalHash, job->item.hash, HASH_SIZE) != 0)
+							error = "Hash mismatch, extracted data is corrupt";
+					}
+
+					if(error == NULL)
+					{
+						done->fd = job->output;
+						done->write = TRUE;
+						done->buffer = job->decoded;
+						done->size = original;
+						done->offset = 0;
+						job->submitted = StatsStart();
+						if(!io->Submit(done))
+							error = "Failed to queue a write of the extracted data";
+					}
+				}
+				else
+				{
+					/*
+						The item is written out
+					*/
+					if(close(job->output) != 0)
+						error = "Error writing extracted data";
+					job->output = -1;
+
+					if(error == NULL)
+					{
+						unsigned int original = GetOriginalSize(job->item);
+						if(job->decoded != job->stored)
+							allocator.Free(job->decoded);
+						allocator.Free(job->stored);
+						job->active = FALSE;
+						running--;
+						memory -= job->memory;
+
+						AddItemStats(&job->item, FALSE, job->start, window);
+						if(trace)
+							trace->Add("ExtractItem", job->item.filename, job->start, StatsClock(), original);
+						if(!ReportProgress(original, 1, NULL))
+							result = FALSE;
+					}
+				}
+			}
+
+			if(error)
+			{
+				SetLastError(error);
+				printf("Failed to extract %s: %s\n", job->item.filename, GetLastError());
+				result = FALSE;
+			}
+		}
+
+		/*
+			Never leave a partial or corrupt file behind
+		*/
+		for(unsigned int i = 0; i < jobs.size(); i++)
+		{
+			AsyncExtract& job = jobs[i];
+			if(!job.active)
+				continue;
+
+			if(job.output >= 0)
+				close(job.output);
+			remove(job.path.c_str());
+			if(job.decoded != job.stored)
+				allocator.Free(job.decoded);
+			allocator.Free(job.stored);
+		}
+
+		return result;
+#else
+		return FALSE;
+#endif
+	}
+
+
+	/*
+		Sink of items that are only checked against their hash
+	*/
+	static BOOL DiscardSink(void* context, const unsigned char* data, unsigned int size)
+	{
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::TestItems(std::vector<PARASITE_TEST_RESULT>* results, int threads)
+	{
+		assert(hostFile != NULL);
+
+		ParasiteTraceSpan span(trace, "TestItems");
+		OperationStats operation(this, "TestItems");
+
+		std::vector<PARASITE_TEST_RESULT> localResults;
+		if(results == NULL)
+			results = &localResults;
+
+		results->clear();
+		if(!LoadTable())
+			return FALSE;
+
+		PARASITE_TEST_RESULT result;
+		result.passed = FALSE;
+		results->reserve(itemStore.GetCount());
+		for(unsigned int i = 0; i < itemStore.GetCount(); i++)
+		{
+			strcpy(result.filename, itemStore.GetName(i));
+			results->push_back(result);
+		}
+
+		if(threads <= 0)
+			threads = std::thread::hardware_concurrency();
+		if(threads <= 0)
+			threads = 1;
+
+		/*
+			Every worker holds one batch and has more queued, each with its stored
+			and decoded data. Under a memory budget batches shrink first, then
+			workers, and items larger than a batch are streamed.
+		*/
+		unsigned int batchLimit = HASH_BATCH_SIZE;
+		if(memoryBudget != 0)
+		{
+			size_t copies = 2 * (TEST_BATCHES_PER_THREAD + 1);
+			if(memoryBudget / (copies * threads) < HASH_BATCH_ITEM_SIZE)
+				threads = (int) std::max((size_t) 1, memoryBudget / (copies * HASH_BATCH_ITEM_SIZE));
+			batchLimit = (unsigned int) std::min((size_t) HASH_BATCH_SIZE, memoryBudget / (copies * threads));
+		}
+
+		/*
+			Visit the items in payload order so the host is read front to back
+		*/
+		std::vector<unsigned int> order(itemStore.GetCount());
+		for(unsigned int i = 0; i < order.size(); i++)
+			order[i] = i;
+		OffsetOrder compare;
+		compare.items = &itemStore;
+		std::sort(order.begin(), order.end(), compare);
+
+		TestQueue queue;
+		queue.limit = threads * TEST_BATCHES_PER_THREAD;
+		queue.finished = FALSE;
+		queue.stats = collectStats ? stats.phases : NULL;
+		queue.trace = trace;
+		queue.allocator = &allocator;
+
+		std::vector<std::thread> workers;
+		for(int i = 0; i < threads; i++)
+			workers.push_back(std::thread(TestWorker, &queue, &itemStore, results));
+
+		TestBatch* batch = new TestBatch;
+		batch->size = 0;
+		long position = -1;
+
+		for(unsigned int i = 0; i < order.size(); i++)
+		{
+			unsigned int offset = itemStore.GetOffset(order[i]);
+			unsigned int size = itemStore.GetSize(order[i]);
+
+			if(memoryBudget != 0 && std::max(size, itemStore.GetLzSize(order[i])) > batchLimit)
+			{
+				PARASITE_ITEM item;
+				itemStore.GetItem(order[i], &item);
+				(*results)[order[i]].passed = ExtractItemToSink(&item, DiscardSink, NULL);
+				position = -1;
+				continue;
+			}
+
+			if(!batch->items.empty() &&
+			   (batch->items.size() == HASH_BATCH_ITEMS || batch->size + size > batchLimit))
+			{
+				QueueTestBatch(&queue, batch);
+				batch = new TestBatch;
+				batch->size = 0;
+			}
+
+			/*
+				Only seek when there is a gap, so stdio keeps its read buffer
+			*/
+			unsigned char* data = (unsigned char*) allocator.Alloc(size + 1);
+			if(data)
+			{
+				if(position != (long) offset)
+				{
+					Seek(offset);
+					position = offset;
+				}
+
+				double start = StatsStart();
+				size_t got = fread(data, 1, size, hostFile);
+				AddPhaseStats(PHASE_HOST_READ, start, got);
+				position += got;
+				if(got != size)
+				{
+					allocator.Free(data);
+					data = NULL;
+					position = -1;
+				}
+			}
+
+			batch->items.push_back(order[i]);
+			batch->data.push_back(data);
+			batch->size += size;
+		}
+
+		if(!batch->items.empty())
+			QueueTestBatch(&queue, batch);
+		else
+			delete batch;
+
+		{
+			std::unique_lock<std::mutex> guard(queue.lock);
+			queue.finished = TRUE;
+		}
+		queue.changed.notify_all();
+
+		for(unsigned int i = 0; i < workers.size(); i++)
+			workers[i].join();
+
+		for(unsigned int i = 0; i < results->size(); i++)
+			if(!(*results)[i].passed)
+				return FALSE;
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::RestoreFile(char* outfile)
+	{
+		assert(hostFile != NULL);
+
+		ParasiteTraceSpan span(trace, "RestoreFile");
+		OperationStats operation(this, "RestoreFile");
+		
+		if(verboseOutput)
+			printf("Restoring to file %s\n", outfile);
+
+		/*
+			Check the offset before anything is created, so a corrupt header
+			leaves no empty file behind
+		*/
+		if((host.baseOffset < 0) || (host.baseOffset > host.size))
+		{
+			printf("Base offset [%u] seems corrupt\n", host.baseOffset);
+			printf("Aborting restore operation\n");
+			return FALSE;
+		}
+
+		/*
+			Direct restores read the host on a descriptor of their own
+		*/
+		FILE* out = NULL;
+		ParasiteDirectFile source(&allocator);
+		ParasiteDirectFile target(&allocator);
+		if(directIO ? !OpenDirectFile(target, outfile, true) : (out = fopen(outfile, "w+b")) == NULL)
+		{
+			printf("Could not open file %s for writing\n", outfile);
+			printf("Aborting restore operation\n");
+			return FALSE;
+		}
+		if(directIO && !OpenDirectFile(source, host.filename, false))
+		{
+			printf("Could not open file %s for reading\n", host.filename);
+			printf("Aborting restore operation\n");
+			target.Close();
+			remove(outfile);
+			return FALSE;
+		}
+
+		/*
+			Copy the host up to the first item in blocks. A cancelled or failed
+			copy removes the partial file.
+		*/
+		StartProgress(0, host.baseOffset);
+		size_t mark = scratch.Mark();
+		unsigned char* block = scratch.Alloc(BLOCK_SIZE);
+		BOOL result = (block != NULL);
+		if(!result)
+			SetLastError("Failed to allocate the restore buffer");
+		Seek(0);
+		double directStart = StatsStart();
+		unsigned int done = 0;
+		while(done < host.baseOffset && result)
+		{
+			unsigned int size = std::min(host.baseOffset - done, (unsigned int) BLOCK_SIZE);
+			if(directIO)
+				result = source.Read(block, size) == size && target.Write(block, size);
+			else
+				result = fread(block, 1, size, hostFile) == size && fwrite(block, 1, size, out) == size;
+			if(!result)
+				SetLastError("Could not copy the host data");
+			else
+				result = ReportProgress(size, 0, NULL);
+			done += size;
+		}
+		scratch.Release(mark);
+		EndProgress();
+
+		if((directIO ? !target.Close() : fclose(out) != 0) && result)
+		{
+			SetLastError("Could not write the restored file");
+			result = FALSE;
+		}
+		if(directIO)
+		{
+			source.Close();
+			AddDirectStats(collectStats ? StatsClock() - directStart : 0, done, done);
+		}
+
+		if(!result)
+		{
+			printf("Failed to restore %s: %s\n", outfile, GetLastError());
+			remove(outfile);
+		}
+		
+		return result;
+	}
+
+
+	BOOL ParasiteHost::ReadLegacyFileTable()
 	{
 		PARASITE_ITEM item;
-		for(itr = itemList.begin(); itr < itemList.end(); itr++)
+		unsigned short bufsize = 0;
+		
+		itemStore.Reserve(host.items);
+		for(unsigned int i = 0; i < host.items; i++)
+		{			
+			Read(item.size);                // Host file size  
+			Read(item.lzSize);              // Size of lz compression
+			Read(item.offset);              // Items location in stream realative to 0
+			Read(item.flags);               // Feature flags
+			Read(item.hash);                // Original file crc32 hash
+			Read(bufsize);                  // Size of the file name string
+			if(bufsize == 0 || bufsize > MAX_FILE_NAME)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+			Read(item.filename, bufsize);   // File name string
+			item.filename[bufsize - 1] = 0;
+		
+			itemStore.Add(item);
+		}
+
+		SortTable();
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::ReadFileTable()
+	{
+		assert(hostFile != NULL);
+
+		OperationStats operation(this, "ReadFileTable");
+
+		itemStore.Clear();
+		newItems.clear();
+		std::vector<PARASITE_ITEM>().swap(itemList);
+		itemListCurrent = FALSE;
+		foundItems.clear();
+		foundIndex.clear();
+		dirList.clear();
+		tableSorted = TRUE;
+		ReleaseLazyTable();
+
+		double start = StatsStart();
+		long position = ftell(hostFile);
+		BOOL result = ReadFileTableFormat();
+		AddPhaseStats(PHASE_TABLE_READ, start, ftell(hostFile) - position);
+		return result;
+	}
+
+
+	BOOL ParasiteHost::ReadFileTableFormat()
+	{
+		switch(host.version.major)
 		{
-			item = *itr;
-			
-			//printf("FileName\tFlags\tSize\tOffset\n");
-			printf("\n");
-			printf("%s\n", item.filename);
-			printf("  flags:       %u\n", item.flags);
-			printf("  size:        %u\n", item.size);
-			printf("  offset:      %d\n", item.offset);
-			printf("  lzSize:      %u\n", item.lzSize);
-			printf("  hash: \t");
-			for(int i = 0; i < HASH_SIZE; i++)
-				printf("%x", item.hash[i]);
-			printf("\n");
-			printf("\n");
+			case TABLE_FORMAT_LEGACY:
+				return ReadLegacyFileTable();
+
+			case TABLE_FORMAT_TREE:
+				return ReadTreeFileTable();
+
+			case TABLE_FORMAT_COMPACT:
+				return ReadCompactFileTable();
+
+			case TABLE_FORMAT_MAPPED:
+				/*
+					Read lazily, the table is used in place from a mapping and
+					nothing is parsed
+				*/
+				if(lazyTable)
+				{
+					tableMap = new ParasiteTableMap();
+					if(tableMap->Open(host.filename) && tableMap->GetItemCount() == host.items)
+					{
+						tableLoaded = FALSE;
+						return TRUE;
+					}
+					ReleaseLazyTable();
+				}
+				return ReadMappedFileTable();
+		}
+
+		SetLastError("File table was written by a newer version of Parasite");
+		return FALSE;
+	}
+
+
+	BOOL ParasiteHost::LoadTable()
+	{
+		if(tableLoaded)
+			return TRUE;
+
+		OperationStats operation(this, "LoadTable");
+
+		double start = StatsStart();
+		BOOL result;
+		if(tableMap != NULL)
+		{
+			ReleaseLazyTable();
+			result = ReadMappedFileTable();
+		}
+		else
+		{
+			result = ParseCompactItems();
+			ReleaseLazyTable();
+		}
+
+		AddPhaseStats(PHASE_TABLE_READ, start, 0);
+		return result;
+	}
+
+
+	void ParasiteHost::ReleaseLazyTable()
+	{
+		delete tableMap;
+		tableMap = NULL;
+		std::vector<unsigned char>().swap(tableBody);
+		std::vector<PARASITE_TABLE_ENTRY>().swap(tableEntries);
+		std::string().swap(entryNames);
+		tableLoaded = TRUE;
+	}
+
+
+	BOOL ParasiteHost::BuildEntryIndex()
+	{
+		TableReader reader;
+		reader.pos = &tableBody[0] + tableItemsStart;
+		reader.end = &tableBody[0] + tableBody.size() - 1;
+
+		PARASITE_TABLE_ENTRY entry;
+		std::string leaf;
+		unsigned int expected = host.baseOffset;
+		tableEntries.clear();
+		entryNames.clear();
+		tableEntries.reserve(host.items);
+		for(unsigned int d = 0; d < dirList.size(); d++)
+		{
+			for(unsigned int i = 0; i < dirList[d].itemCount; i++)
+			{
+				entry.bodyOffset = reader.pos - &tableBody[0];
+				entry.expected = expected;
+				entry.leafOffset = entryNames.size();
+				if(!DecodeCompactEntry(reader, dirList[d].path, leaf, expected, NULL))
+				{
+					tableEntries.clear();
+					SetLastError("File table is corrupt");
+					return FALSE;
+				}
+
+				entryNames.append(leaf.c_str(), leaf.size() + 1);
+				tableEntries.push_back(entry);
+			}
+		}
+
+		return TRUE;
+	}
+
+
+	const PARASITE_ITEM* ParasiteHost::FindLazyItem(const char* itemName)
+	{
+		PARASITE_ITEM item;
+		if(tableMap != NULL)
+		{
+			const PARASITE_MAP_RECORD* record = tableMap->Find(itemName);
+			if(record == NULL || !tableMap->ToItem(record, &item))
+				return NULL;
+
+			return KeepFoundItem(record - tableMap->GetRecord(0), &item);
+		}
+
+		int dir = FindDirectory(itemName, DirLength(itemName));
+		if(dir < 0)
+			return NULL;
+
+		const PARASITE_DIR& entry = dirList[dir];
+		const char* name = LeafName(itemName);
+		std::string leaf;
+		unsigned int expected;
+		TableReader reader;
+		reader.end = &tableBody[0] + tableBody.size() - 1;
+
+		if(indexEntries)
+		{
+			if(tableEntries.size() != host.items && !BuildEntryIndex())
+				return NULL;
+
+			/*
+				Binary search the names of the directory in the index, then
+				decode the one entry from where the index says it starts
+			*/
+			unsigned int low = entry.firstItem;
+			unsigned int high = entry.firstItem + entry.itemCount;
+			while(low < high)
+			{
+				unsigned int middle = low + (high - low) / 2;
+				if(strcmp(entryNames.c_str() + tableEntries[middle].leafOffset, name) < 0)
+					low = middle + 1;
+				else
+					high = middle;
+			}
+
+			if(low == entry.firstItem + entry.itemCount || strcmp(entryNames.c_str() + tableEntries[low].leafOffset, name) != 0)
+				return NULL;
+
+			if(low > 0)
+				leaf = entryNames.c_str() + tableEntries[low - 1].leafOffset;
+			reader.pos = &tableBody[0] + tableEntries[low].bodyOffset;
+			expected = tableEntries[low].expected;
+			if(!DecodeCompactEntry(reader, entry.path, leaf, expected, &item))
+			{
+				SetLastError("File table is corrupt");
+				return NULL;
+			}
+
+			return KeepFoundItem(low, &item);
+		}
+
+		/*
+			Without the index every entry before the directory is skimmed, as
+			names and offsets are coded against the entry before them
+		*/
+		reader.pos = &tableBody[0] + tableItemsStart;
+		expected = host.baseOffset;
+		for(int d = 0; d < dir; d++)
+			for(unsigned int i = 0; i < dirList[d].itemCount; i++)
+				if(!DecodeCompactEntry(reader, dirList[d].path, leaf, expected, NULL))
+				{
+					SetLastError("File table is corrupt");
+					return NULL;
+				}
+
+		for(unsigned int i = 0; i < entry.itemCount; i++)
+		{
+			if(!DecodeCompactEntry(reader, entry.path, leaf, expected, &item))
+			{
+				SetLastError("File table is corrupt");
+				return NULL;
+			}
+
+			int order = strcmp(leaf.c_str(), name);
+			if(order == 0)
+				return KeepFoundItem(entry.firstItem + i, &item);
+			if(order > 0)
+				break;
+		}
+
+		return NULL;
+	}
+
+
+	BOOL ParasiteHost::ReadTreeFileTable()
+	{
+		/*
+			The directory tree comes first, in depth-first order with the root first.
+			Each directory is stored with its name relative to its parent.
+		*/
+		unsigned int dirCount = 0;
+		Read(dirCount);
+
+		/*
+			Every directory record takes at least 19 bytes of the table
+		*/
+		if(dirCount == 0 || host.headerOffset > host.size
+		   || (unsigned long long) dirCount * 19 > host.size - host.headerOffset)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		PARASITE_DIR dir;
+		char name[MAX_FILE_NAME];
+		unsigned short bufsize = 0;
+		unsigned int nextItem = 0;
+		dirList.reserve(dirCount);
+		for(unsigned int d = 0; d < dirCount; d++)
+		{
+			Read(dir.parent);
+			Read(dir.dirEnd);
+			Read(dir.firstItem);
+			Read(dir.itemCount);
+			Read(bufsize);
+			if(bufsize == 0 || bufsize > MAX_FILE_NAME || Read(name, bufsize) != 1)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+			name[bufsize - 1] = 0;
+			if(strchr(name, '/') != NULL)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+
+			/*
+				Directories must nest properly and their items follow on from the
+				previous directory's
+			*/
+			if((d == 0) != (dir.parent == 0 && name[0] == 0) || (d > 0 && dir.parent >= d)
+			   || (d > 0 && dir.dirEnd > dirList[dir.parent].dirEnd) || dir.dirEnd <= d || dir.dirEnd > dirCount
+			   || dir.firstItem != nextItem || dir.itemCount > host.items - nextItem)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+			nextItem += dir.itemCount;
+
+			dir.path = (d == 0 || dir.parent == 0) ? "" : dirList[dir.parent].path + "/";
+			dir.path += name;
+			if(dir.path.size() >= MAX_FILE_NAME)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+			dirList.push_back(dir);
+		}
+
+		if(nextItem != host.items)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		/*
+			Items follow grouped by directory, each stored with its name within
+			the directory
+		*/
+		PARASITE_ITEM item;
+		itemStore.Reserve(host.items);
+		for(unsigned int d = 0; d < dirList.size(); d++)
+		{
+			const std::string& path = dirList[d].path;
+			for(unsigned int i = 0; i < dirList[d].itemCount; i++)
+			{
+				Read(item.size);
+				Read(item.lzSize);
+				Read(item.offset);
+				Read(item.flags);
+				Read(item.hash);
+				Read(bufsize);
+				if(bufsize == 0 || bufsize > MAX_FILE_NAME || Read(name, bufsize) != 1)
+				{
+					SetLastError("File table is corrupt");
+					return FALSE;
+				}
+				name[bufsize - 1] = 0;
+
+				if(name[0] == 0 || strchr(name, '/') != NULL || path.size() + 1 + strlen(name) >= MAX_FILE_NAME)
+				{
+					SetLastError("File table is corrupt");
+					return FALSE;
+				}
+
+				strcpy(item.filename, path.empty() ? name : (path + "/" + name).c_str());
+
+				itemStore.Add(item);
+			}
+		}
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::ReadCompactFileTable()
+	{
+		unsigned int dirCount, rawSize, storedSize;
+		if(!ReadVarint(&dirCount) || !ReadVarint(&rawSize))
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		storedSize = rawSize;
+		if((host.tableFlags & TABLE_FLAG_LZ) && !ReadVarint(&storedSize))
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		/*
+			The body is read with one call. Every item takes at least 20 bytes of
+			it and every directory at least 5, and neither more than the 16 byte
+			hash, two names, and a few varints.
+		*/
+		unsigned long long longest = (unsigned long long) host.items * (HASH_SIZE + 31 + MAX_FILE_NAME)
+									 + (unsigned long long) dirCount * (31 + MAX_FILE_NAME);
+		if(dirCount == 0 || host.headerOffset > host.size || storedSize > host.size - host.headerOffset
+		   || rawSize > longest || rawSize < (unsigned long long) host.items * 20 + dirCount * 5)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		std::vector<unsigned char>& body = tableBody;
+		body.resize(rawSize + 1);
+		if(host.tableFlags & TABLE_FLAG_LZ)
+		{
+			std::vector<unsigned char> stored(storedSize + 1);
+			HeldMemory held(allocator, stored.capacity());
+			if(fread(&stored[0], 1, storedSize, hostFile) != storedSize
+			   || LZ_UncompressSafe(&stored[0], &body[0], storedSize, rawSize) != (int) rawSize)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+		}
+		else if(fread(&body[0], 1, rawSize, hostFile) != rawSize)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		TableReader reader;
+		reader.pos = &body[0];
+		reader.end = &body[0] + rawSize;
+
+		/*
+			Directories: distance back to the parent, number of directories in the
+			subtree, item count and the front coded full path
+		*/
+		PARASITE_DIR dir;
+		std::string previous;
+		unsigned int nextItem = 0;
+		dirList.reserve(dirCount);
+		for(unsigned int d = 0; d < dirCount; d++)
+		{
+			unsigned int back, subtree;
+			if(!reader.GetVarint(&back) || !reader.GetVarint(&subtree) || !reader.GetVarint(&dir.itemCount)
+			   || !reader.GetFrontCoded(previous))
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+
+			dir.parent = d - back;
+			dir.dirEnd = d + subtree;
+			dir.firstItem = nextItem;
+			dir.path = previous;
+
+			/*
+				The root comes first and every other directory nests inside its parent
+			*/
+			const PARASITE_DIR* parent = NULL;
+			if(d == 0 ? (back != 0 || !dir.path.empty()) : (back == 0 || back > d))
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+			if(d > 0)
+				parent = &dirList[dir.parent];
+
+			if(subtree == 0 || subtree > dirCount - d || dir.itemCount > host.items - nextItem
+			   || (d > 0 && (dir.dirEnd > parent->dirEnd || dir.path.empty()
+							 || dir.path.compare(0, parent->path.size(), parent->path) != 0
+							 || (!parent->path.empty() && dir.path[parent->path.size()] != '/')
+							 || dir.path.find('/', parent->path.empty() ? 0 : parent->path.size() + 1) != std::string::npos)))
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
+
+			nextItem += dir.itemCount;
+			dirList.push_back(dir);
+		}
+
+		if(nextItem != host.items)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
 		}
+
+		/*
+			Entries are decoded now unless the table is read lazily
+		*/
+		tableItemsStart = reader.pos - &body[0];
+		tableLoaded = FALSE;
+		if(lazyTable)
+			return TRUE;
+
+		BOOL result = ParseCompactItems();
+		ReleaseLazyTable();
+		return result;
 	}
 
 
-	void ParasiteHost::AddItem(PARASITE_ITEM & item)
-	{
-		itemList.push_back(item);
+	BOOL ParasiteHost::ParseCompactItems()
+	{
+		TableReader reader;
+		reader.pos = &tableBody[0] + tableItemsStart;
+		reader.end = &tableBody[0] + tableBody.size() - 1;
+
+		PARASITE_ITEM item;
+		std::string leaf;
+		unsigned int expected = host.baseOffset;
+		itemStore.Reserve(host.items, tableBody.size());
+		for(unsigned int d = 0; d < dirList.size(); d++)
+		{
+			const std::string& path = dirList[d].path;
+			for(unsigned int i = 0; i < dirList[d].itemCount; i++)
+			{
+				if(!DecodeCompactEntry(reader, path, leaf, expected, &item))
+				{
+					SetLastError("File table is corrupt");
+					return FALSE;
+				}
+
+				itemStore.Add(item);
+			}
+		}
+
+		return TRUE;
 	}
 
 
-	BOOL ParasiteHost::ExtractItem(char* itemName, char* path)
+	BOOL ParasiteHost::ReadMappedFileTable()
 	{
-		assert(hostFile != NULL);
+		unsigned int start = (host.headerOffset + 2 + 7) & ~7u;
+		unsigned int footer = sizeof(host.headerOffset) + TAG_SIZE;
 
-		char targetPath[MAX_FILE_NAME];
-		if(path == NULL)
-			strcpy(targetPath, itemName);
-		else
+		PARASITE_MAP_HEADER header;
+		Seek(start);
+		if(start > host.size || host.size - start < footer || Read(header) != 1
+		   || !CheckMapHeader(header, host.size - start - footer))
 		{
-			strcpy(targetPath, path);
-			strcat(targetPath, itemName);
-		}   
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
 
-		PARASITE_ITEM item;
-		for(itr = itemList.begin(); itr < itemList.end(); itr++)
+		std::vector<unsigned char> table(header.tableSize);
+		HeldMemory held(allocator, table.capacity());
+		Seek(start);
+		if(fread(&table[0], 1, header.tableSize, hostFile) != header.tableSize)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		const PARASITE_MAP_RECORD* records = (const PARASITE_MAP_RECORD*) &table[header.recordOffset];
+		const PARASITE_MAP_DIR* dirs = (const PARASITE_MAP_DIR*) &table[header.dirOffset];
+		const char* pool = (const char*) &table[header.poolOffset];
+
+		PARASITE_DIR dir;
+		unsigned int nextItem = 0;
+		dirList.reserve(header.dirCount);
+		for(unsigned int d = 0; d < header.dirCount; d++)
 		{
-			item = *itr;
-			if(strcmp(item.filename, itemName) == 0)
+			const PARASITE_MAP_DIR& entry = dirs[d];
+			if(entry.nameLength >= MAX_FILE_NAME || entry.nameOffset >= header.poolSize
+			   || header.poolSize - entry.nameOffset <= entry.nameLength || entry.firstItem != nextItem
+			   || entry.itemCount > header.items - nextItem || entry.parent > d || entry.dirEnd <= d
+			   || entry.dirEnd > header.dirCount)
 			{
-				if(verboseOutput)
-					printf("Extracting item %s to %s\n", item.filename, targetPath);
+				SetLastError("File table is corrupt");
+				return FALSE;
+			}
 
-				FILE* dest = fopen(targetPath, "w+b");
-				if(dest == NULL)
-				{
-					printf("Error opening file %s with write access\n", targetPath);
-					return FALSE;
-				}
-								
-				/* 
-					Read the parasite file into a new work buffer 
-				*/
-				unsigned char* itemBuf = (unsigned char*) malloc(item.size);
-				if(!itemBuf)
-				{
-					printf("Failed to allocate the extract buffer of %u bytes\n Aborting\n", item.size);
-					fclose(dest);
-					return FALSE;
-				}			  
-				Seek(item.offset);
-				fread(itemBuf, 1, item.size, hostFile);
-				
-				/* 
-					If the file uses compression, extract it to the new location 
-				*/
-				if(item.flags & FEATURE_COMPRESS)
-				{
-					unsigned char* out = (unsigned char*) malloc(item.lzSize);
-					if(!out)
-					{
-						printf("Failed to allocate a decompress buffer of %u bytes\n", item.lzSize);
-						free(itemBuf);
-						fclose(dest);
-						return FALSE;
-					}
-					
-					LZ_Uncompress(itemBuf, out, item.size);
-					fwrite(out, 1, item.lzSize, dest);
-					free(out);
-				}
-				else 
-				{
-					/* 
-						No compression was used on this file
-					*/
-					fwrite(itemBuf, 1, item.size, dest);
-				}
-				
-				fclose(dest);
-				free(itemBuf);				
+			dir.path.assign(pool + entry.nameOffset, entry.nameLength);
+			dir.parent = entry.parent;
+			dir.dirEnd = entry.dirEnd;
+			dir.firstItem = entry.firstItem;
+			dir.itemCount = entry.itemCount;
+			nextItem += entry.itemCount;
+			dirList.push_back(dir);
+		}
 
-				/* 
-					Check the final hash against original hash value stored during injection
-				*/
-				CompareFileHash(targetPath, item.hash);
+		if(nextItem != header.items)
+		{
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
 
-				return TRUE;
+		itemStore.Reserve(header.items, header.poolSize);
+		for(unsigned int i = 0; i < header.items; i++)
+		{
+			const PARASITE_MAP_RECORD& record = records[i];
+			if(record.nameLength == 0 || record.nameLength >= MAX_FILE_NAME || record.nameOffset >= header.poolSize
+			   || header.poolSize - record.nameOffset <= record.nameLength)
+			{
+				SetLastError("File table is corrupt");
+				return FALSE;
 			}
+
+			itemStore.Add(pool + record.nameOffset, record.nameLength, record.offset, record.size, record.lzSize,
+						  record.flags, record.hash);
 		}
 
-		return FALSE;
+		return TRUE;
 	}
 
-	
-	BOOL ParasiteHost::CompareFileHash(char* fileName, unsigned char* testHash)
+
+	/*
+		Orders the name index of a mapped table by hash, then by path
+	*/
+	struct MapIndexOrder
 	{
-		unsigned char finalHash[HASH_SIZE];
-		if(md5_file(fileName, finalHash) != 0)
+		const ParasiteItemStore* items;
+
+		bool operator()(const PARASITE_MAP_INDEX& a, const PARASITE_MAP_INDEX& b) const
 		{
-			printf("Could not calculate final hash\n");
-			return FALSE;
+			if(a.hash != b.hash)
+				return a.hash < b.hash;
+			return strcmp(items->GetName(a.item), items->GetName(b.item)) < 0;
 		}
-		
-		for(int i = 0; i < HASH_SIZE; i++)
-			if(finalHash[i] != testHash[i])
-				return FALSE;		
-	
-		return TRUE;
-	}
-	
-	BOOL ParasiteHost::ExtractAll(char* path)
-	{
-		assert(hostFile != NULL);
-		
-		for(itr = itemList.begin(); itr < itemList.end(); itr++)
-			if(ExtractItem((PARASITE_ITEM(*itr)).filename, path) == FALSE)
-				return FALSE;								
+	};
 
-		return TRUE;
+
+	static unsigned int Align8(unsigned int value)
+	{
+		return (value + 7) & ~7u;
 	}
 
 
-	BOOL ParasiteHost::RestoreFile(char* outfile)
+	BOOL ParasiteHost::WriteMappedFileTable()
 	{
-		assert(hostFile != NULL);
-		
-		if(verboseOutput)
-			printf("Restoring to file %s\n", outfile);
+		/*
+			Pad so the header starts 8 byte aligned in the host file
+		*/
+		unsigned int position = ftell(hostFile);
+		while(position % 8 != 0)
+		{
+			fputc(0, hostFile);
+			position++;
+		}
 
-		FILE* out = fopen(outfile, "w+b");
-		if(out == NULL)
+		std::vector<char> pool;
+		std::vector<PARASITE_MAP_DIR> dirs(dirList.size());
+		for(unsigned int d = 0; d < dirList.size(); d++)
 		{
-			printf("Could not open file %s for writing\n", outfile);
-			printf("Aborting restore operation\n");
-			return FALSE;
+			dirs[d].parent = dirList[d].parent;
+			dirs[d].dirEnd = dirList[d].dirEnd;
+			dirs[d].firstItem = dirList[d].firstItem;
+			dirs[d].itemCount = dirList[d].itemCount;
+			dirs[d].nameOffset = pool.size();
+			dirs[d].nameLength = dirList[d].path.size();
+			pool.insert(pool.end(), dirList[d].path.c_str(), dirList[d].path.c_str() + dirList[d].path.size() + 1);
 		}
 
-		if((host.baseOffset < 0) || (host.baseOffset > host.size))
+		unsigned int count = itemStore.GetCount();
+		std::vector<PARASITE_MAP_RECORD> records(count);
+		std::vector<PARASITE_MAP_INDEX> index(count);
+		unsigned int dir = 0;
+		for(unsigned int i = 0; i < count; i++)
 		{
-			printf("Base offset [%u] seems corrupt\n", host.baseOffset);
-			printf("Aborting restore operation\n");
-			return FALSE;
+			const char* name = itemStore.GetName(i);
+			while(i >= dirList[dir].firstItem + dirList[dir].itemCount)
+				dir++;
+
+			PARASITE_MAP_RECORD& record = records[i];
+			memset(&record, 0, sizeof(record));
+			record.offset = itemStore.GetOffset(i);
+			record.size = itemStore.GetSize(i);
+			record.lzSize = itemStore.GetLzSize(i);
+			record.nameOffset = pool.size();
+			record.dir = dir;
+			record.nameLength = strlen(name);
+			record.flags = itemStore.GetFlags(i);
+			memcpy(record.hash, itemStore.GetHash(i), HASH_SIZE);
+			pool.insert(pool.end(), name, name + record.nameLength + 1);
+
+			index[i].hash = HashItemName(name);
+			index[i].item = i;
 		}
-	
-		Seek(0);
-		for(unsigned int i = 0; i < host.baseOffset; i++)
-			fputc(fgetc(hostFile), out);
 
-		fclose(out);
-		
-		return TRUE;
-	}
+		MapIndexOrder order;
+		order.items = &itemStore;
+		std::sort(index.begin(), index.end(), order);
 
+		PARASITE_MAP_HEADER header;
+		memset(&header, 0, sizeof(header));
+		header.headerSize = sizeof(header);
+		header.items = count;
+		header.baseOffset = host.baseOffset;
+		header.dirCount = dirList.size();
+		header.recordOffset = Align8(sizeof(header));
+		header.dirOffset = Align8(header.recordOffset + records.size() * sizeof(PARASITE_MAP_RECORD));
+		header.indexOffset = Align8(header.dirOffset + dirs.size() * sizeof(PARASITE_MAP_DIR));
+		header.poolOffset = Align8(header.indexOffset + index.size() * sizeof(PARASITE_MAP_INDEX));
+		header.poolSize = pool.size();
+		header.tableSize = Align8(header.poolOffset + header.poolSize);
 
-	BOOL ParasiteHost::ReadFileTable()
-	{
-		assert(hostFile != NULL);
+		std::vector<unsigned char> table(header.tableSize, 0);
+		HeldMemory held(allocator, table.capacity() + pool.capacity() + dirs.capacity() * sizeof(PARASITE_MAP_DIR)
+							   + records.capacity() * sizeof(PARASITE_MAP_RECORD) + index.capacity() * sizeof(PARASITE_MAP_INDEX));
+		memcpy(&table[0], &header, sizeof(header));
+		if(!records.empty())
+		{
+			memcpy(&table[header.recordOffset], &records[0], records.size() * sizeof(PARASITE_MAP_RECORD));
+			memcpy(&table[header.indexOffset], &index[0], index.size() * sizeof(PARASITE_MAP_INDEX));
+		}
+		memcpy(&table[header.dirOffset], &dirs[0], dirs.size() * sizeof(PARASITE_MAP_DIR));
+		memcpy(&table[header.poolOffset], &pool[0], pool.size());
 
-		PARASITE_ITEM item;
-		unsigned short bufsize = 0;
-		
-		for(int i = 0; i < host.items; i++)
-		{			
-			Read(item.size);                // Host file size  
-			Read(item.lzSize);              // Size of lz compression
-			Read(item.offset);              // Items location in stream realative to 0
-			Read(item.flags);               // Feature flags
-			Read(item.hash);                // Original file crc32 hash
-			Read(bufsize);                  // Size of the file name string
-			Read(item.filename, bufsize);   // File name string
-		
-			itemList.push_back(item);
+		if(fwrite(&table[0], 1, table.size(), hostFile) != table.size())
+		{
+			SetLastError("Error writing file table");
+			return FALSE;
 		}
+
 		return TRUE;
 	}
 
@@ -447,6 +4577,9 @@ namespace parasite
 	BOOL ParasiteHost::Infect()
 	{
 		assert(hostFile != NULL);
+
+		ParasiteTraceSpan span(trace, "Infect");
+		OperationStats operation(this, "Infect");
 		
 		if(HasParasite())
 		{
@@ -459,18 +4592,92 @@ namespace parasite
 		host.baseOffset = ftell(hostFile);
 		if(verboseOutput)
 			printf("Writing files starting at base offset %u\n", host.baseOffset);
+
+		/*
+			Write the items in table order, so their offsets increase through
+			the table and delta code to almost nothing
+		*/
+		std::stable_sort(newItems.begin(), newItems.end(), CompareItemPath);
+
+		unsigned long long totalBytes = 0;
+		for(itr = newItems.begin(); itr < newItems.end(); itr++)
+			totalBytes += itr->size;
+		StartProgress(newItems.size(), totalBytes);
 		
-		for(itr = itemList.begin(); itr < itemList.end(); itr++)
-			if(WriteItemToHost(&*itr) == FALSE)
-				return FALSE;
+		/*
+			Small items are read and hashed in batches so the multi-buffer MD5
+			engine can hash several of them at once. Large items are read and
+			hashed by WriteItemToHost one at a time.
+		*/
+		PARASITE_ITEM* batch[HASH_BATCH_ITEMS];
+		int batchCount = 0;
+		unsigned int batchSize = 0;
+		unsigned int batchLimit = GetBatchLimit();
+		unsigned int itemLimit = std::min((unsigned int) HASH_BATCH_ITEM_SIZE, batchLimit);
+		BOOL result = TRUE;
+
+		for(itr = newItems.begin(); itr < newItems.end() && result; itr++)
+		{
+			PARASITE_ITEM* item = &*itr;
+
+			if(item->size > itemLimit)
+			{
+				if(batchCount > 0)
+					result = WriteItemBatch(batch, batchCount);
+				batchCount = 0;
+				batchSize = 0;
+
+				if(result)
+					result = WriteItemToHost(item) && ReportProgress(0, 1, NULL);
+				continue;
+			}
+
+			if(batchCount == HASH_BATCH_ITEMS || batchSize + item->size > batchLimit)
+			{
+				result = WriteItemBatch(batch, batchCount);
+				batchCount = 0;
+				batchSize = 0;
+			}
+
+			batch[batchCount++] = item;
+			batchSize += item->size;
+		}
+
+		if(result && batchCount > 0)
+			result = WriteItemBatch(batch, batchCount);
+		EndProgress();
+
+		/*
+			A failed or cancelled infection is undone, leaving the host as it
+			was opened. Items written in part have lost their original sizes,
+			so none of them are kept for another try.
+		*/
+		if(!result)
+		{
+			newItems.clear();
+			TruncateHost(host.baseOffset);
+			return FALSE;
+		}
+
+		/*
+			The written items join the file table
+		*/
+		itemStore.Reserve(itemStore.GetCount() + newItems.size());
+		for(itr = newItems.begin(); itr < newItems.end(); itr++)
+			itemStore.Add(*itr);
+		newItems.clear();
+		tableSorted = FALSE;
+		itemListCurrent = FALSE;
 
 		return TRUE;
 	}
 
 
-	BOOL ParasiteHost::InfectMore(PARASITE_ITEM item)
+	BOOL ParasiteHost::InfectMore(const PARASITE_ITEM& item)
 	{
 		assert(hostFile != NULL);
+
+		OperationStats operation(this, "InfectMore");
 		
 		if(HasParasite() == FALSE)
 		{
@@ -478,8 +4685,9 @@ namespace parasite
 			return FALSE;
 		}
 
-		itemList.push_back(item);
-		
+		if(!LoadTable())
+			return FALSE;
+
 		/* 
 			The appended file will overwrite the current header
 		*/
@@ -488,12 +4696,26 @@ namespace parasite
 			
 		Seek(host.headerOffset);
 		
-		if(WriteItemToHost(&item) == FALSE)
+		/*
+			WriteItemToHost fills in the offset and hash, so it works on a copy
+		*/
+		PARASITE_ITEM written = item;
+		if(WriteItemToHost(&written) == FALSE)
 		{
 			/*
-				Failure... we should clean up make a method.
+				Cut off what was written of the item. This also drops the old
+				table, which WriteFileTable puts back from the items in memory.
 			*/
+			TruncateHost(host.headerOffset);
+			return FALSE;
 		}
+
+		/*
+			Add the item once it has been written, so the table gets its offset and hash
+		*/
+		itemStore.Add(written);
+		tableSorted = FALSE;
+		itemListCurrent = FALSE;
 				   
 		return TRUE;
 	}
@@ -502,10 +4724,22 @@ namespace parasite
 	BOOL ParasiteHost::WriteFileTable(int startOffset)
 	{
 		assert(hostFile != NULL);
+
+		OperationStats operation(this, "WriteFileTable");
 		
+		/*
+			Loading a lazily read table moves the stream, so remember where to write
+		*/
+		long position = ftell(hostFile);
+		if(!LoadTable())
+			return FALSE;
+
 		if(startOffset != -1)
 			Seek(startOffset);
+		else
+			fseek(hostFile, position, SEEK_SET);
 		
+		double start = StatsStart();
 		host.headerOffset = ftell(hostFile);
 		/* Maybe a little too verbose!
 		if(verboseOutput)
@@ -513,15 +4747,70 @@ namespace parasite
 		*/
 
 		/*
-			Write version information
+			Write version information, the major version is the table format
 		*/
-		fputc(MAJOR_VERSION, hostFile);
+		fputc(tableFormat, hostFile);
 		fputc(REVISION_VERSION, hostFile);
 
+		host.items = itemStore.GetCount();
+		SortTable();
+
+		BOOL result;
+		if(tableFormat == TABLE_FORMAT_COMPACT)
+			result = WriteCompactFileTable();
+		else if(tableFormat == TABLE_FORMAT_MAPPED)
+			result = WriteMappedFileTable();
+		else
+			result = WriteTreeFileTable();
+
+		if(result == FALSE)
+			return FALSE;
+
+		/*
+			Last thing we write is the base address for the file table.
+		 	We do this so that we do not need to do a linear search for the table.
+		  	A simple address extraction off the tail of the file will be O(1).
+		*/
+		Write(host.headerOffset);
+		Write(TAG_DATA, TAG_SIZE);
+		AddPhaseStats(PHASE_TABLE_WRITE, start, ftell(hostFile) - host.headerOffset);
+
+		/*
+			A rewritten table can be shorter than the one it replaces, so cut off
+			whatever is left of the old one to keep our tag at the end of the file
+		*/
+		long end = ftell(hostFile);
+		if(!TruncateHost(end))
+		{
+			SetLastError("Could not truncate the host file after the file table");
+			return FALSE;
+		}
+
+		return TRUE;
+	} 
+
+
+	BOOL ParasiteHost::TruncateHost(long end)
+	{
+		fflush(hostFile);
+#ifdef LINUX
+		if(ftruncate(fileno(hostFile), end) != 0)
+#else
+		if(_chsize(_fileno(hostFile), end) != 0)
+#endif
+			return FALSE;
+
+		host.size = end;
+		fseek(hostFile, end, SEEK_SET);
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::WriteTreeFileTable()
+	{
 		/*
 			Write the number of files in infestation
 		*/
-		host.items = itemList.size();
 		Write(host.items);
 
 		/*
@@ -530,33 +4819,135 @@ namespace parasite
 		Write(host.baseOffset);
 
 		/*
-			Write all of the file items to the file stream
+			Write the directory tree, each directory named relative to its parent
 		*/
-		PARASITE_ITEM item;
-		for(itr = itemList.begin(); itr < itemList.end(); itr++)
+		unsigned int dirCount = dirList.size();
+		Write(dirCount);
+		for(unsigned int d = 0; d < dirList.size(); d++)
 		{
-			item = *itr;
+			PARASITE_DIR& dir = dirList[d];
+			const char* name = LeafName(dir.path.c_str());
 
-			Write(item.size);
-			Write(item.lzSize);
-			Write(item.offset);
-			Write(item.flags);
-			Write(item.hash);
-			unsigned short sz = strlen(item.filename) + 1;		
+			Write(dir.parent);
+			Write(dir.dirEnd);
+			Write(dir.firstItem);
+			Write(dir.itemCount);
+			unsigned short sz = strlen(name) + 1;
 			Write(sz);
-			Write(item.filename, sz);
+			Write(*name, sz);
 		}
 
 		/*
-			Last thing we write is the base address for the file table.
-		 	We do this so that we do not need to do a linear search for the table.
-		  	A simple address extraction off the tail of the file will be O(1).
+			Write all of the file items to the file stream, in directory order
 		*/
-		Write(host.headerOffset);
-		Write(TAG_DATA, TAG_SIZE);
+		for(unsigned int i = 0; i < itemStore.GetCount(); i++)
+		{
+			const char* name = LeafName(itemStore.GetName(i));
+			unsigned int size = itemStore.GetSize(i);
+			unsigned int lzSize = itemStore.GetLzSize(i);
+			unsigned int offset = itemStore.GetOffset(i);
+			unsigned char flags = itemStore.GetFlags(i);
+
+			Write(size);
+			Write(lzSize);
+			Write(offset);
+			Write(flags);
+			Write(*itemStore.GetHash(i), HASH_SIZE);
+			unsigned short sz = strlen(name) + 1;		
+			Write(sz);
+			Write(*name, sz);
+		}
 
 		return TRUE;
-	} 
+	}
+
+
+	BOOL ParasiteHost::WriteCompactFileTable()
+	{
+		std::vector<unsigned char> body;
+		std::string previous;
+
+		for(unsigned int d = 0; d < dirList.size(); d++)
+		{
+			PARASITE_DIR& dir = dirList[d];
+			PutVarint(body, d - dir.parent);
+			PutVarint(body, dir.dirEnd - d);
+			PutVarint(body, dir.itemCount);
+			PutFrontCoded(body, previous, dir.path.c_str());
+		}
+
+		unsigned int expected = host.baseOffset;
+		previous.clear();
+		for(unsigned int i = 0; i < itemStore.GetCount(); i++)
+		{
+			unsigned int offset = itemStore.GetOffset(i);
+			PutVarint(body, itemStore.GetSize(i));
+			PutVarint(body, itemStore.GetLzSize(i));
+			PutVarint(body, ZigZag((int) (offset - expected)));
+			body.push_back(itemStore.GetFlags(i));
+			body.insert(body.end(), itemStore.GetHash(i), itemStore.GetHash(i) + HASH_SIZE);
+			PutFrontCoded(body, previous, LeafName(itemStore.GetName(i)));
+
+			expected = offset + itemStore.GetSize(i);
+		}
+
+		HeldMemory heldBody(allocator, body.capacity());
+
+		/*
+			Keep the compressed body only if it is smaller
+		*/
+		std::vector<unsigned char> packed;
+		if(compressTable && body.size() > 0)
+		{
+			std::vector<unsigned int> work(body.size() + 65536);
+			packed.resize(body.size() + body.size() / 256 + 1 + 16);
+			HeldMemory held(allocator, work.capacity() * sizeof(unsigned int) + packed.capacity());
+			int packedSize = LZ_CompressFast(&body[0], &packed[0], body.size(), &work[0]);
+			if(packedSize > 0 && (unsigned int) packedSize < body.size())
+				packed.resize(packedSize);
+			else
+				packed.clear();
+		}
+
+		host.tableFlags = packed.empty() ? 0 : TABLE_FLAG_LZ;
+
+		std::vector<unsigned char> header;
+		header.push_back(host.tableFlags);
+		PutVarint(header, host.items);
+		PutVarint(header, host.baseOffset);
+		PutVarint(header, dirList.size());
+		PutVarint(header, body.size());
+		if(!packed.empty())
+			PutVarint(header, packed.size());
+
+		const std::vector<unsigned char>& stored = packed.empty() ? body : packed;
+		if(fwrite(&header[0], 1, header.size(), hostFile) != header.size()
+		   || fwrite(&stored[0], 1, stored.size(), hostFile) != stored.size())
+		{
+			SetLastError("Error writing file table");
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteHost::ReadVarint(unsigned int* value)
+	{
+		*value = 0;
+		for(int shift = 0; shift < 35; shift += 7)
+		{
+			int byte = fgetc(hostFile);
+			if(byte == EOF)
+				return FALSE;
+
+			*value |= (unsigned int) (byte & 0x7f) << shift;
+			if(!(byte & 0x80))
+				return TRUE;
+		}
+
+		return FALSE;
+	}
 
 
 	BOOL ParasiteHost::ReadHeader()
@@ -582,14 +4973,51 @@ namespace parasite
 		host.version.revision = fgetc(hostFile);
 
 		/* 
-			Read number of infested files 
+			Read number of infested files and the base offset (start of our data
+			payload). Old versions store the count in 16 bits, compact tables
+			store both as varints after the table flags.
 		*/
-		Read(host.items);
-		
-        /* 
-        	Read the base offset (start of our data payload)
-        */
-		Read(host.baseOffset);
+		host.tableFlags = 0;
+		if(host.version.major == TABLE_FORMAT_LEGACY)
+		{
+			unsigned short items = 0;
+			Read(items);
+			host.items = items;
+			Read(host.baseOffset);
+		}
+		else if(host.version.major == TABLE_FORMAT_COMPACT)
+		{
+			Read(host.tableFlags);
+			if(!ReadVarint(&host.items) || !ReadVarint(&host.baseOffset))
+			{
+				SetLastError("File table header is corrupt");
+				return FALSE;
+			}
+		}
+		else if(host.version.major == TABLE_FORMAT_MAPPED)
+		{
+			PARASITE_MAP_HEADER header;
+			Seek((host.headerOffset + 2 + 7) & ~7u);
+			if(Read(header) != 1)
+			{
+				SetLastError("File table header is corrupt");
+				return FALSE;
+			}
+			host.items = header.items;
+			host.baseOffset = header.baseOffset;
+		}
+
+		else
+		{
+			Read(host.items);
+			Read(host.baseOffset);
+		}
+
+		/*
+			A table rewritten after adding items keeps the format it was read in
+		*/
+		if(host.version.major >= TABLE_FORMAT_TREE && host.version.major <= TABLE_FORMAT_MAPPED)
+			tableFormat = host.version.major;
 		
 		if(verboseOutput)
 		{
@@ -622,6 +5050,13 @@ namespace parasite
 	}
 
 
+	ParasiteHost::~ParasiteHost()
+	{
+		delete tableMap;
+		delete io;
+	}
+
+
 	void ParasiteHost::Close()
 	{
 		assert(hostFile != NULL);
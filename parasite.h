@@ -25,12 +25,18 @@
 #define __PARASITE_H__
 
 #include <vector>
+#include <map>
+#include <deque>
+#include <string>
+#include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "lz.h"		// Compression Lib
 #include "md5.h"	// Hash Lib
+#include "md5_mb.h"	// Multi-buffer hash
 
 #ifdef parasite_export
 #define parasite_api __declspec(dllexport)
@@ -59,19 +65,61 @@
 #define BUILD_DATE "03/18/08"
 #endif
 #ifndef MAJOR_VERSION
-#define MAJOR_VERSION 0
+#define MAJOR_VERSION 2
 #endif
 #ifndef REVISION_VERSION
 #define REVISION_VERSION 40
 #endif
 
 #define MAX_FILE_NAME 255
+
+/* File table formats, stored as the major version byte of the table */
+#define TABLE_FORMAT_LEGACY  0	///< 16 bit item count and a flat list of names, read only
+#define TABLE_FORMAT_TREE    1	///< Fixed width directory tree and items
+#define TABLE_FORMAT_COMPACT 2	///< Varint directory tree and items with front coded names and delta coded offsets
+#define TABLE_FORMAT_MAPPED  3	///< Aligned fixed width records, name pool and hash index usable in place from a mapping
+
+/* Define some table flag bits */
+#define TABLE_FLAG_LZ 0x01	///< The body of a #TABLE_FORMAT_COMPACT table is LZ compressed
 #define TAG_SIZE 8			///< Size of special tag string in chars
 #define TAG_DATA "Parasite"	///< Text value of the special tag
 #define HASH_SIZE 16		///< Size of calculated item hash value
+#define HASH_BATCH_ITEMS 32				///< Maximum number of items read and hashed together
+#define HASH_BATCH_ITEM_SIZE (1 << 20)	///< Items up to this size are hashed in batches
+#define HASH_BATCH_SIZE (16 << 20)		///< Maximum number of bytes read for one batch
+#define TEST_BATCHES_PER_THREAD 2		///< Batches read ahead for each test worker
+
+#define BLOCK_SIZE (128 << 10)	///< Size of the blocks compressed items are split into
+#define MIN_BLOCK_SIZE (16 << 10)	///< Smallest block size a memory budget shrinks #BLOCK_SIZE to
+#define PIPELINE_SLOTS 4			///< Blocks in flight between the read, compress and write stages of one item
+#define PIPELINE_MIN_SIZE (1 << 20)	///< Smallest item file written through the pipeline
+
+/* I/O engines, see ParasiteHost::SetIOEngine */
+#define IO_ENGINE_SYNC		0	///< Blocking stdio on the calling thread
+#define IO_ENGINE_THREADS	1	///< pread and pwrite on a pool of threads
+#define IO_ENGINE_URING		2	///< Linux io_uring
+#define IO_ENGINE_AUTO		3	///< io_uring if the system allows it, threads otherwise
+#define IO_QUEUE_DEPTH		32	///< Requests kept in flight by default
+#define IO_INFLIGHT_SIZE	(64 << 20)	///< Bytes of item buffers in flight when there is no memory budget
+#define IO_DIRECT_ALIGN		4096		///< Alignment of O_DIRECT buffers, offsets and sizes
+#define IO_DIRECT_BUFFER	(1 << 20)	///< Chunk size of direct reads and writes
 
 /* Define some feature bits */
 #define FEATURE_COMPRESS 0x01 ///< Feature flag bit to enable LZ compression
+#define FEATURE_BLOCKS   0x02 ///< Compressed item is stored as independently compressed blocks
+
+/* Define the phases timed when statistics are collected */
+#define PHASE_SOURCE_READ	0	///< Reading the files of items being added
+#define PHASE_HASH			1	///< Hashing items being added
+#define PHASE_COMPRESS		2	///< Compressing item blocks
+#define PHASE_HOST_WRITE	3	///< Writing item data to the host
+#define PHASE_TABLE_READ	4	///< Reading and decoding the file table
+#define PHASE_TABLE_WRITE	5	///< Writing the file table
+#define PHASE_HOST_READ		6	///< Reading stored item data from the host
+#define PHASE_DECOMPRESS	7	///< Decompressing item blocks
+#define PHASE_VERIFY		8	///< Hashing extracted or tested items to check them
+#define PHASE_OUTPUT_WRITE	9	///< Handing extracted data to its sink
+#define PHASE_COUNT			10	///< Number of phases
 
 /**
  * The namespace for out parasite classes.
@@ -101,8 +149,189 @@ namespace parasite
 		unsigned int	size;						///< Size of the item in bytes
 		unsigned int	lzSize;						///< Size of the item when decompressed with lz (if compression used)
 		unsigned char	hash[16];					///< Holds MD5 sum of the original file
+		const unsigned char* data;					///< Item data held in memory, or NULL to read it from localpath
 	} PARASITE_ITEM;
 
+	/**
+	* Describes how the stored data of an item is split into blocks.
+	* Items with #FEATURE_BLOCKS start with this index: the block size, the block
+	* count and the end of every compressed block relative to the first block.
+	* A block whose stored size equals its decompressed size is stored raw.
+	* Uncompressed items are read in blocks of #BLOCK_SIZE, and compressed items
+	* from older hosts are a single block holding the whole item.
+	*/
+	typedef struct _PARASITE_BLOCK_INDEX
+	{
+		unsigned int				blockSize;		///< Decompressed size of every block but the last
+		unsigned int				blockCount;		///< Number of blocks in the item
+		unsigned int				dataOffset;		///< Host offset of the first block
+		std::vector<unsigned int>	ends;			///< End of each stored block relative to dataOffset (#FEATURE_BLOCKS only)
+	} PARASITE_BLOCK_INDEX;
+
+	/**
+	* A directory of the file table.
+	* Directories are kept in depth-first order with the root first, and the items
+	* of the table are grouped by directory in the same order, sorted by name within
+	* each directory. So every directory's items, and every subtree's items, are a
+	* contiguous range of the table.
+	*/
+	typedef struct _PARASITE_DIR
+	{
+		std::string		path;		///< Full path of the directory without a trailing '/', empty for the root
+		unsigned int	parent;		///< Index of the parent directory, the root is its own parent
+		unsigned int	dirEnd;		///< Index past the last directory below this one
+		unsigned int	firstItem;	///< Index of the first item directly in this directory
+		unsigned int	itemCount;	///< Number of items directly in this directory
+	} PARASITE_DIR;
+
+	/**
+	* Entry index of a #TABLE_FORMAT_COMPACT table loaded lazily.
+	* Holds where each entry starts in the table body and what is needed to
+	* decode it on its own, a small fraction of a decoded #PARASITE_ITEM.
+	*/
+	typedef struct _PARASITE_TABLE_ENTRY
+	{
+		unsigned int	bodyOffset;	///< Offset of the entry in the table body
+		unsigned int	expected;	///< Offset its stream offset is delta coded against
+		unsigned int	leafOffset;	///< Offset of its NUL terminated name in the index name pool
+	} PARASITE_TABLE_ENTRY;
+
+	/**
+	* Header of a #TABLE_FORMAT_MAPPED file table.
+	* It follows the format and revision bytes, padded to the next multiple of 8 in
+	* the host file. All offsets are relative to the start of this header, and every
+	* section is 8 byte aligned, so the table can be used in place from a read-only
+	* mapping of the host without parsing or copying any entry.
+	*/
+	typedef struct _PARASITE_MAP_HEADER
+	{
+		unsigned int	headerSize;		///< Size of this header in bytes
+		unsigned int	items;			///< Number of item records
+		unsigned int	baseOffset;		///< Base offset of the parasite files appended data
+		unsigned int	dirCount;		///< Number of directory records
+		unsigned int	recordOffset;	///< Start of the #PARASITE_MAP_RECORD array, in table order
+		unsigned int	dirOffset;		///< Start of the #PARASITE_MAP_DIR array, in depth-first order
+		unsigned int	indexOffset;	///< Start of the #PARASITE_MAP_INDEX array, sorted by hash then path
+		unsigned int	poolOffset;		///< Start of the name pool
+		unsigned int	poolSize;		///< Size of the name pool in bytes
+		unsigned int	tableSize;		///< Size of the whole table from this header on
+	} PARASITE_MAP_HEADER;
+
+	/**
+	* An item record of a #TABLE_FORMAT_MAPPED file table.
+	*/
+	typedef struct _PARASITE_MAP_RECORD
+	{
+		unsigned int	offset;				///< Stream offset position for the first byte of this item
+		unsigned int	size;				///< Size of the item in bytes
+		unsigned int	lzSize;				///< Size of the item when decompressed with lz (if compression used)
+		unsigned int	nameOffset;			///< Pool offset of the item's NUL terminated full path
+		unsigned int	dir;				///< Index of the item's directory record
+		unsigned short	nameLength;			///< Length of the path without the NUL
+		unsigned char	flags;				///< Feature flags
+		unsigned char	reserved;			///< Always 0
+		unsigned char	hash[HASH_SIZE];	///< MD5 sum of the original file
+	} PARASITE_MAP_RECORD;
+
+	/**
+	* A directory record of a #TABLE_FORMAT_MAPPED file table, see #PARASITE_DIR.
+	*/
+	typedef struct _PARASITE_MAP_DIR
+	{
+		unsigned int	parent;			///< Index of the parent directory, the root is its own parent
+		unsigned int	dirEnd;			///< Index past the last directory below this one
+		unsigned int	firstItem;		///< Index of the first item directly in this directory
+		unsigned int	itemCount;		///< Number of items directly in this directory
+		unsigned int	nameOffset;		///< Pool offset of the directory's NUL terminated full path
+		unsigned int	nameLength;		///< Length of the path without the NUL
+	} PARASITE_MAP_DIR;
+
+	/**
+	* An entry of the name index of a #TABLE_FORMAT_MAPPED file table.
+	*/
+	typedef struct _PARASITE_MAP_INDEX
+	{
+		unsigned int	hash;			///< #HashItemName of the item path
+		unsigned int	item;			///< Index of the item record
+	} PARASITE_MAP_INDEX;
+
+	/**
+	* A structure that holds the outcome of testing one item with ParasiteHost::TestItems.
+	*/
+	typedef struct _PARASITE_TEST_RESULT
+	{
+		char			filename[MAX_FILE_NAME];	///< Name of the tested item
+		BOOL			passed;						///< TRUE if the item decoded and its hash matched
+	} PARASITE_TEST_RESULT;
+
+	/**
+	* Time and bytes spent in one phase, see #PHASE_COUNT.
+	*/
+	typedef struct _PARASITE_PHASE_STATS
+	{
+		double				seconds;	///< Time spent in the phase
+		unsigned long long	bytes;		///< Bytes the phase handled
+		unsigned int		calls;		///< Number of times the phase ran
+	} PARASITE_PHASE_STATS;
+
+	/**
+	* Memory allocated through a ParasiteAllocator.
+	*/
+	typedef struct _PARASITE_MEMORY_STATS
+	{
+		unsigned long long	current;		///< Bytes allocated at the time of the snapshot
+		unsigned long long	peak;			///< Most bytes allocated at once
+		unsigned long long	allocations;	///< Number of allocations
+	} PARASITE_MEMORY_STATS;
+
+	/**
+	* Sizes and time of one item written or extracted while statistics are collected.
+	*/
+	typedef struct _PARASITE_ITEM_STATS
+	{
+		std::string		name;		///< Item path
+		BOOL			written;	///< TRUE if the item was added, FALSE if it was extracted
+		unsigned int	original;	///< Size of the item data
+		unsigned int	stored;		///< Size of the item in the host
+		double			seconds;	///< Time taken to write or extract the item
+		PARASITE_MEMORY_STATS memory;	///< Peak and allocations while the item was handled
+	} PARASITE_ITEM_STATS;
+
+	/**
+	* Bulk reads and writes done around the page cache, see ParasiteHost::SetDirectIO.
+	*/
+	typedef struct _PARASITE_DIRECT_STATS
+	{
+		unsigned int		files;			///< Files opened
+		unsigned int		direct;			///< Files of those opened with O_DIRECT, the others dropped their pages
+		unsigned long long	bytesRead;		///< Bytes read
+		unsigned long long	bytesWritten;	///< Bytes written
+		double				seconds;		///< Time spent reading and writing
+	} PARASITE_DIRECT_STATS;
+
+	/**
+	* Time and memory of one operation run while statistics are collected.
+	*/
+	typedef struct _PARASITE_OPERATION_STATS
+	{
+		const char*		name;		///< Operation, for example "Infect"
+		double			seconds;	///< Time the operation took
+		PARASITE_MEMORY_STATS memory;	///< Peak and allocations during the operation, current when it ended
+	} PARASITE_OPERATION_STATS;
+
+	/**
+	* Statistics collected by a ParasiteHost, see ParasiteHost::SetCollectStats.
+	*/
+	typedef struct _PARASITE_STATS
+	{
+		PARASITE_PHASE_STATS phases[PHASE_COUNT];	///< Time and bytes of every phase
+		std::vector<PARASITE_ITEM_STATS> items;		///< Items in the order they were written or extracted
+		std::vector<PARASITE_OPERATION_STATS> operations;	///< Operations in the order they ended
+		PARASITE_MEMORY_STATS memory;				///< Memory of the host, the peak since collection started
+		PARASITE_DIRECT_STATS direct;				///< Bulk I/O done around the page cache
+		double seconds;								///< Time since collection started
+	} PARASITE_STATS;
+
 	/**
 	* A structure that holds the version information for parasite.
 	*/
@@ -122,13 +351,47 @@ namespace parasite
 	{
 		PARASITE_VERSION	version;
 		char				filename[MAX_FILE_NAME];	///< Host file name
-		unsigned short		items;						///< Number of injected items in host
+		unsigned int		items;						///< Number of injected items in host
 		unsigned int		size;						///< Size of the host file when opened
 		unsigned int		baseOffset;					///< Base offset of the parasite files appended data
 		unsigned int		headerOffset;				///< Offset that points to the start of the Parasite file table
+		unsigned char		tableFlags;					///< Table flag bits of a #TABLE_FORMAT_COMPACT table
 	} PARASITE_HOST_FILE;
 
 
+	/**
+	* Callback that receives the data of an item extracted with ParasiteHost::ExtractItemToSink.
+	* Data is delivered in order, one decoded block at a time.
+	* @param context Pointer passed through from ExtractItemToSink
+	* @param data Next chunk of item data
+	* @param size Number of bytes in data
+	* @return TRUE to continue, FALSE to abort the extraction
+	*/
+	typedef BOOL (*PARASITE_SINK)(void* context, const unsigned char* data, unsigned int size);
+
+	/**
+	* Progress of a long running ParasiteHost operation, see ParasiteHost::SetProgressCallback.
+	*/
+	typedef struct _PARASITE_PROGRESS
+	{
+		unsigned int		itemsDone;		///< Items finished so far
+		unsigned int		itemsTotal;		///< Items the operation handles, 0 if it does not work on items
+		unsigned long long	bytesDone;		///< Item bytes handled so far
+		unsigned long long	bytesTotal;		///< Item bytes the operation handles
+		double				seconds;		///< Time since the operation started
+		double				rate;			///< Recent throughput in bytes per second
+		double				eta;			///< Estimated seconds left, -1 until a rate is known
+		const char*			current;		///< Name of the item being handled, NULL between items
+	} PARASITE_PROGRESS;
+
+	/**
+	* Callback that receives the progress of an operation at item and block boundaries.
+	* @param context Pointer passed through from ParasiteHost::SetProgressCallback
+	* @param progress Progress so far, only valid during the call
+	* @return TRUE to continue, FALSE to cancel the operation
+	*/
+	typedef BOOL (*PARASITE_PROGRESS_CALLBACK)(void* context, const PARASITE_PROGRESS* progress);
+
 	/**
 	* Simple utility function to extract the file name from a path
 	* @param path Path represented as a string to extract the file name from
@@ -136,6 +399,36 @@ namespace parasite
 	*/
 	parasite_api char* ExtractFileName(char* path);
 
+	/**
+	* Writes a string as a JSON string literal, quoted and escaped
+	* @param out Stream to write to
+	* @param text String to write
+	*/
+	parasite_api void WriteJsonString(FILE* out, const char* text);
+
+	/**
+	* Turns a local file path into the relative path an item is stored under.
+	* Backslashes become '/', and leading '/', drive letters, '.' components and
+	* everything up to the last '..' component are dropped.
+	* @param path Local file path
+	* @return The item path
+	*/
+	parasite_api std::string MakeItemPath(const char* path);
+
+	/**
+	* 32 bit FNV-1a hash of an item path, as used by the #TABLE_FORMAT_MAPPED name index.
+	*/
+	parasite_api unsigned int HashItemName(const char* name);
+
+	/**
+	* Checks that the sections of a #TABLE_FORMAT_MAPPED table are aligned, in
+	* order, and fit in the bytes available for the table.
+	* @param header Table header
+	* @param available Number of bytes from the header to the end of the table region
+	* @return TRUE if the sections can be used
+	*/
+	parasite_api BOOL CheckMapHeader(const PARASITE_MAP_HEADER& header, unsigned int available);
+
 	/**
 	* Handy function to make a #PARASITE_ITEM out of a filename, and do some error checking.
 	* @param item Reference to item we will stroe the results in.
@@ -145,6 +438,263 @@ namespace parasite
 	*/
 	parasite_api BOOL NewItemFromFile(PARASITE_ITEM& item, char* fileName, unsigned char flags = 0);
 
+	/**
+	* Returns the size of an item's original data, before any compression.
+	* @param item Item to get the size of
+	* @return Size of the original data in bytes
+	*/
+	parasite_api unsigned int GetOriginalSize(const PARASITE_ITEM& item);
+
+	/**
+	* Compact store of file table items.
+	* A #PARASITE_ITEM carries two #MAX_FILE_NAME arrays. The store keeps each
+	* field in its own array instead, and the paths back to back in one arena, so
+	* a table costs a few dozen bytes per item and walking one field of every item
+	* touches little memory. Items are addressed by their index in table order.
+	*/
+	class parasite_api ParasiteItemStore
+	{
+		private:
+			std::vector<unsigned int> offsets;	///< Stream offset of each item
+			std::vector<unsigned int> sizes;	///< Stored size of each item
+			std::vector<unsigned int> lzSizes;	///< Decompressed size of each item (if compression used)
+			std::vector<unsigned char> flags;	///< Feature flags of each item
+			std::vector<unsigned char> hashes;	///< MD5 sum of each item, #HASH_SIZE bytes apiece
+			std::vector<unsigned int> names;	///< Arena offset of each item's NUL terminated path
+			std::vector<char> arena;			///< Item paths
+
+		public:
+			/**
+			* Removes every item.
+			*/
+			void Clear();
+
+			/**
+			* Reserves room for a number of items.
+			* @param count Number of items
+			* @param nameBytes Bytes of paths, including their NULs
+			*/
+			void Reserve(unsigned int count, size_t nameBytes = 0);
+
+			/**
+			* Appends an item. Pointers returned by #GetName become invalid.
+			*/
+			void Add(const PARASITE_ITEM& item);
+
+			/**
+			* Appends an item from its fields, see above.
+			* @param name Path of the item, need not be NUL terminated
+			* @param length Number of characters in name
+			*/
+			void Add(const char* name, size_t length, unsigned int offset, unsigned int size,
+					 unsigned int lzSize, unsigned char flags, const unsigned char* hash);
+
+			/**
+			* Puts the items in a new order, and their paths in that order in the arena.
+			* @param order Index of the item that goes to each position
+			*/
+			void Reorder(const std::vector<unsigned int>& order);
+
+			/**
+			* Copies an item out of the store.
+			*/
+			void GetItem(unsigned int index, PARASITE_ITEM* item) const;
+
+			/**
+			* @return Bytes allocated by the store
+			*/
+			size_t GetMemoryUsage() const;
+
+			unsigned int GetCount() const { return (unsigned int) offsets.size(); }					///< Number of items
+			const char* GetName(unsigned int index) const { return &arena[names[index]]; }			///< Path of an item
+			unsigned int GetOffset(unsigned int index) const { return offsets[index]; }				///< Stream offset of an item
+			unsigned int GetSize(unsigned int index) const { return sizes[index]; }					///< Stored size of an item
+			unsigned int GetLzSize(unsigned int index) const { return lzSizes[index]; }				///< Decompressed size of an item
+			unsigned char GetFlags(unsigned int index) const { return flags[index]; }				///< Feature flags of an item
+			const unsigned char* GetHash(unsigned int index) const { return &hashes[index * HASH_SIZE]; }	///< MD5 sum of an item
+	};
+
+	/**
+	* Counts the memory of one host. Item buffers, scratch chunks and the LZ
+	* work memory are allocated through it, and the file table and other
+	* containers report what they hold, so the current and peak bytes and the
+	* number of allocations are known at any time. It may be used from any
+	* thread.
+	*/
+	class parasite_api ParasiteAllocator
+	{
+		private:
+			std::atomic<size_t> current;					///< Bytes allocated now
+			std::atomic<size_t> peak;						///< Most bytes allocated at once since the open window started
+			std::atomic<unsigned long long> allocations;	///< Number of allocations
+
+			ParasiteAllocator(const ParasiteAllocator&);			///< Not copyable
+			ParasiteAllocator& operator=(const ParasiteAllocator&);	///< Not copyable
+
+		public:
+			/**
+			* Constructor, nothing is allocated
+			*/
+			ParasiteAllocator();
+
+			/**
+			* Allocates a buffer, aligned like malloc.
+			* @return The buffer, or NULL if no memory was left
+			*/
+			void* Alloc(size_t size);
+
+			/**
+			* Frees a buffer from #Alloc, NULL is ignored.
+			*/
+			void Free(void* buffer);
+
+			/**
+			* Counts memory obtained elsewhere as one allocation, until #Drop.
+			*/
+			void Hold(size_t bytes);
+
+			/**
+			* Stops counting memory passed to #Hold.
+			*/
+			void Drop(size_t bytes);
+
+			/**
+			* Starts a window that tracks its own peak. Windows nest.
+			* @return Value to pass to #CloseWindow
+			*/
+			size_t OpenWindow();
+
+			/**
+			* Ends a window, the peak becomes the largest of it and the windows around it.
+			*/
+			void CloseWindow(size_t previous);
+
+			size_t GetCurrent() const { return current; }						///< Bytes allocated now
+			size_t GetPeak() const { return peak; }								///< Peak of the innermost open window
+			unsigned long long GetAllocations() const { return allocations; }	///< Number of allocations so far
+	};
+
+	/**
+	* Scope that tracks the peak memory and the allocations of a ParasiteAllocator
+	* while it lives.
+	*/
+	class parasite_api ParasiteMemoryWindow
+	{
+		private:
+			ParasiteAllocator& memory;			///< Allocator watched
+			size_t previous;					///< Peak of the enclosing window
+			unsigned long long allocations;		///< Allocations when the window opened
+
+		public:
+			ParasiteMemoryWindow(ParasiteAllocator& memory)
+				: memory(memory), previous(memory.OpenWindow()), allocations(memory.GetAllocations()) {}
+
+			~ParasiteMemoryWindow() { memory.CloseWindow(previous); }
+
+			/**
+			* @return Current bytes, the peak and the allocations since the window opened
+			*/
+			PARASITE_MEMORY_STATS GetStats() const
+			{
+				PARASITE_MEMORY_STATS stats;
+				stats.current = memory.GetCurrent();
+				stats.peak = memory.GetPeak();
+				stats.allocations = memory.GetAllocations() - allocations;
+				return stats;
+			}
+	};
+
+	/**
+	* Scratch memory for the buffers of one host's operations.
+	* Buffers are taken from the top of the arena and given back in reverse order
+	* by releasing to a mark, so reading, hashing and compressing an item costs no
+	* heap allocation once the arena has grown to the largest item. When it runs
+	* out another chunk is added, so buffers already handed out stay put, and once
+	* everything is released the chunks are merged into one.
+	*/
+	class parasite_api ParasiteScratch
+	{
+		private:
+			/**
+			* A block of scratch memory.
+			*/
+			typedef struct _SCRATCH_CHUNK
+			{
+				unsigned char*	base;	///< Start of the chunk
+				size_t			size;	///< Bytes in the chunk
+				size_t			used;	///< Bytes handed out from the start of the chunk
+				BOOL			mapped;	///< TRUE if the chunk was mapped rather than malloc'ed
+			} SCRATCH_CHUNK;
+
+			std::vector<SCRATCH_CHUNK> chunks;	///< Chunks, buffers are handed out from the last one in use
+			BOOL hugePages;						///< Map new chunks with huge pages
+			ParasiteAllocator* allocator;		///< Allocator chunks are taken from, NULL for malloc
+
+			/**
+			* Appends a chunk of at least size bytes.
+			*/
+			BOOL AddChunk(size_t size);
+
+			/**
+			* Frees every chunk.
+			*/
+			void FreeChunks();
+
+			ParasiteScratch(const ParasiteScratch&);			///< Not copyable
+			ParasiteScratch& operator=(const ParasiteScratch&);	///< Not copyable
+
+		public:
+			/**
+			* Constructor, no memory is taken until the first buffer
+			*/
+			ParasiteScratch();
+
+			/**
+			* Destructor, frees the arena
+			*/
+			~ParasiteScratch();
+
+			/**
+			* Backs chunks added from now on with huge pages, which saves TLB misses
+			* when large items are compressed. Explicit huge pages are tried first,
+			* then transparent ones. Only Linux has them, elsewhere this does nothing.
+			*/
+			void SetHugePages(BOOL use);
+
+			/**
+			* Takes chunks added from now on from an allocator, so they are counted.
+			* Must be set before the first buffer and outlive the arena.
+			*/
+			void SetAllocator(ParasiteAllocator* allocator);
+
+			/**
+			* Hands out a buffer, aligned to 64 bytes.
+			* @param size Bytes needed
+			* @return The buffer, or NULL if no memory was left
+			*/
+			unsigned char* Alloc(size_t size);
+
+			/**
+			* @return Position of the top of the arena, to pass to #Release
+			*/
+			size_t Mark();
+
+			/**
+			* Gives back every buffer handed out since a mark was taken.
+			*/
+			void Release(size_t mark);
+
+			/**
+			* @return Bytes held by the arena
+			*/
+			size_t GetCapacity();
+	};
+
+	class ParasiteTableMap;
+	class ParasiteTrace;
+	class ParasiteIO;
+	class ParasiteDirectFile;
+
 	/**
 	* A Class that provides a simple interface to interacting with a Parasite host file.
 	* This class can be used to open and existing Parasite file and perform operations, or to
@@ -158,9 +708,50 @@ namespace parasite
 	
 			FILE* hostFile; ///< The file pointer for the classes instance of an open host file.
 
-			std::vector<PARASITE_ITEM> itemList;      ///< Holds a list of items that are injected into the host file.
-			std::vector<PARASITE_ITEM>::iterator itr; ///< An iterator for the itemList
-		
+			ParasiteItemStore itemStore;				///< Items of the file table
+			std::vector<PARASITE_ITEM> newItems;		///< Items added to be written by #Infect
+			std::vector<PARASITE_ITEM>::iterator itr;	///< An iterator for newItems
+			std::vector<PARASITE_ITEM> itemList;		///< Copy of #itemStore handed out by #GetItems
+			BOOL itemListCurrent;						///< TRUE while itemList matches #itemStore
+			std::deque<PARASITE_ITEM> foundItems;		///< Items copied out of the table by #FindItem
+			std::vector<unsigned int> foundIndex;		///< Position in foundItems plus one of each table item, 0 if not copied
+			std::vector<PARASITE_DIR> dirList;		///< Directory tree of #itemStore, valid while #tableSorted is set
+			BOOL tableSorted;						///< TRUE while #itemStore is in table order and #dirList matches it
+			unsigned char tableFormat;				///< Format #WriteFileTable writes
+			BOOL compressTable;						///< Let #WriteFileTable compress #TABLE_FORMAT_COMPACT tables
+
+			BOOL lazyTable;							///< Let #ReadFileTable leave entries undecoded until they are needed
+			BOOL indexEntries;						///< Build #tableEntries on the first lazy lookup
+			BOOL tableLoaded;						///< FALSE while the entries of the table read last are not in #itemStore
+			std::vector<unsigned char> tableBody;	///< Body of a compact table that is not loaded yet
+			unsigned int tableItemsStart;			///< Offset of the first item entry in #tableBody
+			std::vector<PARASITE_TABLE_ENTRY> tableEntries;	///< Entry index of #tableBody, in table order
+			std::string entryNames;					///< Name pool of #tableEntries
+			ParasiteTableMap* tableMap;				///< Mapping of a mapped table that is not loaded yet
+
+			std::map<unsigned int, PARASITE_BLOCK_INDEX> blockIndexes; ///< Block indexes already read, by item offset
+			ParasiteAllocator allocator;			///< Counts the buffers and the table of the host
+			size_t tableMemory;						///< Bytes of the table and item lists held in #allocator
+			ParasiteScratch scratch;				///< Buffers for writing and extracting items, taken from #allocator
+			size_t memoryBudget;					///< Bytes of item buffers operations try to stay under, 0 for no limit
+			BOOL pipelineWrites;					///< Write large item files with overlapped read, compress and write stages
+			ParasiteIO* io;							///< Engine for asynchronous reads and writes, NULL for stdio
+			unsigned int ioDepth;					///< Requests #io keeps in flight
+			BOOL directIO;							///< Extract and restore around the page cache
+			PARASITE_STATS stats;					///< Statistics collected since #ResetStats
+			BOOL collectStats;						///< Time the phases of every operation
+			double statsStart;						///< Clock when collection started
+			unsigned long long statsAllocations;	///< Allocations of #allocator when collection started
+			ParasiteTrace* trace;					///< Records spans of operations, NULL for none
+			PARASITE_PROGRESS_CALLBACK progressCallback;	///< Receives the progress of operations, NULL for none
+			void* progressContext;					///< Passed to #progressCallback
+			PARASITE_PROGRESS progress;				///< Progress of the running operation
+			BOOL progressActive;					///< TRUE while an operation reports progress
+			BOOL progressCancelled;					///< TRUE once #progressCallback cancelled the operation
+			double progressStart;					///< Clock when the operation started
+			double rateTime;						///< Clock at the start of the current rate window
+			unsigned long long rateBytes;			///< Bytes done at the start of the current rate window
+
 			/* Class options */
 			BOOL verboseOutput; ///< If this is set TRUE members will display more debugging information at runtime
 	
@@ -238,26 +829,275 @@ namespace parasite
 			*	strean pointer position. Make sure you do a #Seek or #RSeek to get the file in the
 			*	propper poistion before calling this function.
 			*	@param item Pointer to an item object to write to the host file.
+			*	@param data Optional buffer already holding the item data. When this is
+			*	            passed the item hash must already be set, otherwise the data is
+			*	            read from the item's local path and hashed here.
 			*	@return TRUE if the item was correctly written to host
 			*/
-			BOOL WriteItemToHost(PARASITE_ITEM* item);
+			BOOL WriteItemToHost(PARASITE_ITEM* item, unsigned char* data = NULL);
+
+			/**
+			*	Reads a batch of small items into memory, hashes them together with the
+			*	multi-buffer MD5 engine and writes them to the host.
+			*	@param items Array of pointers to the items in the batch
+			*	@param count Number of items in the batch
+			*	@return TRUE if all items were written to host
+			*/
+			BOOL WriteItemBatch(PARASITE_ITEM** items, int count);
+
+			/**
+			*	Compresses an item buffer block by block and appends it to the host
+			*	in the #FEATURE_BLOCKS layout.
+			*	@param item Item being written, its size is updated to the stored size.
+			*	@param data Original item data, or NULL to read it from source
+			*	@param source File the blocks are read from when data is NULL. The
+			*	              item hash is then calculated as the blocks go by.
+			*	@return TRUE if the item was written
+			*/
+			BOOL WriteCompressedBlocks(PARASITE_ITEM* item, unsigned char* data, FILE* source = NULL);
 
 			/**
+			*	Writes an item from its local path one block at a time, for items
+			*	too large to be read whole within the memory budget.
+			*	@return TRUE if the item was written
 			*/
-			BOOL CompareFileHash(char* fileName, unsigned char* testHash);
+			BOOL WriteStreamedItem(PARASITE_ITEM* item);
+
+			/**
+			*	Writes an item from its local path with a reader thread, the
+			*	compressor on the calling thread and a writer thread passing
+			*	blocks through #PIPELINE_SLOTS buffers, so the disk and the CPU
+			*	work at the same time. The host layout is the one of
+			*	#WriteCompressedBlocks, or the raw data when not compressing.
+			*	@return TRUE if the item was written
+			*/
+			BOOL WritePipelinedItem(PARASITE_ITEM* item);
+
+			/**
+			*	@return Size of the blocks items are compressed in, #BLOCK_SIZE unless
+			*	        the memory budget is too small for its work buffers
+			*/
+			unsigned int GetCompressBlockSize();
+
+			/**
+			*	@return Largest number of bytes read for one hash batch within the memory budget
+			*/
+			unsigned int GetBatchLimit();
+
+			/**
+			*	Returns the block index of an item, reading it from the host the first
+			*	time it is needed.
+			*	@param item Item to get the block index of
+			*	@return Pointer to the index, or NULL if it could not be read or is corrupt
+			*/
+			PARASITE_BLOCK_INDEX* GetBlockIndex(const PARASITE_ITEM* item);
+
+			/**
+			*	Sorts #itemStore into table order and rebuilds the directory tree.
+			*/
+			void SortTable();
+
+			/**
+			*	Collects the #itemStore indexes of the items whose path starts with a
+			*	prefix, see #FindPrefix.
+			*/
+			void FindPrefixIndexes(const char* prefix, std::vector<unsigned int>* indexes);
+
+			/**
+			*	Copies #itemStore into itemList unless it is current.
+			*/
+			void MakeItemList();
+
+			/**
+			*	Finds a directory by its full path with a binary search of #dirList.
+			*	@param path Directory path without a trailing '/', empty for the root
+			*	@param length Number of characters of path to use
+			*	@return Index of the directory, or -1 if there is none
+			*/
+			int FindDirectory(const char* path, size_t length);
+
+			/**
+			*	Reads an unsigned LEB128 varint from the host file.
+			*/
+			BOOL ReadVarint(unsigned int* value);
+
+			/**
+			*	Reads the file table with the reader of its format.
+			*/
+			BOOL ReadFileTableFormat();
+
+			/**
+			*	@return Clock to pass to #AddPhaseStats, 0 when statistics are not collected and there is no trace
+			*/
+			double StatsStart();
+
+			/**
+			*	Adds the time since start and the bytes handled to a phase, and records it as a span of the trace.
+			*/
+			void AddPhaseStats(int phase, double start, unsigned long long bytes);
+
+			/**
+			*	Records the sizes of an item and the time since start.
+			*/
+			void AddItemStats(const PARASITE_ITEM* item, BOOL written, double start, const ParasiteMemoryWindow& window);
+
+			/**
+			*	Records the time and memory of the operation it lives in with the statistics.
+			*/
+			class OperationStats
+			{
+				private:
+					ParasiteHost* host;				///< Host running the operation
+					const char* name;				///< Operation name
+					double start;					///< Clock when it started
+					ParasiteMemoryWindow window;	///< Memory while it runs
+
+				public:
+					OperationStats(ParasiteHost* host, const char* name);
+					~OperationStats();
+			};
+
+			/**
+			*	Counts what the table, the item lists and the lookups of found items
+			*	hold with #allocator. Called whenever they may have grown or shrunk.
+			*/
+			void UpdateTableMemory();
+
+			/**
+			*	Extracts every item with #io, reading the host in payload order.
+			*/
+			BOOL ExtractItemsAsync(char* path);
+
+			/**
+			*	Reads the files of a batch of items with #io into their buffers.
+			*/
+			BOOL ReadItemFiles(PARASITE_ITEM** items, int count, unsigned char** buffers);
+
+			/**
+			*	Deletes #io after it failed, which ends its requests in flight, so
+			*	their buffers may be released. Later operations use stdio.
+			*/
+			void AbandonIO();
+
+			/**
+			*	Opens a file around the page cache and counts it with the statistics.
+			*/
+			BOOL OpenDirectFile(ParasiteDirectFile& file, const char* path, BOOL write);
+
+			/**
+			*	Records time and bytes of reads and writes around the page cache.
+			*/
+			void AddDirectStats(double seconds, unsigned long long bytesRead, unsigned long long bytesWritten);
+
+			/**
+			*	Starts reporting the progress of an operation to #progressCallback.
+			*/
+			void StartProgress(unsigned int items, unsigned long long bytes);
+
+			/**
+			*	Adds to the progress and reports it.
+			*	@return FALSE if the callback cancelled the operation, with the last error set
+			*/
+			BOOL ReportProgress(unsigned long long bytes, unsigned int items, const char* current);
+
+			/**
+			*	Stops reporting progress.
+			*/
+			void EndProgress();
+
+			/**
+			*	Cuts the host file off at end and moves the stream there.
+			*/
+			BOOL TruncateHost(long end);
+
+			/**
+			*	Parses the rest of a #TABLE_FORMAT_LEGACY file table.
+			*/
+			BOOL ReadLegacyFileTable();
+
+			/**
+			*	Parses the rest of a #TABLE_FORMAT_TREE file table.
+			*/
+			BOOL ReadTreeFileTable();
+
+			/**
+			*	Parses the rest of a #TABLE_FORMAT_COMPACT file table.
+			*/
+			BOOL ReadCompactFileTable();
+
+			/**
+			*	Writes the directories and items of a #TABLE_FORMAT_TREE file table.
+			*/
+			BOOL WriteTreeFileTable();
+
+			/**
+			*	Writes the body of a #TABLE_FORMAT_COMPACT file table.
+			*/
+			BOOL WriteCompactFileTable();
+
+			/**
+			*	Parses the rest of a #TABLE_FORMAT_MAPPED file table into #itemStore.
+			*/
+			BOOL ReadMappedFileTable();
+
+			/**
+			*	Writes the padding and sections of a #TABLE_FORMAT_MAPPED file table.
+			*/
+			BOOL WriteMappedFileTable();
+
+			/**
+			*	Decodes the item entries of #tableBody into #itemStore.
+			*/
+			BOOL ParseCompactItems();
+
+			/**
+			*	Decodes every entry of a table #ReadFileTable left undecoded, and
+			*	drops the lazy lookup state. Does nothing once the table is loaded.
+			*	@return TRUE if #itemStore holds the whole table
+			*/
+			BOOL LoadTable();
+
+			/**
+			*	Frees the undecoded table, its entry index and mapping, and marks the table loaded.
+			*/
+			void ReleaseLazyTable();
+
+			/**
+			*	Skims the item entries of #tableBody once to build #tableEntries.
+			*/
+			BOOL BuildEntryIndex();
+
+			/**
+			*	Looks up an item in a table that is not loaded, decoding as few
+			*	entries as possible.
+			*/
+			const PARASITE_ITEM* FindLazyItem(const char* itemName);
+
+			/**
+			*	Returns the copy of a table item handed out by #FindItem, making it
+			*	the first time the item is found. Copies live until the next table is read.
+			*	@param index Index of the item in table order
+			*	@param item The item, or NULL to copy it from #itemStore
+			*/
+			const PARASITE_ITEM* KeepFoundItem(unsigned int index, const PARASITE_ITEM* item);
 
 	public:
 			/**
 			* Constructor
 			*/
-			ParasiteHost():verboseOutput(true)
-			{}
+			ParasiteHost():itemListCurrent(true), tableSorted(true), tableFormat(TABLE_FORMAT_COMPACT), compressTable(true), lazyTable(false),
+						   indexEntries(false), tableLoaded(true), tableItemsStart(0), tableMap(NULL), tableMemory(0), memoryBudget(0), pipelineWrites(true), io(NULL),
+						   ioDepth(IO_QUEUE_DEPTH), directIO(false), collectStats(false), statsStart(0), statsAllocations(0), trace(NULL), progressCallback(NULL), progressContext(NULL),
+						   progressActive(false), progressCancelled(false), progressStart(0), rateTime(0), rateBytes(0), verboseOutput(true)
+			{
+				scratch.SetAllocator(&allocator);
+				ResetStats();
+			}
 
 			/**
 			* Destructor
 			*/
-			~ParasiteHost()
-			{}
+			~ParasiteHost();
 	
 			/**
 			*  Call this to get some text describing the last ParasiteHost internal failure
@@ -271,6 +1111,125 @@ namespace parasite
 			*/
 			void SetVerboseOutput(BOOL verbose);
 
+			/**
+			* Selects the format #WriteFileTable writes. New hosts default to #TABLE_FORMAT_COMPACT,
+			* and #ReadHeader selects the format of the table it reads, legacy tables excepted.
+			* @param format #TABLE_FORMAT_TREE, #TABLE_FORMAT_COMPACT or #TABLE_FORMAT_MAPPED
+			* @param compress Compress the body of compact tables when that makes them smaller
+			* @return TRUE if the format can be written
+			*/
+			BOOL SetTableFormat(unsigned char format, BOOL compress = true);
+
+			/**
+			* Makes #ReadFileTable read only the directories of the table and decode
+			* entries when they are looked up, so a single item can be read from a
+			* huge host without parsing the whole table. #TABLE_FORMAT_MAPPED tables
+			* are looked up in place through a mapping of the host, #TABLE_FORMAT_COMPACT
+			* tables are kept in memory undecoded, and older formats are read in full.
+			* Calls that need every entry, such as #GetItems or #WriteFileTable, load
+			* the rest of the table first.
+			* @param lazy TRUE to defer decoding entries
+			* @param index Build an index of the compact table entries on the first
+			*              lookup, so further lookups decode a single entry. Costs 12
+			*              bytes and the name of every entry.
+			*/
+			void SetLazyTable(BOOL lazy, BOOL index = false);
+
+			/**
+			* Backs the scratch buffers used to write and extract items with huge pages.
+			* See ParasiteScratch::SetHugePages.
+			*/
+			void SetScratchHugePages(BOOL use);
+
+			/**
+			* Bounds the memory used for item buffers. Batches, compression blocks and
+			* test workers shrink to fit, and items too large to be held whole are
+			* streamed in blocks instead. The file table itself is not counted.
+			* @param bytes Budget in bytes, 0 removes the limit
+			*/
+			void SetMemoryBudget(size_t bytes);
+
+			/**
+			* Turns the pipelined writing of item files of #PIPELINE_MIN_SIZE and
+			* more on or off, see #WritePipelinedItem. It is on by default, off
+			* every item is read whole, then compressed, then written.
+			*/
+			void SetPipelinedWrites(BOOL enable);
+
+			/**
+			* Chooses how #ExtractAll reads stored items and writes the extracted
+			* files, and how #Infect reads batches of small files. An asynchronous
+			* engine keeps many requests in flight, so decoding overlaps the disk
+			* and fast devices see a deep queue. Items too large for the memory in
+			* flight still go through stdio one at a time.
+			* @param engine #IO_ENGINE_SYNC, #IO_ENGINE_THREADS, #IO_ENGINE_URING or #IO_ENGINE_AUTO
+			* @param depth Most requests in flight
+			* @return FALSE if the engine is not available on this system, stdio is used then
+			*/
+			BOOL SetIOEngine(int engine, unsigned int depth = IO_QUEUE_DEPTH);
+
+			/**
+			* @return Name of the engine in use, "stdio" when there is none
+			*/
+			const char* GetIOEngineName();
+
+			/**
+			* Makes #ExtractAll, #ExtractItem and #RestoreFile leave the page cache
+			* alone, so bulk unpacking does not push out the data of other
+			* processes. Files are written and the host is read for restoring with
+			* O_DIRECT through aligned buffers. File systems without O_DIRECT get
+			* plain I/O with the pages dropped by posix_fadvise(DONTNEED) once
+			* written back. Host pages read for extraction are dropped after every
+			* item. #ExtractAll then extracts one item at a time, without #io.
+			* @return FALSE if this system has no support for it
+			*/
+			BOOL SetDirectIO(BOOL enable);
+
+			/**
+			* Starts or stops timing the phases of every operation. Starting also
+			* resets the statistics. The clock is only read while collecting.
+			*/
+			void SetCollectStats(BOOL collect);
+
+			/**
+			* Clears the statistics and restarts their clock.
+			*/
+			void ResetStats();
+
+			/**
+			* @return Statistics collected since they were last reset
+			*/
+			const PARASITE_STATS& GetStats();
+
+			/**
+			* Writes the statistics as a JSON object.
+			*/
+			void DumpStats(FILE* out);
+
+			/**
+			* @return Name of a phase as used by #DumpStats, for example "compress"
+			*/
+			static const char* GetPhaseName(int phase);
+
+			/**
+			* Records spans of the work of every operation into a trace: the
+			* operations, every item written or extracted, table reads and writes,
+			* and every phase as timed by the statistics. Several hosts may share a
+			* trace, and it must outlive its use by the host.
+			* @param trace Trace to record to, NULL to stop recording
+			*/
+			void SetTrace(ParasiteTrace* trace);
+
+			/**
+			* Sets a callback that receives the progress of #Infect, #ExtractAll and
+			* #RestoreFile after every item and block. Returning FALSE from it
+			* cancels the operation at that boundary, see the operations for what
+			* they leave behind.
+			* @param callback Callback to use, NULL to stop reporting
+			* @param context Pointer passed to every call
+			*/
+			void SetProgressCallback(PARASITE_PROGRESS_CALLBACK callback, void* context);
+
 			/**
 			* Returns the size of loaded #hostFile
 			*/
@@ -278,42 +1237,195 @@ namespace parasite
 
 			/**
 			*  Writes debug information about a PARASITE_ITEM to stdout.
+			*  @param prefix Optional, only items whose path starts with prefix are written
 			*/
-			void DumpItems();
+			void DumpItems(const char* prefix = NULL);
 
 			/**
-			* Adds a #PARASITE_ITEM to the private #itemList
+			* Adds a #PARASITE_ITEM to be written to the host by #Infect
 			* @param item Item that will be added to the list
 			*/
 			void AddItem(PARASITE_ITEM & item);
 
+			/**
+			* Adds an item whose data is already in memory, so nothing is read from disk
+			* when the host is infected. The data is not copied: it must stay valid until
+			* #Infect or #InfectMore has written the item.
+			* @param name Name to store the item under, made a relative path like the
+			*             names of file items
+			* @param data Item data
+			* @param size Number of bytes in data
+			* @param flags Feature flags (compression etc) for the item
+			* @return TRUE if the item was added
+			*/
+			BOOL AddItemFromMemory(const char* name, const unsigned char* data, unsigned int size, unsigned char flags = 0);
+
+			/**
+			* Decodes an item into a newly allocated buffer.
+			* @param itemName Name of the item to read
+			* @param size Receives the number of bytes in the returned buffer
+			* @return Buffer holding the item data, to be released with free(), or NULL on failure
+			*/
+			unsigned char* ReadItem(const char* itemName, unsigned int* size);
+
+			/**
+			* Decodes an item into a buffer provided by the caller.
+			* @param itemName Name of the item to read
+			* @param buffer Buffer that receives the item data
+			* @param bufferSize Size of buffer, fails if the item does not fit
+			* @param size Optional, receives the number of bytes read
+			* @return TRUE if the item was read and its hash verified
+			*/
+			BOOL ReadItem(const char* itemName, unsigned char* buffer, unsigned int bufferSize, unsigned int* size = NULL);
+
 			/**
 			* Pulls an item out of infected host file and saves it in a new file.
 			* If the file was infected with compression, ExtractItem will automatically
-			* decompress the file while extracting. Extract item will also perform
-			* an MD5 checksum test to make sure the extracted file data is accurate.
+			* decompress the file while extracting. The MD5 checksum of the data is
+			* calculated while it is written, and if it does not match the hash stored
+			* at injection time the partially written file is removed.
 			* @param itemName Name of the file to extract from the infected host
 			* @param path Optional target path to extract items to.
-			* @return TRUE if file was extracted
+			* @return TRUE if file was extracted and its hash verified
 			*/
 			BOOL ExtractItem(char* itemName, char* path = NULL);
+
+			/**
+			* Extracts an item returned by #FindItem or copied out of #GetItemStore, see above.
+			*/
+			BOOL ExtractItem(const PARASITE_ITEM* item, char* path = NULL);
 	
+			/**
+			* Looks up an item in the file table by its path with a binary search.
+			* The item is copied out of the table once, and the returned pointer stays
+			* valid until the next table is read.
+			* @param itemName Path of the item
+			* @return The item, or NULL if no item has that name
+			*/
+			const PARASITE_ITEM* FindItem(const char* itemName);
+
+			/**
+			* Lists one directory of the file table without visiting the rest of it.
+			* @param path Directory path, empty or NULL for the root
+			* @param items Receives the items directly in the directory, sorted by name
+			* @param subdirs Optional, receives the full paths of the directories directly below it
+			* @return TRUE if the directory exists
+			*/
+			BOOL ListDirectory(const char* path, std::vector<const PARASITE_ITEM*>* items,
+							   std::vector<std::string>* subdirs = NULL);
+
+			/**
+			* Finds every item whose path starts with a prefix, such as "docs/" for a
+			* whole subtree or "docs/re" for the names starting with "re" in docs.
+			* Only the directory holding the prefix and the matching subtrees are visited.
+			* @param prefix Path prefix, empty or NULL for every item
+			* @param items Receives the matching items in table order
+			* @return Number of items found
+			*/
+			unsigned int FindPrefix(const char* prefix, std::vector<const PARASITE_ITEM*>* items);
+
+			/**
+			* Returns a copy of the items of the file table, in table order.
+			* The reference is valid until items are added to the host. Use
+			* #GetItemStore to walk large tables without copying them.
+			*/
+			const std::vector<PARASITE_ITEM>& GetItems();
+
+			/**
+			* Returns the items of the file table, in table order.
+			* The reference is valid until the next table is read.
+			*/
+			const ParasiteItemStore& GetItemStore();
+
+			/**
+			* Gets the block layout of an item's decompressed data.
+			* @param item Item returned by #FindItem
+			* @param blockSize Receives the decompressed size of every block but the last
+			* @param blockCount Receives the number of blocks
+			* @return TRUE if the block index could be read
+			*/
+			BOOL GetItemBlocks(const PARASITE_ITEM* item, unsigned int* blockSize, unsigned int* blockCount);
+
+			/**
+			* Reads and decodes a single block of an item.
+			* @param item Item returned by #FindItem
+			* @param block Number of the block to read
+			* @param out Buffer that receives the block, must hold the block size
+			* @param outSize Receives the number of bytes in the block
+			* @return TRUE if the block was read and decoded
+			*/
+			BOOL ReadItemBlock(const PARASITE_ITEM* item, unsigned int block, unsigned char* out, unsigned int* outSize);
+
+			/**
+			* Reads the bytes [offset, offset + length) of an item's original data.
+			* Only the blocks covering the range are read and decompressed, uncompressed
+			* items are read straight from the host.
+			* @param itemName Name of the item
+			* @param offset Offset of the first byte to read
+			* @param length Number of bytes to read
+			* @param buffer Receives the data, must hold length bytes
+			* @param bytesRead Optional, receives the number of bytes read, which is less
+			*                  than length when the range runs past the end of the item
+			* @return TRUE if the range was read
+			*/
+			BOOL ReadRange(char* itemName, unsigned int offset, unsigned int length, unsigned char* buffer,
+						   unsigned int* bytesRead = NULL);
+
+			/**
+			* Reads a range of an item returned by #FindItem, see the overload above.
+			*/
+			BOOL ReadRange(const PARASITE_ITEM* item, unsigned int offset, unsigned int length, unsigned char* buffer,
+						   unsigned int* bytesRead = NULL);
+
+			/**
+			* Decodes an item and passes its data to a sink callback in chunks,
+			* without creating any file. The hash is verified as the data passes
+			* through, but it can only be checked after the last chunk has been
+			* delivered: when this returns FALSE the sink should discard what it got.
+			* @param itemName Name of the item to extract
+			* @param sink Callback that receives the data
+			* @param context Pointer passed to every sink call
+			* @return TRUE if the item was delivered completely and its hash verified
+			*/
+			BOOL ExtractItemToSink(const char* itemName, PARASITE_SINK sink, void* context);
+
+			/**
+			* Extracts an item returned by #FindItem to a sink, see above.
+			*/
+			BOOL ExtractItemToSink(const PARASITE_ITEM* item, PARASITE_SINK sink, void* context);
+
 			/**
 			* Unpacks all the injected files to the specified path, or .
 			* @param path Option path to extract the files into.
-			* @return TRUE if files where extracted without error.
+			* @return TRUE if files where extracted without error. A cancelled
+			*         extraction keeps the items finished before it stopped.
 			*/
 			BOOL ExtractAll(char* path = NULL);	
 
+			/**
+			* Checks the integrity of every item without writing anything to disk.
+			* The payload region is read sequentially by the calling thread, while
+			* worker threads decompress the items in memory and compare them against
+			* the hashes stored at injection time.
+			* @param results Optional vector that receives one result per item, in file table order.
+			* @param threads Number of worker threads, or 0 to use one per CPU.
+			* @return TRUE if every item passed.
+			*/
+			BOOL TestItems(std::vector<PARASITE_TEST_RESULT>* results = NULL, int threads = 0);
+
 			/**
 			* Restores the original host file to specified new file.
 			* @param outfile Target filename to store restored file in
-			* @return TRUE if file was restored correctly
+			* @return TRUE if file was restored correctly, a failed or cancelled
+			*         restore leaves no file behind
 			*/
 			BOOL RestoreFile(char* outfile);
 
 			/**
 			* Parses the filetable from hostFile stream starting at current position.
+			* Tables of either major version are read, and the items are left sorted by
+			* path with the directory tree built. See #SetLazyTable for reading only
+			* what lookups need.
 			*/
 			BOOL ReadFileTable();
 
@@ -328,17 +1440,28 @@ namespace parasite
 
 			/**
 			* Infects the hostFile with a vector of items representing files.
-			* @return TRUE if all files where injected into hostFile stream
+			* @return TRUE if all files where injected into hostFile stream. A
+			*         failed or cancelled infection truncates the host back to its
+			*         original size and drops the items it was adding.
 			*/
 			BOOL Infect();
 
 			/**
 			* Inserts more items(files) into an exisiting parasite host,
 			*/
-			BOOL InfectMore(PARASITE_ITEM item);
+			BOOL InfectMore(const PARASITE_ITEM& item);
 
 			/**
-			* Generates a parasite file table from a vector of PARASITE_ITEM and writes it to fileHost stream.
+			* Generates a parasite file table from the items of the host and writes it to fileHost stream.
+			* The items are sorted by path first. The table holds the directory tree (parent,
+			* end of subtree, item count and name of each directory) followed by the items
+			* grouped by directory.
+			*
+			* #TABLE_FORMAT_TREE writes fixed width fields and names each directory and item
+			* relative to its parent. #TABLE_FORMAT_COMPACT writes varints, front codes the
+			* directory paths and item names against the previous one, codes every offset as
+			* the signed difference from the end of the previous item, and LZ compresses the
+			* whole body when that saves space.
 			* @param startOffset Stream position to write file table at, or defaults to current position
 			* @return TRUE if a valid table was written to the stream.
 			*/
@@ -0,0 +1,464 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_catalog.cpp
+ *	Implementation of the multi-host catalog found in #parasite_catalog.h
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#define parasite_export
+#define parasite_static_lib
+#include "parasite_catalog.h"
+
+#include <algorithm>
+
+namespace parasite
+{
+	/**
+	* 64 bit FNV-1a hash of an item name, split into the two Bloom filter hashes.
+	*/
+	static void HashName(const char* name, unsigned int* h1, unsigned int* h2)
+	{
+		unsigned long long hash = 14695981039346656037ULL;
+		for(const unsigned char* c = (const unsigned char*) name; *c; c++)
+		{
+			hash ^= *c;
+			hash *= 1099511628211ULL;
+		}
+
+		*h1 = (unsigned int) hash;
+		*h2 = (unsigned int) (hash >> 32) | 1;
+	}
+
+
+	static void BloomAdd(std::vector<unsigned long long>& bloom, const char* name)
+	{
+		unsigned int h1, h2;
+		unsigned int bits = (unsigned int) bloom.size() * 64;
+		HashName(name, &h1, &h2);
+
+		for(unsigned int i = 0; i < BLOOM_HASHES; i++)
+		{
+			unsigned int bit = (h1 + i * h2) % bits;
+			bloom[bit / 64] |= 1ULL << (bit % 64);
+		}
+	}
+
+
+	static BOOL BloomTest(const std::vector<unsigned long long>& bloom, const char* name)
+	{
+		if(bloom.empty())
+			return FALSE;
+
+		unsigned int h1, h2;
+		unsigned int bits = (unsigned int) bloom.size() * 64;
+		HashName(name, &h1, &h2);
+
+		for(unsigned int i = 0; i < BLOOM_HASHES; i++)
+		{
+			unsigned int bit = (h1 + i * h2) % bits;
+			if(!(bloom[bit / 64] & (1ULL << (bit % 64))))
+				return FALSE;
+		}
+
+		return TRUE;
+	}
+
+
+	static bool CompareEntry(const PARASITE_CATALOG_ENTRY& a, const PARASITE_CATALOG_ENTRY& b)
+	{
+		int order = strcmp(a.name.c_str(), b.name.c_str());
+		if(order != 0)
+			return order < 0;
+
+		return a.host < b.host;
+	}
+
+
+	static bool EntryBeforeName(const PARASITE_CATALOG_ENTRY& entry, const char* name)
+	{
+		return strcmp(entry.name.c_str(), name) < 0;
+	}
+
+
+	/**
+	* Writes a value to the catalog file in native byte order.
+	*/
+	template <class T>
+	static BOOL Put(FILE* file, const T& value)
+	{
+		return fwrite(&value, sizeof(T), 1, file) == 1;
+	}
+
+
+	static BOOL PutString(FILE* file, const std::string& value)
+	{
+		unsigned short length = (unsigned short) value.size();
+		return Put(file, length) && fwrite(value.data(), 1, length, file) == length;
+	}
+
+
+	/**
+	* Bounds checked reader over a catalog file loaded into memory.
+	*/
+	struct CatalogReader
+	{
+		const unsigned char* pos;
+		const unsigned char* end;
+
+		template <class T>
+		BOOL Get(T* value)
+		{
+			if((size_t) (end - pos) < sizeof(T))
+				return FALSE;
+			memcpy(value, pos, sizeof(T));
+			pos += sizeof(T);
+			return TRUE;
+		}
+
+		BOOL GetBytes(void* value, size_t size)
+		{
+			if((size_t) (end - pos) < size)
+				return FALSE;
+			memcpy(value, pos, size);
+			pos += size;
+			return TRUE;
+		}
+
+		BOOL GetString(std::string* value)
+		{
+			unsigned short length;
+			if(!Get(&length) || (size_t) (end - pos) < length)
+				return FALSE;
+			value->assign((const char*) pos, length);
+			pos += length;
+			return TRUE;
+		}
+	};
+
+
+	ParasiteCatalog::ParasiteCatalog()
+	{
+		sorted = TRUE;
+		LastError[0] = 0;
+	}
+
+
+	void ParasiteCatalog::SetLastError(const char* error)
+	{
+		strcpy(LastError, error);
+	}
+
+
+	char* ParasiteCatalog::GetLastError()
+	{
+		return (char*)&LastError;
+	}
+
+
+	void ParasiteCatalog::Sort()
+	{
+		if(sorted)
+			return;
+
+		std::sort(entries.begin(), entries.end(), CompareEntry);
+		sorted = TRUE;
+	}
+
+
+	BOOL ParasiteCatalog::AddHost(char* hostfile)
+	{
+		ParasiteHost host;
+		host.SetVerboseOutput(FALSE);
+
+		if(host.OpenReadOnly(hostfile) == FALSE)
+		{
+			SetLastError("Could not open host file");
+			return FALSE;
+		}
+
+		if(host.HasParasite() == FALSE)
+		{
+			SetLastError("Host file does not have a Parasite header");
+			host.Close();
+			return FALSE;
+		}
+
+		if(host.ReadHeader() == FALSE || host.ReadFileTable() == FALSE)
+		{
+			SetLastError(host.GetLastError());
+			host.Close();
+			return FALSE;
+		}
+
+		const ParasiteItemStore& items = host.GetItemStore();
+
+		PARASITE_CATALOG_HOST record;
+		record.filename = hostfile;
+		record.size = host.GetSize();
+		record.items = items.GetCount();
+		record.bloom.resize(((size_t) items.GetCount() * BLOOM_BITS_PER_ITEM + 63) / 64 + 1, 0);
+
+		unsigned int id = (unsigned int) hosts.size();
+		entries.reserve(entries.size() + items.GetCount());
+		for(unsigned int i = 0; i < items.GetCount(); i++)
+		{
+			PARASITE_CATALOG_ENTRY entry;
+			entry.host = id;
+			entry.offset = items.GetOffset(i);
+			entry.size = items.GetSize(i);
+			entry.lzSize = items.GetLzSize(i);
+			entry.flags = items.GetFlags(i);
+			memcpy(entry.hash, items.GetHash(i), HASH_SIZE);
+			entry.name = items.GetName(i);
+
+			BloomAdd(record.bloom, items.GetName(i));
+			entries.push_back(entry);
+		}
+
+		host.Close();
+
+		hosts.push_back(record);
+		sorted = FALSE;
+		return TRUE;
+	}
+
+
+	BOOL ParasiteCatalog::Write(const char* catalogFile)
+	{
+		Sort();
+
+		FILE* file = fopen(catalogFile, "wb");
+		if(file == NULL)
+		{
+			SetLastError("Could not open catalog file for writing");
+			return FALSE;
+		}
+
+		unsigned char version = CATALOG_VERSION;
+		unsigned int hostCount = (unsigned int) hosts.size();
+		unsigned int entryCount = (unsigned int) entries.size();
+
+		BOOL result = fwrite(CATALOG_TAG, 1, TAG_SIZE, file) == TAG_SIZE
+					&& Put(file, version) && Put(file, hostCount) && Put(file, entryCount);
+
+		for(unsigned int i = 0; result && i < hosts.size(); i++)
+		{
+			const PARASITE_CATALOG_HOST& host = hosts[i];
+			unsigned int words = (unsigned int) host.bloom.size();
+
+			result = PutString(file, host.filename) && Put(file, host.size) && Put(file, host.items)
+					&& Put(file, words) && fwrite(&host.bloom[0], sizeof(unsigned long long), words, file) == words;
+		}
+
+		for(unsigned int i = 0; result && i < entries.size(); i++)
+		{
+			const PARASITE_CATALOG_ENTRY& entry = entries[i];
+
+			result = Put(file, entry.host) && Put(file, entry.offset) && Put(file, entry.size)
+					&& Put(file, entry.lzSize) && Put(file, entry.flags) && Put(file, entry.hash)
+					&& PutString(file, entry.name);
+		}
+
+		if(fclose(file) != 0)
+			result = FALSE;
+
+		if(result == FALSE)
+		{
+			SetLastError("Failed writing catalog file");
+			remove(catalogFile);
+		}
+
+		return result;
+	}
+
+
+	BOOL ParasiteCatalog::Load(const char* catalogFile)
+	{
+		FILE* file = fopen(catalogFile, "rb");
+		if(file == NULL)
+		{
+			SetLastError("Could not open catalog file");
+			return FALSE;
+		}
+
+		/*
+			The whole catalog is read with one call and parsed in memory
+		*/
+		std::vector<unsigned char> data;
+		fseek(file, 0, SEEK_END);
+		long length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		if(length > 0)
+		{
+			data.resize(length);
+			if(fread(&data[0], 1, length, file) != (size_t) length)
+				data.clear();
+		}
+		fclose(file);
+
+		hosts.clear();
+		entries.clear();
+		sorted = TRUE;
+
+		if(data.size() < TAG_SIZE || memcmp(&data[0], CATALOG_TAG, TAG_SIZE) != 0)
+		{
+			SetLastError("File is not a Parasite catalog");
+			return FALSE;
+		}
+
+		CatalogReader reader;
+		reader.pos = &data[0] + TAG_SIZE;
+		reader.end = &data[0] + data.size();
+
+		unsigned char version;
+		unsigned int hostCount, entryCount;
+		if(!reader.Get(&version) || !reader.Get(&hostCount) || !reader.Get(&entryCount))
+		{
+			SetLastError("Catalog header is corrupt");
+			return FALSE;
+		}
+
+		if(version != CATALOG_VERSION)
+		{
+			SetLastError("Unsupported catalog version");
+			return FALSE;
+		}
+
+		BOOL result = TRUE;
+		for(unsigned int i = 0; result && i < hostCount; i++)
+		{
+			PARASITE_CATALOG_HOST host;
+			unsigned int words;
+
+			result = reader.GetString(&host.filename) && reader.Get(&host.size) && reader.Get(&host.items)
+					&& reader.Get(&words) && (size_t) (reader.end - reader.pos) / sizeof(unsigned long long) >= words;
+			if(result)
+			{
+				host.bloom.resize(words);
+				if(words > 0)
+					reader.GetBytes(&host.bloom[0], words * sizeof(unsigned long long));
+				hosts.push_back(host);
+			}
+		}
+
+		for(unsigned int i = 0; result && i < entryCount; i++)
+		{
+			PARASITE_CATALOG_ENTRY entry;
+
+			result = reader.Get(&entry.host) && reader.Get(&entry.offset) && reader.Get(&entry.size)
+					&& reader.Get(&entry.lzSize) && reader.Get(&entry.flags) && reader.GetBytes(entry.hash, HASH_SIZE)
+					&& reader.GetString(&entry.name) && entry.host < hostCount;
+
+			/*
+				Lookups rely on the order, so a catalog that is not sorted is corrupt
+			*/
+			if(result && !entries.empty() && CompareEntry(entry, entries.back()))
+				result = FALSE;
+
+			if(result)
+				entries.push_back(entry);
+		}
+
+		if(result == FALSE)
+		{
+			SetLastError("Catalog is truncated or corrupt");
+			hosts.clear();
+			entries.clear();
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+
+	BOOL ParasiteCatalog::Lookup(const char* itemName, std::vector<const PARASITE_CATALOG_ENTRY*>* matches)
+	{
+		matches->clear();
+
+		BOOL candidate = FALSE;
+		for(unsigned int i = 0; i < hosts.size() && !candidate; i++)
+			candidate = BloomTest(hosts[i].bloom, itemName);
+
+		if(!candidate)
+			return FALSE;
+
+		Sort();
+
+		std::vector<PARASITE_CATALOG_ENTRY>::const_iterator i;
+		i = std::lower_bound(entries.begin(), entries.end(), itemName, EntryBeforeName);
+		for(; i != entries.end() && i->name == itemName; i++)
+			matches->push_back(&*i);
+
+		return !matches->empty();
+	}
+
+
+	const PARASITE_CATALOG_ENTRY* ParasiteCatalog::Find(const char* itemName)
+	{
+		std::vector<const PARASITE_CATALOG_ENTRY*> matches;
+		if(!Lookup(itemName, &matches))
+			return NULL;
+
+		return matches[0];
+	}
+
+
+	BOOL ParasiteCatalog::HostMayContain(unsigned int host, const char* itemName)
+	{
+		if(host >= hosts.size())
+			return FALSE;
+
+		return BloomTest(hosts[host].bloom, itemName);
+	}
+
+
+	unsigned int ParasiteCatalog::GetHostCount()
+	{
+		return (unsigned int) hosts.size();
+	}
+
+
+	unsigned int ParasiteCatalog::GetEntryCount()
+	{
+		return (unsigned int) entries.size();
+	}
+
+
+	const PARASITE_CATALOG_HOST* ParasiteCatalog::GetHost(unsigned int host)
+	{
+		if(host >= hosts.size())
+			return NULL;
+
+		return &hosts[host];
+	}
+
+
+	void ParasiteCatalog::ToItem(const PARASITE_CATALOG_ENTRY& entry, PARASITE_ITEM* item)
+	{
+		memset(item, 0, sizeof(PARASITE_ITEM));
+		item->offset = entry.offset;
+		item->size = entry.size;
+		item->lzSize = entry.lzSize;
+		item->flags = entry.flags;
+		memcpy(item->hash, entry.hash, HASH_SIZE);
+		strncpy(item->filename, entry.name.c_str(), MAX_FILE_NAME - 1);
+	}
+
+}
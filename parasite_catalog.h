@@ -0,0 +1,175 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_catalog.h
+ *	A catalog that indexes the items of many Parasite hosts in a single file.
+ */
+
+#ifndef __PARASITE_CATALOG_H__
+#define __PARASITE_CATALOG_H__
+
+#include "parasite.h"
+
+#define CATALOG_TAG "PCatalog"		///< Text value of the tag that starts a catalog file
+#define CATALOG_VERSION 1			///< Version of the catalog file layout
+#define BLOOM_BITS_PER_ITEM 10		///< Bloom filter bits per host item, about 1% false positives
+#define BLOOM_HASHES 7				///< Number of bit positions set for each name
+
+namespace parasite
+{
+
+	/**
+	* An item of one of the catalogued hosts.
+	*/
+	typedef struct _PARASITE_CATALOG_ENTRY
+	{
+		unsigned int	host;				///< Index of the host holding the item, see ParasiteCatalog::GetHostName
+		unsigned int	offset;				///< Host offset of the first byte of the item
+		unsigned int	size;				///< Stored size of the item in bytes
+		unsigned int	lzSize;				///< Decompressed size of the item (if compression used)
+		unsigned char	flags;				///< Feature flags of the item
+		unsigned char	hash[HASH_SIZE];	///< MD5 sum of the original file
+		std::string		name;				///< Item name
+	} PARASITE_CATALOG_ENTRY;
+
+	/**
+	* A host recorded in a catalog.
+	*/
+	typedef struct _PARASITE_CATALOG_HOST
+	{
+		std::string							filename;	///< Path of the host file as given when the catalog was built
+		unsigned int						size;		///< Size of the host file when it was catalogued
+		unsigned int						items;		///< Number of items in the host
+		std::vector<unsigned long long>		bloom;		///< Bloom filter of the host's item names
+	} PARASITE_CATALOG_HOST;
+
+
+	/**
+	* Indexes the items of many host files so an item can be located without
+	* opening every host. The catalog holds one index of all items, sorted by
+	* name, and a Bloom filter of item names per host.
+	*
+	* A catalog file starts with #CATALOG_TAG, a version byte, the host and
+	* entry counts, then every host (name, size, item count, Bloom filter) and
+	* every entry in name order. Like host file tables it is written in native
+	* byte order.
+	*/
+	class parasite_api ParasiteCatalog
+	{
+		private:
+			std::vector<PARASITE_CATALOG_HOST> hosts;		///< Catalogued hosts, indexed by host id
+			std::vector<PARASITE_CATALOG_ENTRY> entries;	///< Items of all hosts, sorted by name once #Sort ran
+			BOOL sorted;									///< TRUE while #entries is in name order
+
+			char LastError[255]; ///< Buffer that holds the last error in ParasiteCatalog
+
+			/**
+			*  Utility function for storing text describing the last internal error
+			*/
+			void SetLastError(const char* error);
+
+			/**
+			* Sorts the entries by name, then by host.
+			*/
+			void Sort();
+
+		public:
+			/**
+			* Constructor
+			*/
+			ParasiteCatalog();
+
+			/**
+			*  Call this to get some text describing the last ParasiteCatalog failure
+			*/
+			char* GetLastError();
+
+			/**
+			* Reads the file table of a host and adds its items to the catalog.
+			* @param hostfile Path to an infected host
+			* @return TRUE if the host was read and added
+			*/
+			BOOL AddHost(char* hostfile);
+
+			/**
+			* Writes the catalog to a file.
+			* @param catalogFile Path of the catalog file to create
+			* @return TRUE if the catalog was written
+			*/
+			BOOL Write(const char* catalogFile);
+
+			/**
+			* Replaces the contents of the catalog with a catalog file.
+			* @param catalogFile Path of the catalog file to read
+			* @return TRUE if the file was read and is valid
+			*/
+			BOOL Load(const char* catalogFile);
+
+			/**
+			* Finds every item with the given name.
+			* The per-host Bloom filters are checked first, so names no host holds
+			* are rejected without searching the index.
+			* @param itemName Name of the item
+			* @param matches Receives the matching entries, ordered by host id. The
+			*                pointers are valid until the catalog is changed.
+			* @return TRUE if at least one host holds the item
+			*/
+			BOOL Lookup(const char* itemName, std::vector<const PARASITE_CATALOG_ENTRY*>* matches);
+
+			/**
+			* Finds the item with the given name in the host with the lowest id.
+			* @param itemName Name of the item
+			* @return The entry, or NULL if no host holds the item
+			*/
+			const PARASITE_CATALOG_ENTRY* Find(const char* itemName);
+
+			/**
+			* Checks the Bloom filter of one host.
+			* @return FALSE if the host certainly does not hold the item, TRUE if it may
+			*/
+			BOOL HostMayContain(unsigned int host, const char* itemName);
+
+			/**
+			* @return Number of hosts in the catalog
+			*/
+			unsigned int GetHostCount();
+
+			/**
+			* @return Number of items of all hosts in the catalog
+			*/
+			unsigned int GetEntryCount();
+
+			/**
+			* @return The host with the given id, or NULL if there is none
+			*/
+			const PARASITE_CATALOG_HOST* GetHost(unsigned int host);
+
+			/**
+			* Fills an item structure from a catalog entry, so the item can be read
+			* with ParasiteHost::ReadRange or ParasiteHost::ReadItemBlock on the
+			* opened host without reading its file table.
+			* @param entry Entry returned by #Lookup or #Find
+			* @param item Receives the item
+			*/
+			static void ToItem(const PARASITE_CATALOG_ENTRY& entry, PARASITE_ITEM* item);
+	};
+
+} // namespace parasite
+
+#endif // __PARASITE_CATALOG_H__
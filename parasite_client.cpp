@@ -32,9 +32,30 @@
 
 #define parasite_static_lib
 #include "parasite.h"
+#include "parasite_catalog.h"
+#include "parasite_trace.h"
 using namespace parasite;
 
+#include <signal.h>
+
+#ifndef LINUX
+#include <io.h>
+#include <fcntl.h>
+#endif
+
 BOOL verbose = FALSE;
+BOOL toStdout = FALSE;
+BOOL mappedTable = FALSE;
+size_t maxMemory = 0;
+BOOL printStats = FALSE;
+const char* statsFile = NULL;
+BOOL showProgress = FALSE;
+ParasiteTrace trace;
+const char* traceFile = NULL;
+int ioEngine = IO_ENGINE_SYNC;
+BOOL directIO = FALSE;
+volatile sig_atomic_t interrupted = 0;
+double progressDrawn = -1;
 unsigned char _flags = 0;
 
 /**
@@ -48,6 +69,9 @@ enum parasite_operation{op_none,
 						op_list, 
 						op_restore, 
 						op_remove, 
+						op_test,
+						op_catalog,
+						op_query,
 						op_multi
 };
 
@@ -62,7 +86,8 @@ BOOL FileExists(char* filename)
 	file = fopen(filename, "r");
 	if(file == NULL)
 		result = FALSE;
-	fclose(file);
+	else
+		fclose(file);
 	
 	return result;
 }
@@ -81,7 +106,7 @@ void PrintVersion()
 void PrintUsage()
 {
 	PrintVersion();
-	printf("Usage: parasite [-cixXalrdvz] [HOST] [ITEM(s)] [PATH]\n");
+	printf("Usage: parasite [--max-memory SIZE] [--stats[=FILE]] [--trace FILE] [--progress] [--io ENGINE] [--direct] [-cixXalrtkqdvzmO] [HOST] [ITEM(s)] [PATH]\n");
 }
 
 /**
@@ -98,22 +123,45 @@ void PrintHelp()
 	printf("  parasite -c host.exe file1          : Injects foo.png into host.exe\n");
 	printf("  parasite -c host.exe file1 file2    : Injects file1 and file2 into host.exe\n");
 	printf("  parasite -l host.exe                : Lists any infected files in host.exe\n");
+	printf("  parasite -l host.exe docs/          : Lists the infected files below docs in host.exe\n");
 	printf("  parasite -x host.exe foo.png        : Extracts foo.png from host.exe\n");
 	printf("  parasite -x host.exe foo.png temp\\  : Extracts foo.png from host.exe into relative path temp\n");
+	printf("  parasite -xO host.exe foo.png       : Writes foo.png from host.exe to stdout\n");
 	printf("  parasite -X host.exe                : Extracts all parasite files from host.exe\n");
 	printf("  parasite -X host.exe temp\\          : Extracts all parasite files from host.exe into relative path temp\n");
 	printf("  parasite -r host.exe restore.exe    : Restores original host.exe to restore.exe\n");
+	printf("  parasite -t host.exe                : Tests the integrity of all parasite files in host.exe\n");
+	printf("  parasite -k all.cat a.exe b.exe     : Builds the catalog all.cat of the items in a.exe and b.exe\n");
+	printf("  parasite -q all.cat foo.png         : Finds the host and offset of foo.png using catalog all.cat\n");
 	printf("\n");
 	printf("Main operation mode:\n");
 	printf("  -c      create a new parasite host\n");
 	printf("  -l      list infected files in host\n");
 	printf("  -x      extract item from host\n");
 	printf("  -X      extract all items from host\n");
-	printf("  -r      restore host file to original binary\n\n");
+	printf("  -r      restore host file to original binary\n");
+	printf("  -t      test all items in memory without extracting them\n");
+	printf("  -k      build a catalog of the items in many hosts\n");
+	printf("  -q      look up items in a catalog\n\n");
 	printf("\n");
 	printf("Optional operation mode:\n");
 	printf("  -v      enable verbose output\n");
 	printf("  -z      use compression\n");
+	printf("  -O      extract item to stdout\n");
+	printf("  -m      write a file table that can be used in place from a memory mapping\n");
+	printf("\n");
+	printf("Long options, anywhere on the command line:\n");
+	printf("  --max-memory SIZE  keep item buffers under SIZE bytes, K, M or G may follow the number.\n");
+	printf("                     Items that do not fit are streamed in blocks.\n");
+	printf("  --stats[=FILE]     write time and bytes of every phase and item as JSON to stderr or FILE\n");
+	printf("  --trace FILE       write a Chrome trace event timeline of the work on every thread to FILE,\n");
+	printf("                     for chrome://tracing or Perfetto\n");
+	printf("  --progress         show items, bytes, speed and time left on stderr while creating,\n");
+	printf("                     extracting all or restoring. Ctrl-C stops at the next block.\n");
+	printf("  --io ENGINE        read and write files with many requests in flight while creating and\n");
+	printf("                     extracting all: sync (the default), threads, uring or auto\n");
+	printf("  --direct           extract and restore around the page cache with O_DIRECT, or by dropping\n");
+	printf("                     the pages behind the copy, to spare the cache of other processes\n");
 }
 
 /**
@@ -156,6 +204,15 @@ parasite_operation ParseOperation(char* operation)
 
 	if(strchr(operation, 'd') != NULL)
 		SetOp(op_remove)
+
+	if(strchr(operation, 't') != NULL)
+		SetOp(op_test)
+
+	if(strchr(operation, 'k') != NULL)
+		SetOp(op_catalog)
+
+	if(strchr(operation, 'q') != NULL)
+		SetOp(op_query)
 	
 	return op;
 } 
@@ -171,10 +228,123 @@ void ParseOptionFlags(char* flags)
 
 	if(strchr(flags, 'z') != NULL)
 		_flags |= FEATURE_COMPRESS;
+
+	if(strchr(flags, 'O') != NULL)
+		toStdout = TRUE;
+
+	if(strchr(flags, 'm') != NULL)
+		mappedTable = TRUE;
+}
+
+/**
+ * Writes the statistics of a host as JSON to stderr, or to the file given
+ * with --stats=FILE, so they never mix with item data on stdout. The trace
+ * asked for with --trace is written too.
+ */
+void PrintStats(ParasiteHost& host)
+{
+	if(traceFile && !trace.Write(traceFile))
+		fprintf(stderr, "Could not write the trace to %s\n", traceFile);
+
+	if(!printStats)
+		return;
+
+	FILE* out = statsFile ? fopen(statsFile, "w") : stderr;
+	if(out == NULL)
+	{
+		fprintf(stderr, "Could not write statistics to %s\n", statsFile);
+		return;
+	}
+
+	host.DumpStats(out);
+	if(out != stderr)
+		fclose(out);
 }
 
 /**
- * Lists all of the infected files in the specified binary in table format
+ * Sets the I/O engine asked for with --io, staying with stdio if it is not
+ * available
+ */
+void UseIOEngine(ParasiteHost& host)
+{
+	if(ioEngine != IO_ENGINE_SYNC && !host.SetIOEngine(ioEngine))
+		fprintf(stderr, "%s, using stdio\n", host.GetLastError());
+	else if(verbose)
+		printf("Using %s for file I/O\n", host.GetIOEngineName());
+}
+
+/**
+ * Turns on direct I/O when asked for with --direct
+ */
+void UseDirectIO(ParasiteHost& host)
+{
+	if(directIO && !host.SetDirectIO(true))
+		fprintf(stderr, "%s, using the page cache\n", host.GetLastError());
+}
+
+/**
+ * Catches the first Ctrl-C so a long operation stops cleanly, a second one
+ * ends the program as usual
+ */
+void OnInterrupt(int signal)
+{
+	interrupted = 1;
+	::signal(SIGINT, SIG_DFL);
+}
+
+/**
+ * Draws the progress line at most ten times a second, and cancels the
+ * operation once Ctrl-C was pressed
+ */
+BOOL OnProgress(void* context, const PARASITE_PROGRESS* progress)
+{
+	if(interrupted)
+		return FALSE;
+
+	BOOL finished = progress->bytesDone >= progress->bytesTotal && progress->itemsDone >= progress->itemsTotal;
+	if(!showProgress || (progress->seconds - progressDrawn < 0.1 && !finished))
+		return TRUE;
+	progressDrawn = progress->seconds;
+
+	fprintf(stderr, "\r");
+	if(progress->itemsTotal > 0)
+		fprintf(stderr, "%u/%u items  ", progress->itemsDone, progress->itemsTotal);
+	fprintf(stderr, "%.1f/%.1f MB  %.1f MB/s", progress->bytesDone / 1048576.0, progress->bytesTotal / 1048576.0,
+			progress->rate / 1048576.0);
+	if(progress->eta >= 0)
+	{
+		unsigned int eta = (unsigned int) (progress->eta + 0.5);
+		fprintf(stderr, "  ETA %u:%02u", eta / 60, eta % 60);
+	}
+	fprintf(stderr, "    ");
+	return TRUE;
+}
+
+/**
+ * Reports the progress of the long operations of a host
+ */
+void StartProgress(ParasiteHost& host)
+{
+	progressDrawn = -1;
+	host.SetProgressCallback(OnProgress, NULL);
+	signal(SIGINT, OnInterrupt);
+}
+
+/**
+ * Ends the progress line and tells whether the operation was cancelled
+ */
+void EndProgress()
+{
+	signal(SIGINT, SIG_DFL);
+	if(progressDrawn >= 0)
+		fprintf(stderr, "\n");
+	if(interrupted)
+		fprintf(stderr, "Cancelled\n");
+}
+
+/**
+ * Lists the infected files in the specified binary in table format,
+ * optionally only those whose path starts with argv[3]
  */
 BOOL List(int argc, char** argv)
 {
@@ -189,6 +359,8 @@ BOOL List(int argc, char** argv)
 	
 	host.OpenReadOnly(argv[2]);
 	host.SetVerboseOutput(verbose);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
 
 	if(host.HasParasite() == FALSE)
 	{
@@ -197,8 +369,14 @@ BOOL List(int argc, char** argv)
 	}
 	
 	host.ReadHeader();
-	host.ReadFileTable();
-	host.DumpItems();
+	if(host.ReadFileTable() == FALSE)
+	{
+		printf("Could not read the file table of %s: %s\n", argv[2], host.GetLastError());
+		host.Close();
+		return FALSE;
+	}
+	host.DumpItems(argc > 3 ? argv[3] : NULL);
+	PrintStats(host);
 	host.Close();
 	return TRUE;
 }
@@ -224,6 +402,12 @@ BOOL Infect(int argc, char** argv)
 		return FALSE;
 	}
 	host.SetVerboseOutput(verbose);
+	host.SetMemoryBudget(maxMemory);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+	UseIOEngine(host);
+	if(mappedTable)
+		host.SetTableFormat(TABLE_FORMAT_MAPPED);
 
 	PARASITE_ITEM item;
 	for(int i = 3; i < argc; i++)
@@ -235,11 +419,15 @@ BOOL Infect(int argc, char** argv)
 			return FALSE;
 		}
 
-	host.Infect();
-	host.WriteFileTable();
+	StartProgress(host);
+	BOOL result = host.Infect();
+	EndProgress();
+	if(result)
+		result = host.WriteFileTable();
 	
+	PrintStats(host);
 	host.Close();
-	return TRUE;
+	return result;
 }
 
 /**
@@ -249,6 +437,10 @@ BOOL InfectMore(int argc, char** argv)
 {
 	ParasiteHost host;
 	host.SetVerboseOutput(verbose);
+	host.SetMemoryBudget(maxMemory);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+	UseIOEngine(host);
 
 	if(argc < 4)
 	{
@@ -271,7 +463,14 @@ BOOL InfectMore(int argc, char** argv)
 	}	
 	
 	if(!host.ReadFileTable())
-		return 1;
+	{
+		printf("Could not read the file table of %s: %s\n", argv[2], host.GetLastError());
+		host.Close();
+		return FALSE;
+	}
+
+	if(mappedTable)
+		host.SetTableFormat(TABLE_FORMAT_MAPPED);
 	
 	if(verbose)
 		printf("Read File Table OK.\n");
@@ -279,18 +478,32 @@ BOOL InfectMore(int argc, char** argv)
 	
 	if(FileExists(argv[3]) == FALSE)
 	{
+		printf("Could not read input file %s\n", argv[3]);
 		host.Close();
 		return FALSE;
 	}   
 
 	PARASITE_ITEM item;
-	if(NewItemFromFile(item, argv[3]))
-		host.InfectMore(item);
+	BOOL result = NewItemFromFile(item, argv[3]);
+	if(result && host.InfectMore(item) == FALSE)
+	{
+		printf("Could not infect %s into %s\n", argv[3], argv[2]);
+		result = FALSE;
+	}
 
-	host.WriteFileTable();
+	/*
+		A failed infection cut the host back to its old table, so it is
+		written again either way
+	*/
+	if(host.WriteFileTable() == FALSE)
+	{
+		printf("Could not write the file table of %s: %s\n", argv[2], host.GetLastError());
+		result = FALSE;
+	}
+	PrintStats(host);
 	host.Close();	
 	
-	return TRUE;
+	return result;
 }
 
 /**
@@ -308,26 +521,99 @@ BOOL Extract(char* hostfile, char* item, char* path = NULL)
 		return FALSE;
 	}
 	host.SetVerboseOutput(verbose);
+	host.SetMemoryBudget(maxMemory);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+	UseDirectIO(host);
 
-	if(host.ReadHeader() == FALSE)
+	if(host.HasParasite() == FALSE || host.ReadHeader() == FALSE)
 	{
-		printf("This file does not have a Parasite header, or its header is corrupt.");
+		printf("This file does not have a Parasite header, or its header is corrupt.\n");
+		host.Close();
 		return FALSE;
 	}
 	
-	host.ReadFileTable();
+	/*
+		One item is looked up, so leave the rest of the table undecoded
+	*/
+	host.SetLazyTable(true);
+	if(host.ReadFileTable() == FALSE)
+	{
+		printf("Could not read the file table of %s: %s\n", hostfile, host.GetLastError());
+		host.Close();
+		return FALSE;
+	}
 	
 	if(host.ExtractItem(item, path) == FALSE)
 	{
-		printf("Could not find %s in parasite file.\n", item);
+		printf("Could not extract %s from parasite file.\n", item);
 		host.Close();
 		return FALSE;
 	}
 
+	PrintStats(host);
 	host.Close();
 	return TRUE;
 }
 
+/**
+ * Sink that streams extracted data to stdout
+ */
+BOOL StdoutSink(void* context, const unsigned char* data, unsigned int size)
+{
+	return fwrite(data, 1, size, stdout) == size;
+}
+
+/**
+ * Parasite xO [hosted file]
+ * Streams the item to stdout. Messages go to stderr so they never mix with the data.
+ */
+BOOL ExtractToStdout(char* hostfile, char* item)
+{
+	ParasiteHost host;
+
+	if(host.OpenReadOnly(hostfile) == FALSE)
+	{
+		fprintf(stderr, "Could not load Host File %s\n", hostfile);
+		return FALSE;
+	}
+	host.SetVerboseOutput(FALSE);
+	host.SetMemoryBudget(maxMemory);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+
+	if(host.HasParasite() == FALSE)
+	{
+		fprintf(stderr, "This file does not have a Parasite header, or its header is corrupt.\n");
+		host.Close();
+		return FALSE;
+	}
+
+	host.ReadHeader();
+	host.SetLazyTable(true);
+	if(host.ReadFileTable() == FALSE)
+	{
+		fprintf(stderr, "Could not read the file table of %s: %s\n", hostfile, host.GetLastError());
+		host.Close();
+		return FALSE;
+	}
+
+#ifndef LINUX
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	BOOL result = host.ExtractItemToSink(item, StdoutSink, NULL);
+	if(fflush(stdout) != 0)
+		result = FALSE;
+
+	if(result == FALSE)
+		fprintf(stderr, "Could not extract %s from parasite file: %s\n", item, host.GetLastError());
+
+	PrintStats(host);
+	host.Close();
+	return result;
+}
+
 /**
  * Extract all of the infected files, optionally write them to a specified path.
  */
@@ -341,17 +627,166 @@ BOOL ExtractAll(char* hostfile, char* path = NULL)
 		return FALSE;
 	}
 	host.SetVerboseOutput(verbose);
+	host.SetMemoryBudget(maxMemory);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+	UseIOEngine(host);
+	UseDirectIO(host);
 
-	if(host.ReadHeader() == FALSE)
+	if(host.HasParasite() == FALSE || host.ReadHeader() == FALSE)
 	{
-		printf("This file does not have a Parasite header, or its header is corrupt.");
+		printf("This file does not have a Parasite header, or its header is corrupt.\n");
+		host.Close();
 		return FALSE;
 	}
 	
-	host.ReadFileTable();
+	if(host.ReadFileTable() == FALSE)
+	{
+		printf("Could not read the file table of %s: %s\n", hostfile, host.GetLastError());
+		host.Close();
+		return FALSE;
+	}
 
+	StartProgress(host);
 	BOOL result = host.ExtractAll(path);
+	EndProgress();
+	PrintStats(host);
+	host.Close();
+	return result;
+}
+
+/**
+ * Decodes every infected file in memory and checks it against its stored hash.
+ */
+BOOL Test(int argc, char** argv)
+{
+	ParasiteHost host;
+
+	if(argc < 3)
+	{
+		printf("Forget the file name?\n");
+		printf("Aborting\n");
+		return FALSE;
+	}
+
+	if(host.OpenReadOnly(argv[2]) == FALSE)
+	{
+		printf("Could not load Host File %s\n", argv[2]);
+		return FALSE;
+	}
+	host.SetVerboseOutput(verbose);
+	host.SetMemoryBudget(maxMemory);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+
+	if(host.HasParasite() == FALSE)
+	{
+		printf("Specified file %s does not have a Parasite header, or its header is corrupt.\n", argv[2]);
+		host.Close();
+		return FALSE;
+	}
+
+	host.ReadHeader();
+	if(host.ReadFileTable() == FALSE)
+	{
+		printf("Could not read the file table of %s: %s\n", argv[2], host.GetLastError());
+		host.Close();
+		return FALSE;
+	}
+
+	std::vector<PARASITE_TEST_RESULT> results;
+	BOOL result = host.TestItems(&results);
+	PrintStats(host);
 	host.Close();
+
+	unsigned int failed = 0;
+	for(unsigned int i = 0; i < results.size(); i++)
+	{
+		printf("  %-8s %s\n", results[i].passed ? "OK" : "FAILED", results[i].filename);
+		if(!results[i].passed)
+			failed++;
+	}
+	printf("%u items tested, %u failed\n", (unsigned int) results.size(), failed);
+
+	return result;
+}
+
+/**
+ * Builds a catalog file indexing the items of every host given.
+ */
+BOOL BuildCatalog(int argc, char** argv)
+{
+	ParasiteCatalog catalog;
+
+	if(argc < 4)
+	{
+		printf("Missing Parametres?\n");
+		PrintUsage();
+		return FALSE;
+	}
+
+	for(int i = 3; i < argc; i++)
+	{
+		if(catalog.AddHost(argv[i]) == FALSE)
+		{
+			printf("Could not catalog host %s: %s\n", argv[i], catalog.GetLastError());
+			return FALSE;
+		}
+
+		if(verbose)
+			printf("Catalogued %s\n", argv[i]);
+	}
+
+	if(catalog.Write(argv[2]) == FALSE)
+	{
+		printf("Could not write catalog %s: %s\n", argv[2], catalog.GetLastError());
+		return FALSE;
+	}
+
+	printf("%u items from %u hosts written to %s\n", catalog.GetEntryCount(), catalog.GetHostCount(), argv[2]);
+	return TRUE;
+}
+
+/**
+ * Prints the host and location of items using a catalog instead of opening the hosts.
+ */
+BOOL QueryCatalog(int argc, char** argv)
+{
+	ParasiteCatalog catalog;
+
+	if(argc < 4)
+	{
+		printf("Missing Parametres?\n");
+		PrintUsage();
+		return FALSE;
+	}
+
+	if(catalog.Load(argv[2]) == FALSE)
+	{
+		printf("Could not load catalog %s: %s\n", argv[2], catalog.GetLastError());
+		return FALSE;
+	}
+
+	BOOL result = TRUE;
+	std::vector<const PARASITE_CATALOG_ENTRY*> matches;
+	for(int i = 3; i < argc; i++)
+	{
+		if(catalog.Lookup(argv[i], &matches) == FALSE)
+		{
+			printf("%s: not found\n", argv[i]);
+			result = FALSE;
+			continue;
+		}
+
+		for(unsigned int m = 0; m < matches.size(); m++)
+		{
+			const PARASITE_CATALOG_ENTRY* entry = matches[m];
+			unsigned int size = (entry->flags & FEATURE_COMPRESS) ? entry->lzSize : entry->size;
+			printf("%s: %s offset %u size %u\n", argv[i], catalog.GetHost(entry->host)->filename.c_str(),
+				   entry->offset, size);
+		}
+	}
+
 	return result;
 }
 
@@ -377,15 +812,140 @@ BOOL Restore(int argc, char** argv)
 		return FALSE;
 	}
 	host.SetVerboseOutput(verbose);
+	host.SetCollectStats(printStats);
+	host.SetTrace(traceFile ? &trace : NULL);
+	UseDirectIO(host);
 	
-	host.ReadHeader();
-	if(host.RestoreFile(argv[3]))
+	if(host.HasParasite() == FALSE || host.ReadHeader() == FALSE)
+	{
+		printf("Specified file %s does not have a Parasite header, or its header is corrupt.\n", argv[2]);
+		host.Close();
+		return FALSE;
+	}
+
+	StartProgress(host);
+	BOOL result = host.RestoreFile(argv[3]);
+	EndProgress();
+	if(result)
 		printf("Restore to %s Finished\n", argv[3]);
+	PrintStats(host);
 	host.Close();
 
+	return result;
+}
+
+
+/**
+ * Parses a byte count with an optional K, M or G suffix
+ */
+BOOL ParseSize(const char* text, size_t* size)
+{
+	char* end;
+	unsigned long long value = strtoull(text, &end, 10);
+	if(end == text)
+		return FALSE;
+
+	switch(*end)
+	{
+		case 'G': case 'g': value <<= 10;
+		case 'M': case 'm': value <<= 10;
+		case 'K': case 'k': value <<= 10; end++;
+		default: break;
+	}
+
+	if(*end != 0)
+		return FALSE;
+
+	*size = (size_t) value;
 	return TRUE;
 }
 
+/**
+ * Pulls the long options out of the command line, so the operation and its
+ * parameters keep their positions
+ */
+BOOL ParseLongOptions(int& argc, char** argv)
+{
+	int kept = 1;
+	for(int i = 1; i < argc; i++)
+	{
+		const char* value = NULL;
+		if(strcmp(argv[i], "--stats") == 0 || strncmp(argv[i], "--stats=", 8) == 0)
+		{
+			printStats = true;
+			if(argv[i][7] == '=')
+				statsFile = argv[i] + 8;
+			continue;
+		}
+		else if(strncmp(argv[i], "--trace=", 8) == 0 || strcmp(argv[i], "--trace") == 0)
+		{
+			if(argv[i][7] == '=')
+				traceFile = argv[i] + 8;
+			else if(i + 1 < argc)
+				traceFile = argv[++i];
+			if(traceFile == NULL || *traceFile == 0)
+			{
+				printf("--trace needs a file name\n");
+				return FALSE;
+			}
+			continue;
+		}
+		else if(strcmp(argv[i], "--progress") == 0)
+		{
+			showProgress = true;
+			continue;
+		}
+		else if(strcmp(argv[i], "--direct") == 0)
+		{
+			directIO = true;
+			continue;
+		}
+		else if(strncmp(argv[i], "--io=", 5) == 0 || strcmp(argv[i], "--io") == 0)
+		{
+			const char* name = argv[i][4] == '=' ? argv[i] + 5 : (i + 1 < argc ? argv[++i] : "");
+			if(strcmp(name, "sync") == 0)
+				ioEngine = IO_ENGINE_SYNC;
+			else if(strcmp(name, "threads") == 0)
+				ioEngine = IO_ENGINE_THREADS;
+			else if(strcmp(name, "uring") == 0)
+				ioEngine = IO_ENGINE_URING;
+			else if(strcmp(name, "auto") == 0)
+				ioEngine = IO_ENGINE_AUTO;
+			else
+			{
+				printf("Unknown I/O engine %s, use sync, threads, uring or auto\n", name);
+				return FALSE;
+			}
+			continue;
+		}
+		else if(strncmp(argv[i], "--max-memory=", 13) == 0)
+			value = argv[i] + 13;
+		else if(strcmp(argv[i], "--max-memory") == 0)
+		{
+			if(i + 1 >= argc)
+			{
+				printf("--max-memory needs a size\n");
+				return FALSE;
+			}
+			value = argv[++i];
+		}
+		else
+		{
+			argv[kept++] = argv[i];
+			continue;
+		}
+
+		if(ParseSize(value, &maxMemory) == FALSE)
+		{
+			printf("Invalid memory size %s\n", value);
+			return FALSE;
+		}
+	}
+
+	argc = kept;
+	argv[argc] = NULL;
+	return TRUE;
+}
 
 /**
  * Application entry
@@ -395,6 +955,9 @@ int main(int argc, char** argv)
 	// Parse command line
 	//    0          1           2         3       4           N
 	// parasite <operation> <hostfile> [<file1> <file2> ... <fileN>] 
+	if(ParseLongOptions(argc, argv) == FALSE)
+		return 1;
+
 	if(argc < 2)
 	{
 		PrintUsage();
@@ -429,6 +992,16 @@ int main(int argc, char** argv)
 			return (!Infect(argc, argv));
 
 		case op_extract:
+			if(toStdout)
+			{
+				if(argc != 4)
+				{
+					PrintUsage();
+					return 1;
+				}
+				return (!ExtractToStdout(argv[2], argv[3]));
+			}
+
 			switch(argc)
 			{
 				case 4:
@@ -467,17 +1040,26 @@ int main(int argc, char** argv)
 		case op_add:
 			return (!InfectMore(argc, argv));
 
+		case op_test:
+			return (!Test(argc, argv));
+
+		case op_catalog:
+			return (!BuildCatalog(argc, argv));
+
+		case op_query:
+			return (!QueryCatalog(argc, argv));
+
 		case op_remove:
 			printf("Not Implemented yet, sorry!");
 			return -1;
 
 		case op_multi:
-			printf("You must specify only one of the '-xcalrd' operations\n");
+			printf("You must specify only one of the '-xcalrtkqd' operations\n");
 			printf("Try 'parasite --help' or 'parasite --usage' for more information.\n");
 			return -1;
 		   
 		case op_none:
-			printf("You must specify one of the '-xcalrd' operations\n");
+			printf("You must specify one of the '-xcalrtkqd' operations\n");
 			printf("Try 'parasite --help' or 'parasite --usage' for more information.\n");
 			return -1;			
 	}
@@ -0,0 +1,292 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_fs.cpp
+ *	Implementation of the virtual file layer found in #parasite_fs.h
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#define parasite_export
+#define parasite_static_lib
+#include "parasite_fs.h"
+
+namespace parasite
+{
+	ParasiteFS::ParasiteFS(ParasiteHost& parent, unsigned int cacheSize)
+		: host(parent)
+	{
+		memset(&stats, 0, sizeof(stats));
+		stats.cacheSize = cacheSize;
+	}
+
+
+	ParasiteFS::FS_HANDLE* ParasiteFS::GetHandle(int handle)
+	{
+		if(handle < 0 || handle >= (int) handles.size() || !handles[handle].used)
+			return NULL;
+
+		return &handles[handle];
+	}
+
+
+	int ParasiteFS::Open(const char* itemName)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		const PARASITE_ITEM* item = host.FindItem(itemName);
+		if(item == NULL)
+			return -1;
+
+		FS_HANDLE handle;
+		unsigned int blockCount;
+		handle.used = TRUE;
+		handle.item = *item;
+		handle.size = GetOriginalSize(*item);
+		handle.position = 0;
+		if(!host.GetItemBlocks(&handle.item, &handle.blockSize, &blockCount))
+			return -1;
+
+		/*
+			Reuse the first closed slot, like file descriptors
+		*/
+		for(unsigned int i = 0; i < handles.size(); i++)
+		{
+			if(!handles[i].used)
+			{
+				handles[i] = handle;
+				return i;
+			}
+		}
+
+		handles.push_back(handle);
+		return (int) handles.size() - 1;
+	}
+
+
+	int ParasiteFS::Close(int handle)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		FS_HANDLE* entry = GetHandle(handle);
+		if(entry == NULL)
+			return -1;
+
+		entry->used = FALSE;
+		return 0;
+	}
+
+
+	void ParasiteFS::Evict(unsigned int size)
+	{
+		while(!lruList.empty() && stats.cachedBytes + size > stats.cacheSize)
+		{
+			std::map<BlockKey, FS_BLOCK>::iterator oldest = cache.find(lruList.back());
+			stats.cachedBytes -= oldest->second.data.size();
+			stats.cachedBlocks--;
+			stats.evictions++;
+
+			cache.erase(oldest);
+			lruList.pop_back();
+		}
+	}
+
+
+	const std::vector<unsigned char>* ParasiteFS::GetBlock(FS_HANDLE* handle, unsigned int block)
+	{
+		BlockKey key(handle->item.offset, block);
+
+		std::map<BlockKey, FS_BLOCK>::iterator found = cache.find(key);
+		if(found != cache.end())
+		{
+			stats.hits++;
+			lruList.splice(lruList.begin(), lruList, found->second.lru);
+			return &found->second.data;
+		}
+
+		stats.misses++;
+
+		unsigned int rawSize = handle->size - block * handle->blockSize;
+		if(rawSize > handle->blockSize)
+			rawSize = handle->blockSize;
+
+		/*
+			Blocks that can never fit are decoded into scratch and not cached
+		*/
+		if(rawSize > stats.cacheSize)
+		{
+			scratch.resize(rawSize);
+			if(!host.ReadItemBlock(&handle->item, block, &scratch[0], &rawSize))
+				return NULL;
+			return &scratch;
+		}
+
+		Evict(rawSize);
+
+		FS_BLOCK& entry = cache[key];
+		entry.data.resize(rawSize);
+		if(rawSize > 0 && !host.ReadItemBlock(&handle->item, block, &entry.data[0], &rawSize))
+		{
+			cache.erase(key);
+			return NULL;
+		}
+
+		lruList.push_front(key);
+		entry.lru = lruList.begin();
+		stats.cachedBytes += rawSize;
+		stats.cachedBlocks++;
+
+		return &entry.data;
+	}
+
+
+	long ParasiteFS::ReadAt(FS_HANDLE* handle, void* buffer, unsigned int count, unsigned int offset)
+	{
+		if(offset >= handle->size)
+			return 0;
+
+		if(count > handle->size - offset)
+			count = handle->size - offset;
+
+		unsigned char* out = (unsigned char*) buffer;
+		unsigned int done = 0;
+		while(done < count)
+		{
+			unsigned int position = offset + done;
+			unsigned int block = position / handle->blockSize;
+			unsigned int skip = position - block * handle->blockSize;
+
+			const std::vector<unsigned char>* data = GetBlock(handle, block);
+			if(data == NULL || data->size() <= skip)
+				return done > 0 ? (long) done : -1;
+
+			unsigned int copy = (unsigned int) data->size() - skip;
+			if(copy > count - done)
+				copy = count - done;
+
+			memcpy(out + done, &(*data)[skip], copy);
+			done += copy;
+		}
+
+		return (long) done;
+	}
+
+
+	long ParasiteFS::PRead(int handle, void* buffer, unsigned int count, unsigned int offset)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		FS_HANDLE* entry = GetHandle(handle);
+		if(entry == NULL)
+			return -1;
+
+		return ReadAt(entry, buffer, count, offset);
+	}
+
+
+	long ParasiteFS::Read(int handle, void* buffer, unsigned int count)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		FS_HANDLE* entry = GetHandle(handle);
+		if(entry == NULL)
+			return -1;
+
+		long got = ReadAt(entry, buffer, count, entry->position);
+		if(got > 0)
+			entry->position += got;
+
+		return got;
+	}
+
+
+	long ParasiteFS::Seek(int handle, long offset, int whence)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		FS_HANDLE* entry = GetHandle(handle);
+		if(entry == NULL)
+			return -1;
+
+		long long target;
+		if(whence == SEEK_SET)
+			target = offset;
+		else if(whence == SEEK_CUR)
+			target = (long long) entry->position + offset;
+		else if(whence == SEEK_END)
+			target = (long long) entry->size + offset;
+		else
+			return -1;
+
+		/*
+			Like lseek, seeking past the end is allowed and reads return 0 there
+		*/
+		if(target < 0 || target > 0xffffffffLL)
+			return -1;
+
+		entry->position = (unsigned int) target;
+		return (long) target;
+	}
+
+
+	unsigned int ParasiteFS::Size(int handle)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		FS_HANDLE* entry = GetHandle(handle);
+		return entry ? entry->size : 0;
+	}
+
+
+	void ParasiteFS::SetCacheSize(unsigned int cacheSize)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		stats.cacheSize = cacheSize;
+		Evict(0);
+	}
+
+
+	void ParasiteFS::DropCache()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		cache.clear();
+		lruList.clear();
+		stats.cachedBlocks = 0;
+		stats.cachedBytes = 0;
+	}
+
+
+	void ParasiteFS::GetStats(PARASITE_FS_STATS* out)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		*out = stats;
+	}
+
+
+	void ParasiteFS::ResetStats()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		stats.hits = 0;
+		stats.misses = 0;
+		stats.evictions = 0;
+	}
+
+}
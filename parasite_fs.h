@@ -0,0 +1,197 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_fs.h
+ *	A small in-process virtual file layer for reading items out of a Parasite host.
+ */
+
+#ifndef __PARASITE_FS_H__
+#define __PARASITE_FS_H__
+
+#include <list>
+#include <mutex>
+
+#include "parasite.h"
+
+#define FS_CACHE_SIZE (32 << 20)	///< Default size limit of the decoded block cache in bytes
+
+namespace parasite
+{
+
+	/**
+	* Counters describing the use of the ParasiteFS block cache.
+	*/
+	typedef struct _PARASITE_FS_STATS
+	{
+		unsigned long long	hits;			///< Block reads served from the cache
+		unsigned long long	misses;			///< Block reads that had to go to the host
+		unsigned long long	evictions;		///< Blocks dropped to stay under the size limit
+		unsigned int		cachedBlocks;	///< Number of blocks in the cache
+		unsigned int		cachedBytes;	///< Decoded bytes held by the cache
+		unsigned int		cacheSize;		///< Size limit of the cache in bytes
+	} PARASITE_FS_STATS;
+
+
+	/**
+	* POSIX-like read access to the items of an open ParasiteHost.
+	* Items are opened by name and read through integer handles with #PRead, or
+	* #Read and #Seek for sequential access. Decoded blocks are kept in an LRU
+	* cache shared by all handles and bounded in bytes, so repeated reads of hot
+	* items are served from memory without touching the host file.
+	*
+	* All calls are serialized with an internal lock, so handles may be used from
+	* several threads. The host must stay open and must not be used directly while
+	* the ParasiteFS is in use.
+	*/
+	class parasite_api ParasiteFS
+	{
+		private:
+			/**
+			* State of one open handle
+			*/
+			typedef struct _FS_HANDLE
+			{
+				BOOL			used;		///< TRUE while the handle is open
+				PARASITE_ITEM	item;		///< Copy of the opened item
+				unsigned int	size;		///< Size of the original item data
+				unsigned int	blockSize;	///< Decoded size of every block but the last
+				unsigned int	position;	///< Position used by #Read and #Seek
+			} FS_HANDLE;
+
+			/**
+			* Cache key: the item offset identifies the item within the host
+			*/
+			typedef std::pair<unsigned int, unsigned int> BlockKey;
+
+			/**
+			* A decoded block held in the cache
+			*/
+			typedef struct _FS_BLOCK
+			{
+				std::vector<unsigned char>		data;	///< Decoded block data
+				std::list<BlockKey>::iterator	lru;	///< Position of the block in #lruList
+			} FS_BLOCK;
+
+			ParasiteHost& host;					///< Host the items are read from
+			std::mutex lock;					///< Serializes host access and cache updates
+			std::vector<FS_HANDLE> handles;		///< Open handles, indexed by handle number
+
+			std::map<BlockKey, FS_BLOCK> cache;	///< Decoded blocks by item and block number
+			std::list<BlockKey> lruList;		///< Cached blocks, most recently used first
+			std::vector<unsigned char> scratch;	///< Holds blocks too large to be cached
+			PARASITE_FS_STATS stats;			///< Cache counters
+
+			/**
+			* Returns a handle entry, or NULL if the handle is not open.
+			*/
+			FS_HANDLE* GetHandle(int handle);
+
+			/**
+			* Returns the decoded data of a block, from the cache if possible.
+			* @param handle Open handle the block belongs to
+			* @param block Block number within the item
+			* @return The block data, valid until the next call, or NULL on failure
+			*/
+			const std::vector<unsigned char>* GetBlock(FS_HANDLE* handle, unsigned int block);
+
+			/**
+			* Drops least recently used blocks until size more bytes fit in the cache.
+			*/
+			void Evict(unsigned int size);
+
+			/**
+			* Reads from a handle with the lock already held, see #PRead.
+			*/
+			long ReadAt(FS_HANDLE* handle, void* buffer, unsigned int count, unsigned int offset);
+
+		public:
+			/**
+			* Constructor
+			* @param parent Open host with its file table read
+			* @param cacheSize Size limit of the decoded block cache in bytes
+			*/
+			ParasiteFS(ParasiteHost& parent, unsigned int cacheSize = FS_CACHE_SIZE);
+
+			/**
+			* Opens an item for reading.
+			* @param itemName Name of the item
+			* @return A handle, or -1 if the item does not exist or is corrupt
+			*/
+			int Open(const char* itemName);
+
+			/**
+			* Closes a handle.
+			* @return 0 on success, -1 if the handle is not open
+			*/
+			int Close(int handle);
+
+			/**
+			* Reads from a given offset of an item, without moving the handle position.
+			* @param handle Open handle
+			* @param buffer Receives the data
+			* @param count Number of bytes to read
+			* @param offset Item offset to read from
+			* @return Number of bytes read, 0 at the end of the item, or -1 on error
+			*/
+			long PRead(int handle, void* buffer, unsigned int count, unsigned int offset);
+
+			/**
+			* Reads from the handle position and moves it past the data read.
+			* @return Number of bytes read, 0 at the end of the item, or -1 on error
+			*/
+			long Read(int handle, void* buffer, unsigned int count);
+
+			/**
+			* Moves the handle position.
+			* @param handle Open handle
+			* @param offset Offset relative to whence
+			* @param whence SEEK_SET, SEEK_CUR or SEEK_END
+			* @return The new position, or -1 on error
+			*/
+			long Seek(int handle, long offset, int whence);
+
+			/**
+			* @return Size of the item's original data, or 0 if the handle is not open
+			*/
+			unsigned int Size(int handle);
+
+			/**
+			* Changes the size limit of the cache, evicting blocks if needed.
+			*/
+			void SetCacheSize(unsigned int cacheSize);
+
+			/**
+			* Drops every cached block.
+			*/
+			void DropCache();
+
+			/**
+			* Copies the cache counters.
+			*/
+			void GetStats(PARASITE_FS_STATS* out);
+
+			/**
+			* Resets the hit, miss and eviction counters.
+			*/
+			void ResetStats();
+	};
+
+} // namespace parasite
+
+#endif // __PARASITE_FS_H__
@@ -0,0 +1,590 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_io.cpp
+ *	Implementation of the I/O engines and direct files found in #parasite_io.h
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#define parasite_export
+#define parasite_static_lib
+#include "parasite_io.h"
+
+#ifdef LINUX
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+#endif
+
+namespace parasite
+{
+#ifdef LINUX
+
+	/*
+		Runs requests with pread and pwrite on a pool of threads. Works
+		everywhere, but costs a thread switch per request.
+	*/
+	class ThreadIO : public ParasiteIO
+	{
+		private:
+			std::mutex lock;
+			std::condition_variable queued;
+			std::condition_variable completed;
+			std::deque<PARASITE_IO_REQUEST*> waiting;	// Submitted, not picked up by a thread
+			std::deque<PARASITE_IO_REQUEST*> done;		// Completed, not returned by Wait
+			std::vector<std::thread> threads;
+			unsigned int pending;
+			BOOL stopping;
+
+			void Run()
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				for(;;)
+				{
+					while(waiting.empty() && !stopping)
+						queued.wait(guard);
+					if(waiting.empty())
+						return;
+
+					PARASITE_IO_REQUEST* request = waiting.front();
+					waiting.pop_front();
+					guard.unlock();
+
+					ssize_t result = request->write
+						? pwrite(request->fd, request->buffer, request->size, request->offset)
+						: pread(request->fd, request->buffer, request->size, request->offset);
+					request->result = result < 0 ? -errno : result;
+
+					guard.lock();
+					done.push_back(request);
+					completed.notify_one();
+				}
+			}
+
+		public:
+			ThreadIO(unsigned int count) : pending(0), stopping(FALSE)
+			{
+				for(unsigned int i = 0; i < count; i++)
+					threads.push_back(std::thread(&ThreadIO::Run, this));
+			}
+
+			~ThreadIO()
+			{
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					stopping = TRUE;
+				}
+				queued.notify_all();
+				for(unsigned int i = 0; i < threads.size(); i++)
+					threads[i].join();
+			}
+
+			BOOL Submit(PARASITE_IO_REQUEST* request)
+			{
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					waiting.push_back(request);
+					pending++;
+				}
+				queued.notify_one();
+				return TRUE;
+			}
+
+			void Flush()
+			{
+			}
+
+			PARASITE_IO_REQUEST* Wait()
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				if(pending == 0)
+					return NULL;
+
+				while(done.empty())
+					completed.wait(guard);
+
+				PARASITE_IO_REQUEST* request = done.front();
+				done.pop_front();
+				pending--;
+				return request;
+			}
+
+			unsigned int GetPending()
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				return pending;
+			}
+
+			const char* GetName()
+			{
+				return "threads";
+			}
+	};
+
+
+#ifdef __NR_io_uring_setup
+
+	/*
+		Runs requests on an io_uring set up with the raw system calls. Queued
+		requests go to the kernel in one call, and completions are taken from
+		the shared ring without one.
+	*/
+	class UringIO : public ParasiteIO
+	{
+		private:
+			int ring;
+			unsigned char* sqMap;
+			unsigned char* cqMap;
+			size_t sqMapSize;
+			size_t cqMapSize;
+			struct io_uring_sqe* sqes;
+			size_t sqesSize;
+
+			unsigned int* sqHead;
+			unsigned int* sqTail;
+			unsigned int sqMask;
+			unsigned int* sqArray;
+			unsigned int sqEntries;
+			unsigned int* cqHead;
+			unsigned int* cqTail;
+			unsigned int cqMask;
+			struct io_uring_cqe* cqes;
+
+			unsigned int queued;		// Requests in the submission ring not yet given to the kernel
+			unsigned int pending;		// Requests submitted and not returned by Wait
+
+			int Enter(unsigned int submit, unsigned int wait)
+			{
+				return syscall(__NR_io_uring_enter, ring, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+			}
+
+		public:
+			UringIO() : ring(-1), sqMap(NULL), cqMap(NULL), sqes(NULL), queued(0), pending(0)
+			{
+			}
+
+			~UringIO()
+			{
+				/*
+					Requests the kernel has keep using their buffers until they
+					complete, so they are waited for before the ring goes. If
+					that fails too, closing the ring cancels them.
+				*/
+				while(ring >= 0 && sqes && pending > queued)
+				{
+					unsigned int head = *cqHead;
+					if(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+					{
+						__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+						pending--;
+					}
+					else if(Enter(0, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+						break;
+				}
+
+				if(sqes)
+					munmap(sqes, sqesSize);
+				if(cqMap && cqMap != sqMap)
+					munmap(cqMap, cqMapSize);
+				if(sqMap)
+					munmap(sqMap, sqMapSize);
+				if(ring >= 0)
+					close(ring);
+			}
+
+			BOOL Open(unsigned int depth)
+			{
+				struct io_uring_params params;
+				memset(&params, 0, sizeof(params));
+				ring = syscall(__NR_io_uring_setup, depth, &params);
+				if(ring < 0)
+					return FALSE;
+
+				/*
+					Plain read and write requests came with this feature, older
+					kernels only have the vectored ones
+				*/
+				if(!(params.features & IORING_FEAT_RW_CUR_POS))
+					return FALSE;
+
+				sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+				cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+				if(params.features & IORING_FEAT_SINGLE_MMAP)
+					sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+
+				void* map = mmap(NULL, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+				if(map == MAP_FAILED)
+					return FALSE;
+				sqMap = (unsigned char*) map;
+
+				if(params.features & IORING_FEAT_SINGLE_MMAP)
+					cqMap = sqMap;
+				else
+				{
+					map = mmap(NULL, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+					if(map == MAP_FAILED)
+						return FALSE;
+					cqMap = (unsigned char*) map;
+				}
+
+				sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+				map = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+				if(map == MAP_FAILED)
+					return FALSE;
+				sqes = (struct io_uring_sqe*) map;
+
+				sqHead = (unsigned int*) (sqMap + params.sq_off.head);
+				sqTail = (unsigned int*) (sqMap + params.sq_off.tail);
+				sqMask = *(unsigned int*) (sqMap + params.sq_off.ring_mask);
+				sqArray = (unsigned int*) (sqMap + params.sq_off.array);
+				sqEntries = params.sq_entries;
+				cqHead = (unsigned int*) (cqMap + params.cq_off.head);
+				cqTail = (unsigned int*) (cqMap + params.cq_off.tail);
+				cqMask = *(unsigned int*) (cqMap + params.cq_off.ring_mask);
+				cqes = (struct io_uring_cqe*) (cqMap + params.cq_off.cqes);
+				return TRUE;
+			}
+
+			BOOL Submit(PARASITE_IO_REQUEST* request)
+			{
+				/*
+					The completion ring holds twice the submission entries, so
+					keeping no more than that in flight never overflows it
+				*/
+				if(pending >= sqEntries)
+					return FALSE;
+
+				unsigned int tail = *sqTail;
+				if(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+					Flush();
+
+				unsigned int index = tail & sqMask;
+				struct io_uring_sqe* sqe = &sqes[index];
+				memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+				sqe->fd = request->fd;
+				sqe->off = request->offset;
+				sqe->addr = (unsigned long long) request->buffer;
+				sqe->len = request->size;
+				sqe->user_data = (unsigned long long) request;
+				sqArray[index] = index;
+
+				__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+				queued++;
+				pending++;
+				return TRUE;
+			}
+
+			void Flush()
+			{
+				while(queued > 0)
+				{
+					int submitted = Enter(queued, 0);
+					if(submitted < 0 && errno == EINTR)
+						continue;
+					if(submitted <= 0)
+						break;
+					queued -= submitted;
+				}
+			}
+
+			PARASITE_IO_REQUEST* Wait()
+			{
+				if(pending == 0)
+					return NULL;
+
+				for(;;)
+				{
+					unsigned int head = *cqHead;
+					if(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+					{
+						struct io_uring_cqe* cqe = &cqes[head & cqMask];
+						PARASITE_IO_REQUEST* request = (PARASITE_IO_REQUEST*) cqe->user_data;
+						request->result = cqe->res;
+						__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+						pending--;
+						return request;
+					}
+
+					int entered = Enter(queued, 1);
+					if(entered >= 0)
+						queued -= entered;
+					else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+						return NULL;
+				}
+			}
+
+			unsigned int GetPending()
+			{
+				return pending;
+			}
+
+			const char* GetName()
+			{
+				return "io_uring";
+			}
+	};
+
+#endif
+#endif
+
+
+	ParasiteIO* ParasiteIO::Create(int engine, unsigned int depth)
+	{
+#ifdef LINUX
+		if(depth == 0)
+			depth = IO_QUEUE_DEPTH;
+
+#ifdef __NR_io_uring_setup
+		if(engine == IO_ENGINE_URING || engine == IO_ENGINE_AUTO)
+		{
+			/*
+				io_uring may be missing or blocked by a sandbox, which only
+				shows when a ring is set up
+			*/
+			UringIO* uring = new UringIO();
+			if(uring->Open(depth))
+				return uring;
+			delete uring;
+		}
+#endif
+
+		if(engine == IO_ENGINE_THREADS || engine == IO_ENGINE_AUTO)
+			return new ThreadIO(std::min(depth, (unsigned int) IO_QUEUE_DEPTH));
+#endif
+
+		return NULL;
+	}
+
+
+	ParasiteDirectFile::ParasiteDirectFile(ParasiteAllocator* allocator)
+		: fd(-1), writing(FALSE), direct(FALSE), allocator(allocator), memory(NULL), buffer(NULL), used(0), position(0),
+		  offset(0), dropped(0)
+	{
+	}
+
+
+	ParasiteDirectFile::~ParasiteDirectFile()
+	{
+		Close();
+	}
+
+
+	BOOL ParasiteDirectFile::Open(const char* path, BOOL write)
+	{
+#ifdef LINUX
+		Close();
+
+		/*
+			File systems without O_DIRECT, tmpfs for one, refuse it with EINVAL
+		*/
+		int flags = write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+		fd = open(path, flags | O_DIRECT, 0644);
+		direct = (fd >= 0);
+		if(fd < 0 && errno == EINVAL)
+			fd = open(path, flags, 0644);
+		if(fd < 0)
+			return FALSE;
+
+		size_t size = IO_DIRECT_BUFFER + IO_DIRECT_ALIGN;
+		memory = (unsigned char*) (allocator ? allocator->Alloc(size) : malloc(size));
+		if(memory == NULL)
+		{
+			close(fd);
+			fd = -1;
+			return FALSE;
+		}
+
+		buffer = (unsigned char*) (((size_t) memory + IO_DIRECT_ALIGN - 1) & ~(size_t) (IO_DIRECT_ALIGN - 1));
+		writing = write;
+		used = 0;
+		position = 0;
+		offset = 0;
+		dropped = 0;
+		if(!direct)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		return TRUE;
+#else
+		return FALSE;
+#endif
+	}
+
+
+#ifdef LINUX
+	BOOL ParasiteDirectFile::Flush(BOOL last)
+	{
+		/*
+			Direct writes are whole aligned blocks. The last one is padded
+			with zeros, and the file cut back to its size afterwards.
+		*/
+		size_t size = used;
+		if(direct && last)
+		{
+			size = (used + IO_DIRECT_ALIGN - 1) & ~(size_t) (IO_DIRECT_ALIGN - 1);
+			memset(buffer + used, 0, size - used);
+		}
+
+		for(size_t done = 0; done < size; )
+		{
+			ssize_t written = pwrite(fd, buffer + done, size - done, offset + done);
+			if(written < 0 && errno == EINTR)
+				continue;
+			if(written <= 0)
+				return FALSE;
+			done += written;
+		}
+
+		if(size != used && ftruncate(fd, offset + used) != 0)
+			return FALSE;
+
+		offset += used;
+		used = 0;
+		Drop(offset, last);
+		return TRUE;
+	}
+
+
+	void ParasiteDirectFile::Drop(unsigned long long end, BOOL wait)
+	{
+		if(direct)
+			return;
+
+		/*
+			Dirty pages are only dropped once written back. The newest chunk
+			is started, and the ones before it are waited for and dropped, so
+			the disk keeps writing while the next chunk is filled.
+		*/
+		if(writing)
+		{
+			unsigned long long start = end > IO_DIRECT_BUFFER ? end - IO_DIRECT_BUFFER : 0;
+			sync_file_range(fd, start, end - start, SYNC_FILE_RANGE_WRITE);
+			if(!wait)
+				end = start;
+			if(end <= dropped)
+				return;
+			sync_file_range(fd, dropped, end - dropped,
+							SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		}
+
+		if(end > dropped)
+			posix_fadvise(fd, dropped, end - dropped, POSIX_FADV_DONTNEED);
+		dropped = end;
+	}
+#endif
+
+
+	size_t ParasiteDirectFile::Read(unsigned char* data, size_t size)
+	{
+#ifdef LINUX
+		size_t done = 0;
+		while(done < size && fd >= 0 && !writing)
+		{
+			if(position == used)
+			{
+				/*
+					The chunk is used up, drop it and read the next one. A
+					direct read at the end of the file returns less than asked.
+				*/
+				offset += used;
+				Drop(offset, true);
+				used = 0;
+				position = 0;
+
+				ssize_t got = pread(fd, buffer, IO_DIRECT_BUFFER, offset);
+				if(got < 0 && errno == EINTR)
+					continue;
+				if(got <= 0)
+					break;
+				used = got;
+			}
+
+			size_t copy = std::min(size - done, used - position);
+			memcpy(data + done, buffer + position, copy);
+			position += copy;
+			done += copy;
+		}
+
+		return done;
+#else
+		return 0;
+#endif
+	}
+
+
+	BOOL ParasiteDirectFile::Write(const unsigned char* data, size_t size)
+	{
+#ifdef LINUX
+		if(fd < 0 || !writing)
+			return FALSE;
+
+		while(size > 0)
+		{
+			size_t copy = std::min(size, (size_t) IO_DIRECT_BUFFER - used);
+			memcpy(buffer + used, data, copy);
+			used += copy;
+			data += copy;
+			size -= copy;
+
+			if(used == IO_DIRECT_BUFFER && !Flush(false))
+				return FALSE;
+		}
+
+		return TRUE;
+#else
+		return FALSE;
+#endif
+	}
+
+
+	BOOL ParasiteDirectFile::Close()
+	{
+		BOOL result = TRUE;
+#ifdef LINUX
+		if(fd >= 0)
+		{
+			if(writing)
+				result = Flush(true);
+			else
+				Drop(offset + used, true);
+
+			if(close(fd) != 0)
+				result = FALSE;
+			fd = -1;
+		}
+
+		if(allocator)
+			allocator->Free(memory);
+		else
+			free(memory);
+		memory = NULL;
+		buffer = NULL;
+#endif
+		return result;
+	}
+}
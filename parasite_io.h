@@ -0,0 +1,179 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_io.h
+ *	Asynchronous positioned reads and writes with many requests in flight, and
+ *	bulk file access around the page cache.
+ */
+
+#ifndef __PARASITE_IO_H__
+#define __PARASITE_IO_H__
+
+#include "parasite.h"
+
+namespace parasite
+{
+
+	/**
+	* A read or write handed to a ParasiteIO engine. It must stay in place
+	* from #ParasiteIO::Submit until #ParasiteIO::Wait returns it.
+	*/
+	typedef struct _PARASITE_IO_REQUEST
+	{
+		int					fd;			///< File descriptor to read or write
+		BOOL				write;		///< TRUE to write buffer, FALSE to read into it
+		unsigned char*		buffer;		///< Data to write or room for the data read
+		size_t				size;		///< Bytes to transfer
+		unsigned long long	offset;		///< File offset of the first byte
+		void*				tag;		///< Caller data, untouched by the engine
+		long long			result;		///< Bytes transferred, or a negative errno once completed
+	} PARASITE_IO_REQUEST;
+
+	/**
+	* An engine that runs positioned reads and writes asynchronously, so the
+	* caller keeps working while requests are in flight and the device sees
+	* many of them at once. Requests may complete in any order and may
+	* transfer less than asked, like pread and pwrite.
+	*/
+	class parasite_api ParasiteIO
+	{
+		public:
+			/**
+			* Waits for the requests still in flight, or cancels them
+			*/
+			virtual ~ParasiteIO() {}
+
+			/**
+			* Queues a request. Queued requests start at the latest on the next
+			* #Flush or #Wait.
+			* @return FALSE if the engine could not take the request
+			*/
+			virtual BOOL Submit(PARASITE_IO_REQUEST* request) = 0;
+
+			/**
+			* Starts every queued request.
+			*/
+			virtual void Flush() = 0;
+
+			/**
+			* Waits for a request to complete.
+			* @return The completed request with its result, or NULL if none is in flight
+			*         or the engine failed. Requests of a failed engine are only done
+			*         with their buffers once it is deleted.
+			*/
+			virtual PARASITE_IO_REQUEST* Wait() = 0;
+
+			/**
+			* @return Number of requests submitted and not yet returned by #Wait
+			*/
+			virtual unsigned int GetPending() = 0;
+
+			/**
+			* @return Name of the engine, "io_uring" or "threads"
+			*/
+			virtual const char* GetName() = 0;
+
+			/**
+			* Creates an engine.
+			* @param engine #IO_ENGINE_URING, #IO_ENGINE_THREADS or #IO_ENGINE_AUTO to
+			*               try io_uring first and fall back to threads
+			* @param depth Most requests the caller keeps in flight
+			* @return The engine, or NULL if it is not available on this system
+			*/
+			static ParasiteIO* Create(int engine, unsigned int depth);
+	};
+
+	/**
+	* A file read or written front to back in large chunks without filling the
+	* page cache, so bulk copies leave the cache of other processes alone. It is
+	* opened with O_DIRECT where the file system allows and then goes through an
+	* aligned buffer of #IO_DIRECT_BUFFER bytes. Elsewhere it uses plain reads and
+	* writes and drops the pages behind it with posix_fadvise(DONTNEED).
+	*/
+	class parasite_api ParasiteDirectFile
+	{
+		private:
+			int fd;							///< Descriptor, -1 when closed
+			BOOL writing;					///< Opened for writing
+			BOOL direct;					///< Opened with O_DIRECT
+			ParasiteAllocator* allocator;	///< Allocator of the buffer, NULL for malloc
+			unsigned char* memory;			///< Allocation holding the buffer
+			unsigned char* buffer;			///< #IO_DIRECT_ALIGN aligned chunk of the file
+			size_t used;					///< Bytes in the buffer
+			size_t position;				///< Bytes of the buffer already read
+			unsigned long long offset;		///< File offset of the buffer
+			unsigned long long dropped;		///< Bytes from the start already dropped from the cache
+
+			/**
+			* Writes the buffer at #offset, padded to the alignment when it is the last one.
+			*/
+			BOOL Flush(BOOL last);
+
+			/**
+			* Drops the cached pages of the file below an offset when not direct.
+			* @param wait Wait for pages being written back, otherwise the last chunk is left to finish
+			*/
+			void Drop(unsigned long long end, BOOL wait);
+
+		public:
+			/**
+			* @param allocator Allocator that counts the buffer, or NULL
+			*/
+			ParasiteDirectFile(ParasiteAllocator* allocator = NULL);
+
+			/**
+			* Closes the file if still open.
+			*/
+			~ParasiteDirectFile();
+
+			/**
+			* Opens a file, with O_DIRECT if the file system takes it.
+			* @param path File to open
+			* @param write TRUE to create or truncate it for writing, FALSE to read it
+			* @return FALSE if the file could not be opened or this system has no support
+			*/
+			BOOL Open(const char* path, BOOL write);
+
+			/**
+			* Reads the next bytes of the file.
+			* @return Bytes read, less than size at the end of the file or on an error
+			*/
+			size_t Read(unsigned char* data, size_t size);
+
+			/**
+			* Appends bytes to the file.
+			* @return FALSE on a write error
+			*/
+			BOOL Write(const unsigned char* data, size_t size);
+
+			/**
+			* Writes what is left in the buffer and closes the file.
+			* @return FALSE if the data could not all be written
+			*/
+			BOOL Close();
+
+			/**
+			* @return TRUE if the file is opened with O_DIRECT, FALSE if pages are dropped instead
+			*/
+			BOOL IsDirect() const { return direct; }
+	};
+
+}
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_map.cpp
+ *	Implementation of the mapped table reader found in #parasite_map.h
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#define parasite_export
+#define parasite_static_lib
+#include "parasite_map.h"
+
+#ifdef LINUX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+namespace parasite
+{
+	ParasiteTableMap::ParasiteTableMap()
+		: view(NULL), viewSize(0), header(NULL), table(NULL)
+	{
+#ifndef LINUX
+		fileHandle = INVALID_HANDLE_VALUE;
+		mappingHandle = NULL;
+#endif
+		LastError[0] = 0;
+	}
+
+
+	ParasiteTableMap::~ParasiteTableMap()
+	{
+		Close();
+	}
+
+
+	void ParasiteTableMap::SetLastError(const char* error)
+	{
+		strcpy(LastError, error);
+	}
+
+
+	char* ParasiteTableMap::GetLastError()
+	{
+		return (char*)&LastError;
+	}
+
+
+	BOOL ParasiteTableMap::Open(const char* hostfile)
+	{
+		Close();
+
+#ifdef LINUX
+		int file = open(hostfile, O_RDONLY);
+		if(file < 0)
+		{
+			SetLastError("Could not open host file");
+			return FALSE;
+		}
+
+		struct stat info;
+		if(fstat(file, &info) != 0 || info.st_size <= 0 || (unsigned long long) info.st_size > 0xffffffffULL)
+		{
+			close(file);
+			SetLastError("Host file is empty or too large");
+			return FALSE;
+		}
+
+		viewSize = (unsigned int) info.st_size;
+		void* mapping = mmap(NULL, viewSize, PROT_READ, MAP_SHARED, file, 0);
+		close(file);
+		if(mapping == MAP_FAILED)
+		{
+			viewSize = 0;
+			SetLastError("Could not map host file");
+			return FALSE;
+		}
+		view = (const unsigned char*) mapping;
+#else
+		fileHandle = CreateFileA(hostfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(fileHandle == INVALID_HANDLE_VALUE)
+		{
+			SetLastError("Could not open host file");
+			return FALSE;
+		}
+
+		LARGE_INTEGER size;
+		if(!GetFileSizeEx(fileHandle, &size) || size.QuadPart <= 0 || size.QuadPart > 0xffffffffLL)
+		{
+			Close();
+			SetLastError("Host file is empty or too large");
+			return FALSE;
+		}
+
+		viewSize = (unsigned int) size.QuadPart;
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(mappingHandle != NULL)
+			view = (const unsigned char*) MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+		if(view == NULL)
+		{
+			Close();
+			SetLastError("Could not map host file");
+			return FALSE;
+		}
+#endif
+
+		/*
+			Footer, format byte and table header are all that is checked here
+		*/
+		unsigned int footer = sizeof(unsigned int) + TAG_SIZE;
+		unsigned int headerOffset;
+		if(viewSize < footer || memcmp(view + viewSize - TAG_SIZE, TAG_DATA, TAG_SIZE) != 0)
+		{
+			Close();
+			SetLastError("Host file does not have a Parasite header");
+			return FALSE;
+		}
+		memcpy(&headerOffset, view + viewSize - footer, sizeof(headerOffset));
+
+		unsigned int start = (headerOffset + 2 + 7) & ~7u;
+		if(headerOffset >= viewSize - footer || view[headerOffset] != TABLE_FORMAT_MAPPED
+		   || start > viewSize - footer || viewSize - footer - start < sizeof(PARASITE_MAP_HEADER))
+		{
+			Close();
+			SetLastError("Host file does not have a mapped file table");
+			return FALSE;
+		}
+
+		table = view + start;
+		header = (const PARASITE_MAP_HEADER*) table;
+		if(!CheckMapHeader(*header, viewSize - footer - start))
+		{
+			Close();
+			SetLastError("File table is corrupt");
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+
+	void ParasiteTableMap::Close()
+	{
+#ifdef LINUX
+		if(view != NULL)
+			munmap((void*) view, viewSize);
+#else
+		if(view != NULL)
+			UnmapViewOfFile(view);
+		if(mappingHandle != NULL)
+			CloseHandle(mappingHandle);
+		if(fileHandle != INVALID_HANDLE_VALUE)
+			CloseHandle(fileHandle);
+		mappingHandle = NULL;
+		fileHandle = INVALID_HANDLE_VALUE;
+#endif
+		view = NULL;
+		viewSize = 0;
+		header = NULL;
+		table = NULL;
+	}
+
+
+	unsigned int ParasiteTableMap::GetItemCount()
+	{
+		return header ? header->items : 0;
+	}
+
+
+	unsigned int ParasiteTableMap::GetBaseOffset()
+	{
+		return header ? header->baseOffset : 0;
+	}
+
+
+	const PARASITE_MAP_RECORD* ParasiteTableMap::GetRecord(unsigned int index)
+	{
+		if(header == NULL || index >= header->items)
+			return NULL;
+
+		return (const PARASITE_MAP_RECORD*) (table + header->recordOffset) + index;
+	}
+
+
+	const char* ParasiteTableMap::GetName(const PARASITE_MAP_RECORD* record)
+	{
+		if(header == NULL || record->nameOffset >= header->poolSize
+		   || header->poolSize - record->nameOffset <= record->nameLength)
+			return NULL;
+
+		const char* name = (const char*) table + header->poolOffset + record->nameOffset;
+		if(name[record->nameLength] != 0)
+			return NULL;
+
+		return name;
+	}
+
+
+	const PARASITE_MAP_RECORD* ParasiteTableMap::Find(const char* itemName)
+	{
+		if(header == NULL)
+			return NULL;
+
+		const PARASITE_MAP_INDEX* index = (const PARASITE_MAP_INDEX*) (table + header->indexOffset);
+		unsigned int hash = HashItemName(itemName);
+
+		/*
+			Find the first index entry with the hash, then compare the paths of
+			every entry sharing it
+		*/
+		unsigned int low = 0;
+		unsigned int high = header->items;
+		while(low < high)
+		{
+			unsigned int middle = low + (high - low) / 2;
+			if(index[middle].hash < hash)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+
+		for(; low < header->items && index[low].hash == hash; low++)
+		{
+			const PARASITE_MAP_RECORD* record = GetRecord(index[low].item);
+			const char* name = record ? GetName(record) : NULL;
+			if(name != NULL && strcmp(name, itemName) == 0)
+				return record;
+		}
+
+		return NULL;
+	}
+
+
+	const unsigned char* ParasiteTableMap::GetStoredData(const PARASITE_MAP_RECORD* record)
+	{
+		if(view == NULL || record->offset > viewSize || viewSize - record->offset < record->size)
+			return NULL;
+
+		return view + record->offset;
+	}
+
+
+	BOOL ParasiteTableMap::ToItem(const PARASITE_MAP_RECORD* record, PARASITE_ITEM* item)
+	{
+		const char* name = GetName(record);
+		if(name == NULL || record->nameLength >= MAX_FILE_NAME)
+			return FALSE;
+
+		memset(item, 0, sizeof(PARASITE_ITEM));
+		item->offset = record->offset;
+		item->size = record->size;
+		item->lzSize = record->lzSize;
+		item->flags = record->flags;
+		memcpy(item->hash, record->hash, HASH_SIZE);
+		memcpy(item->filename, name, record->nameLength + 1);
+		return TRUE;
+	}
+
+}
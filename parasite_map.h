@@ -0,0 +1,132 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_map.h
+ *	Read-only access to #TABLE_FORMAT_MAPPED file tables straight from a memory mapping.
+ */
+
+#ifndef __PARASITE_MAP_H__
+#define __PARASITE_MAP_H__
+
+#include "parasite.h"
+
+namespace parasite
+{
+
+	/**
+	* Maps a host file read-only and looks items up in its #TABLE_FORMAT_MAPPED
+	* file table in place. Opening only checks the footer and the table header,
+	* no entry is parsed or copied, and the table costs nothing but page cache.
+	* Lookups binary search the name hash index.
+	*
+	* Records are checked when they are used, so a corrupt entry makes only the
+	* calls that touch it fail.
+	*/
+	class parasite_api ParasiteTableMap
+	{
+		private:
+			const unsigned char* view;			///< Start of the mapped host file, NULL when closed
+			unsigned int viewSize;				///< Size of the mapping
+			const PARASITE_MAP_HEADER* header;	///< Table header inside the mapping
+			const unsigned char* table;			///< Start of the table, all section offsets are relative to it
+#ifndef LINUX
+			void* fileHandle;					///< Windows handle of the host file
+			void* mappingHandle;				///< Windows handle of the file mapping
+#endif
+
+			char LastError[255]; ///< Buffer that holds the last error in ParasiteTableMap
+
+			/**
+			*  Utility function for storing text describing the last internal error
+			*/
+			void SetLastError(const char* error);
+
+		public:
+			/**
+			* Constructor
+			*/
+			ParasiteTableMap();
+
+			/**
+			* Destructor, unmaps the host if it is still open
+			*/
+			~ParasiteTableMap();
+
+			/**
+			*  Call this to get some text describing the last ParasiteTableMap failure
+			*/
+			char* GetLastError();
+
+			/**
+			* Maps a host file and checks its table header.
+			* @param hostfile Path to a host written with #TABLE_FORMAT_MAPPED
+			* @return TRUE if the host was mapped and has a usable mapped table
+			*/
+			BOOL Open(const char* hostfile);
+
+			/**
+			* Unmaps the host. Pointers returned earlier become invalid.
+			*/
+			void Close();
+
+			/**
+			* @return Number of items in the table
+			*/
+			unsigned int GetItemCount();
+
+			/**
+			* @return Base offset of the parasite files appended data
+			*/
+			unsigned int GetBaseOffset();
+
+			/**
+			* @return The record of an item in table order, or NULL if index is out of range
+			*/
+			const PARASITE_MAP_RECORD* GetRecord(unsigned int index);
+
+			/**
+			* @return The NUL terminated path of a record, or NULL if it lies outside of the name pool
+			*/
+			const char* GetName(const PARASITE_MAP_RECORD* record);
+
+			/**
+			* Looks up an item by path in the name hash index.
+			* @param itemName Path of the item
+			* @return The record, or NULL if no item has that path
+			*/
+			const PARASITE_MAP_RECORD* Find(const char* itemName);
+
+			/**
+			* Returns the stored data of an item inside the mapping, so uncompressed
+			* items can be used without copying them.
+			* @return Pointer to record->size bytes, or NULL if they lie outside of the host
+			*/
+			const unsigned char* GetStoredData(const PARASITE_MAP_RECORD* record);
+
+			/**
+			* Fills an item structure from a record, so the item can be read with
+			* ParasiteHost::ReadRange or ParasiteHost::ReadItemBlock.
+			* @return TRUE if the record is valid
+			*/
+			BOOL ToItem(const PARASITE_MAP_RECORD* record, PARASITE_ITEM* item);
+	};
+
+} // namespace parasite
+
+#endif // __PARASITE_MAP_H__
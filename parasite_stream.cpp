@@ -0,0 +1,226 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_stream.cpp
+ *	Implementation of the item stream adapters found in #parasite_stream.h
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#define parasite_export
+#define parasite_static_lib
+#include "parasite_stream.h"
+
+namespace parasite
+{
+	ParasiteItemStreambuf::ParasiteItemStreambuf(ParasiteHost& parent, const char* itemName)
+		: host(parent), open(FALSE), size(0), blockSize(0), bufferStart(0)
+	{
+		buffer.resize(1);
+		setg(&buffer[0], &buffer[0], &buffer[0]);
+
+		const PARASITE_ITEM* found = host.FindItem(itemName);
+		if(found == NULL)
+			return;
+
+		/*
+			Keep a copy, the table entry may move if items are added to the host
+		*/
+		item = *found;
+
+		unsigned int blockCount;
+		if(!host.GetItemBlocks(&item, &blockSize, &blockCount))
+			return;
+
+		size = GetOriginalSize(item);
+		if(blockSize > 0)
+			buffer.resize(blockSize);
+		setg(&buffer[0], &buffer[0], &buffer[0]);
+
+		open = TRUE;
+	}
+
+
+	BOOL ParasiteItemStreambuf::IsOpen()
+	{
+		return open;
+	}
+
+
+	unsigned int ParasiteItemStreambuf::GetSize()
+	{
+		return size;
+	}
+
+
+	unsigned int ParasiteItemStreambuf::Position()
+	{
+		return bufferStart + (unsigned int) (gptr() - eback());
+	}
+
+
+	void ParasiteItemStreambuf::Reposition(unsigned int position)
+	{
+		bufferStart = position;
+		setg(&buffer[0], &buffer[0], &buffer[0]);
+	}
+
+
+	ParasiteItemStreambuf::int_type ParasiteItemStreambuf::underflow()
+	{
+		if(gptr() < egptr())
+			return traits_type::to_int_type(*gptr());
+
+		unsigned int position = Position();
+		if(!open || position >= size)
+			return traits_type::eof();
+
+		/*
+			Decode the block holding the read position into the buffer
+		*/
+		unsigned int block = position / blockSize;
+		unsigned int got;
+		if(!host.ReadItemBlock(&item, block, (unsigned char*) &buffer[0], &got))
+			return traits_type::eof();
+
+		bufferStart = block * blockSize;
+		setg(&buffer[0], &buffer[0] + (position - bufferStart), &buffer[0] + got);
+
+		return traits_type::to_int_type(*gptr());
+	}
+
+
+	std::streamsize ParasiteItemStreambuf::xsgetn(char* s, std::streamsize n)
+	{
+		std::streamsize done = 0;
+
+		while(done < n)
+		{
+			/*
+				Use up what is left of the decoded block first
+			*/
+			std::streamsize available = egptr() - gptr();
+			if(available > 0)
+			{
+				std::streamsize copy = (available < n - done) ? available : n - done;
+				memcpy(s + done, gptr(), (size_t) copy);
+				gbump((int) copy);
+				done += copy;
+				continue;
+			}
+
+			unsigned int position = Position();
+			if(!open || position >= size)
+				break;
+
+			unsigned int left = size - position;
+			if((std::streamsize) left > n - done)
+				left = (unsigned int) (n - done);
+
+			/*
+				Bulk reads skip the internal buffer: uncompressed data is read
+				straight from the host, and whole compressed blocks are decoded
+				directly into the caller's memory.
+			*/
+			if(left >= blockSize)
+			{
+				unsigned int got = 0;
+				if(!(item.flags & FEATURE_COMPRESS))
+				{
+					if(!host.ReadRange(&item, position, left, (unsigned char*) s + done, &got))
+						break;
+				}
+				else if(position % blockSize == 0)
+				{
+					if(!host.ReadItemBlock(&item, position / blockSize, (unsigned char*) s + done, &got))
+						break;
+				}
+
+				if(got > 0)
+				{
+					done += got;
+					Reposition(position + got);
+					continue;
+				}
+			}
+
+			if(traits_type::eq_int_type(underflow(), traits_type::eof()))
+				break;
+		}
+
+		return done;
+	}
+
+
+	std::streamsize ParasiteItemStreambuf::showmanyc()
+	{
+		unsigned int position = Position();
+		if(!open || position >= size)
+			return -1;
+
+		return size - position;
+	}
+
+
+	ParasiteItemStreambuf::pos_type ParasiteItemStreambuf::seekoff(off_type off, std::ios_base::seekdir dir,
+																	 std::ios_base::openmode which)
+	{
+		if(!open || !(which & std::ios_base::in))
+			return pos_type(off_type(-1));
+
+		off_type target;
+		if(dir == std::ios_base::beg)
+			target = off;
+		else if(dir == std::ios_base::cur)
+			target = (off_type) Position() + off;
+		else if(dir == std::ios_base::end)
+			target = (off_type) size + off;
+		else
+			return pos_type(off_type(-1));
+
+		if(target < 0 || target > (off_type) size)
+			return pos_type(off_type(-1));
+
+		/*
+			Stay in the decoded block if the target is inside it
+		*/
+		off_type bufferEnd = (off_type) bufferStart + (egptr() - eback());
+		if(target >= (off_type) bufferStart && target <= bufferEnd)
+			setg(eback(), eback() + (target - bufferStart), egptr());
+		else
+			Reposition((unsigned int) target);
+
+		return pos_type(target);
+	}
+
+
+	ParasiteItemStreambuf::pos_type ParasiteItemStreambuf::seekpos(pos_type pos, std::ios_base::openmode which)
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+
+
+	ParasiteItemStream::ParasiteItemStream(ParasiteHost& host, const char* itemName)
+		: std::istream(NULL), itemBuf(host, itemName)
+	{
+		init(&itemBuf);
+		if(!itemBuf.IsOpen())
+			setstate(std::ios_base::failbit);
+	}
+
+}
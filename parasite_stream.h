@@ -0,0 +1,116 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_stream.h
+ *	Standard stream adapters for reading items out of a Parasite host in place.
+ */
+
+#ifndef __PARASITE_STREAM_H__
+#define __PARASITE_STREAM_H__
+
+#include <istream>
+#include <streambuf>
+
+#include "parasite.h"
+
+namespace parasite
+{
+
+	/**
+	* A read-only, seekable std::streambuf over the original data of one item.
+	* Compressed items are decoded lazily, one block at a time, into a fixed internal
+	* buffer of one block. Reads that cover whole blocks, and every bulk read of an
+	* uncompressed item, go straight from the host into the caller's memory without
+	* passing through the internal buffer.
+	*
+	* The host must stay open while the stream buffer is used. Unlike
+	* ParasiteHost::ExtractItem the stream does not verify the item hash, since it
+	* may never see all of the data.
+	*/
+	class parasite_api ParasiteItemStreambuf : public std::streambuf
+	{
+		private:
+			ParasiteHost& host;			///< Host the item is read from
+			PARASITE_ITEM item;			///< Copy of the item being read
+			BOOL open;					///< TRUE if the item was found and its block index is valid
+			unsigned int size;			///< Size of the original item data
+			unsigned int blockSize;		///< Decoded size of every block but the last
+			unsigned int bufferStart;	///< Item offset of the first byte in the get area
+
+			std::vector<char> buffer;	///< Holds the current decoded block
+
+			/**
+			* Item offset of the next character the get area would return.
+			*/
+			unsigned int Position();
+
+			/**
+			* Empties the get area and makes the next read start at the given offset.
+			*/
+			void Reposition(unsigned int position);
+
+		protected:
+			virtual int_type underflow();
+			virtual std::streamsize xsgetn(char* s, std::streamsize n);
+			virtual std::streamsize showmanyc();
+			virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+									 std::ios_base::openmode which = std::ios_base::in);
+			virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in);
+
+		public:
+			/**
+			* Constructor
+			* @param host Open host with its file table read
+			* @param itemName Name of the item to read
+			*/
+			ParasiteItemStreambuf(ParasiteHost& host, const char* itemName);
+
+			/**
+			* @return TRUE if the item was found and can be read
+			*/
+			BOOL IsOpen();
+
+			/**
+			* @return Size of the item's original data in bytes
+			*/
+			unsigned int GetSize();
+	};
+
+
+	/**
+	* A std::istream reading one item through a ParasiteItemStreambuf.
+	* The stream starts in the fail state if the item can not be opened.
+	*/
+	class parasite_api ParasiteItemStream : public std::istream
+	{
+		private:
+			ParasiteItemStreambuf itemBuf;	///< Stream buffer doing the actual reads
+
+		public:
+			/**
+			* Constructor
+			* @param host Open host with its file table read
+			* @param itemName Name of the item to read
+			*/
+			ParasiteItemStream(ParasiteHost& host, const char* itemName);
+	};
+
+} // namespace parasite
+
+#endif // __PARASITE_STREAM_H__
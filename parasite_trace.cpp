@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_trace.cpp
+ *	Implementation of the trace recorder found in #parasite_trace.h
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#define parasite_export
+#define parasite_static_lib
+#include "parasite_trace.h"
+
+#include <chrono>
+
+namespace parasite
+{
+	ParasiteTrace::ParasiteTrace()
+	{
+		origin = Now();
+	}
+
+
+	double ParasiteTrace::Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+
+	unsigned int ParasiteTrace::GetThread()
+	{
+		std::thread::id id = std::this_thread::get_id();
+		std::map<std::thread::id, unsigned int>::iterator found = threads.find(id);
+		if(found != threads.end())
+			return found->second;
+
+		unsigned int track = threadNames.size();
+		char name[32];
+		sprintf(name, track == 0 ? "main" : "thread %u", track);
+		threadNames.push_back(name);
+		threads[id] = track;
+		return track;
+	}
+
+
+	void ParasiteTrace::Add(const char* name, const char* item, double start, double end, unsigned long long bytes)
+	{
+		PARASITE_TRACE_EVENT event;
+		event.name = name;
+		if(item)
+			event.item = item;
+		event.start = start;
+		event.end = end;
+		event.bytes = bytes;
+
+		std::lock_guard<std::mutex> guard(lock);
+		event.thread = GetThread();
+		events.push_back(event);
+	}
+
+
+	void ParasiteTrace::NameThread(const char* name)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		threadNames[GetThread()] = name;
+	}
+
+
+	void ParasiteTrace::Clear()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		events.clear();
+		origin = Now();
+	}
+
+
+	size_t ParasiteTrace::GetCount()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return events.size();
+	}
+
+
+	BOOL ParasiteTrace::Write(FILE* out)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		/*
+			Every thread is a track of one process, named by a metadata event.
+			Spans are complete events timed in microseconds from the origin.
+		*/
+		fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+		fprintf(out, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"parasite\"}}");
+		for(unsigned int i = 0; i < threadNames.size(); i++)
+		{
+			fprintf(out, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ", i + 1);
+			WriteJsonString(out, threadNames[i].c_str());
+			fprintf(out, "}}");
+		}
+
+		for(unsigned int i = 0; i < events.size(); i++)
+		{
+			const PARASITE_TRACE_EVENT& event = events[i];
+			fprintf(out, ",\n  {\"name\": ");
+			WriteJsonString(out, event.name);
+			fprintf(out, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f", event.thread + 1,
+					(event.start - origin) * 1e6, (event.end - event.start) * 1e6);
+			if(!event.item.empty() || event.bytes)
+			{
+				fprintf(out, ", \"args\": {");
+				if(!event.item.empty())
+				{
+					fprintf(out, "\"item\": ");
+					WriteJsonString(out, event.item.c_str());
+				}
+				if(event.bytes)
+					fprintf(out, "%s\"bytes\": %llu", event.item.empty() ? "" : ", ", event.bytes);
+				fprintf(out, "}");
+			}
+			fprintf(out, "}");
+		}
+
+		fprintf(out, "\n]}\n");
+		return ferror(out) == 0;
+	}
+
+
+	BOOL ParasiteTrace::Write(const char* path)
+	{
+		FILE* out = fopen(path, "w");
+		if(out == NULL)
+			return FALSE;
+
+		BOOL result = Write(out);
+		if(fclose(out) != 0)
+			result = FALSE;
+		return result;
+	}
+}
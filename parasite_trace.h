@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2007  Nick Plante <SowWn@CodeDump.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see http://www.gnu.org/licenses
+ *  or write to the Free Software Foundation,Inc., 51 Franklin Street,
+ *  Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/**
+ *	@file parasite_trace.h
+ *	Timeline of the work done by ParasiteHost operations, written as Chrome trace events.
+ */
+
+#ifndef __PARASITE_TRACE_H__
+#define __PARASITE_TRACE_H__
+
+#include "parasite.h"
+
+#include <mutex>
+#include <thread>
+
+namespace parasite
+{
+
+	/**
+	* A span of work recorded by a ParasiteTrace.
+	*/
+	typedef struct _PARASITE_TRACE_EVENT
+	{
+		const char*			name;		///< What was done, a string that outlives the trace
+		std::string			item;		///< Item the work was for, empty if none
+		double				start;		///< Clock when the span started
+		double				end;		///< Clock when the span ended
+		unsigned long long	bytes;		///< Bytes handled, 0 if not counted
+		unsigned int		thread;		///< Track of the thread that did the work
+	} PARASITE_TRACE_EVENT;
+
+	/**
+	* Records spans of work from any number of threads and writes them as
+	* Chrome trace event JSON, which chrome://tracing and Perfetto show as a
+	* timeline with a track per thread. Pass one to ParasiteHost::SetTrace;
+	* hosts without a trace only test a NULL pointer per span.
+	*/
+	class parasite_api ParasiteTrace
+	{
+		private:
+			std::mutex lock;								///< Guards everything below
+			std::vector<PARASITE_TRACE_EVENT> events;		///< Spans in the order they ended
+			std::map<std::thread::id, unsigned int> threads;	///< Track of every thread seen
+			std::vector<std::string> threadNames;			///< Name of every track
+			double origin;									///< Clock the timestamps are relative to
+
+			/**
+			*	@return Track of the calling thread, adding one if needed. Call with the lock held.
+			*/
+			unsigned int GetThread();
+
+		public:
+			/**
+			* Constructor, starts the timeline at the current time
+			*/
+			ParasiteTrace();
+
+			/**
+			* @return Seconds on the monotonic clock spans are timed with
+			*/
+			static double Now();
+
+			/**
+			* Records a span of the calling thread.
+			* @param name What was done, must outlive the trace
+			* @param item Item the work was for, or NULL
+			* @param start Clock when the span started, see #Now
+			* @param end Clock when the span ended
+			* @param bytes Bytes handled, or 0
+			*/
+			void Add(const char* name, const char* item, double start, double end, unsigned long long bytes = 0);
+
+			/**
+			* Names the track of the calling thread, for example "test worker".
+			*/
+			void NameThread(const char* name);
+
+			/**
+			* Drops every span and restarts the timeline. Tracks keep their names.
+			*/
+			void Clear();
+
+			/**
+			* @return Number of spans recorded
+			*/
+			size_t GetCount();
+
+			/**
+			* Writes the spans as a Chrome trace event JSON object.
+			* @return TRUE if everything was written
+			*/
+			BOOL Write(FILE* out);
+
+			/**
+			* Writes the spans to a file, see above.
+			*/
+			BOOL Write(const char* path);
+	};
+
+	/**
+	* Records the lifetime of a scope as a span of a ParasiteTrace. Does
+	* nothing but keep a NULL pointer when there is no trace.
+	*/
+	class ParasiteTraceSpan
+	{
+		private:
+			ParasiteTrace* trace;		///< Trace to record to, NULL for none
+			const char* name;			///< What is being done
+			const char* item;			///< Item it is done for, or NULL
+			double start;				///< Clock when the span started
+			unsigned long long bytes;	///< Bytes handled
+
+		public:
+			ParasiteTraceSpan(ParasiteTrace* trace, const char* name, const char* item = NULL)
+				: trace(trace), name(name), item(item), start(trace ? ParasiteTrace::Now() : 0), bytes(0) {}
+
+			~ParasiteTraceSpan()
+			{
+				if(trace)
+					trace->Add(name, item, start, ParasiteTrace::Now(), bytes);
+			}
+
+			/**
+			* Sets the bytes handled in the span.
+			*/
+			void SetBytes(unsigned long long count) { bytes = count; }
+	};
+
+}
+
+#endif